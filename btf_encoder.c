@@ -14,6 +14,7 @@
 #include "elf_symtab.h"
 #include "btf_encoder.h"
 #include "gobuffer.h"
+#include "hash.h"
 
 #include <bpf/btf.h>
 #include <bpf/libbpf.h>
@@ -26,6 +27,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <pthread.h>
 #include <unistd.h>
 
 #include <errno.h>
@@ -33,7 +35,31 @@
 
 struct elf_function {
 	const char	*name;
-	bool		 generated;
+	uint32_t	 name_len;
+	uint32_t	 hash;
+};
+
+/*
+ * A function encoded in a fragment, idx is its index in elf_symbols->functions,
+ * [first_id, end_id) are the ids for its FUNC_PROTO, FUNC and DECL_TAGs.
+ */
+struct btf_fragment_func {
+	uint32_t	idx;
+	uint32_t	first_id;
+	uint32_t	end_id;
+};
+
+/*
+ * What a worker thread encoded for one CU, kept apart so that the fragments
+ * can be spliced in CU order at the end, see btf_encoder__add_fragments().
+ */
+struct btf_fragment {
+	struct btf		 *btf;
+	struct gobuffer		 percpu_secinfo;
+	struct btf_fragment_func *funcs;
+	uint32_t		 nr_funcs;
+	uint32_t		 allocated_funcs;
+	uint32_t		 seq;
 };
 
 #define MAX_PERCPU_VAR_CNT 4096
@@ -44,37 +70,63 @@ struct var_info {
 	uint32_t    sz;
 };
 
+/*
+ * What is collected from the ELF symtab: the functions, looked up by name
+ * in an open addressing hash table, and the per-CPU variables, sorted by
+ * address. It is read only after created
+ * and shared by all the encoders for the same ELF file, see
+ * elf_symbols__get(), so that it is built just once with -j.
+ */
+struct elf_symbols {
+	struct list_head  node;
+	Elf		  *elf;
+	int		  refcnt;
+	bool		  percpu_vars;
+	struct elf_symtab *symtab;
+	struct {
+		struct var_info vars[MAX_PERCPU_VAR_CNT];
+		int		var_cnt;
+		uint32_t	shndx;
+		uint64_t	base_addr;
+		uint64_t	sec_sz;
+	} percpu;
+	struct {
+		struct elf_function *entries;
+		int		    allocated;
+		int		    cnt;
+		uint32_t	    *table;	/* index + 1 in entries, 0 is an empty slot */
+		uint32_t	    table_mask;
+		uint32_t	    *claims;	/* The only mutable part, see elf_symbols__claim_function() */
+	} functions;
+};
+
 /*
  * cu: cu being processed.
+ * fragment: where the cu being processed is being encoded, if not directly in btf.
+ * generated: bitmap of the functions, in symbols->functions, already encoded.
  */
 struct btf_encoder {
 	struct list_head  node;
 	struct btf        *btf;
 	struct cu         *cu;
+	struct btf_fragment *fragment;
 	struct gobuffer   percpu_secinfo;
 	const char	  *filename;
-	struct elf_symtab *symtab;
+	struct elf_symbols *symbols;
+	uint8_t		  *generated;
 	bool		  has_index_type,
 			  need_index_type,
 			  skip_encoding_vars,
 			  raw_output,
 			  verbose,
 			  force,
-			  gen_floats,
-			  is_rel;
+			  gen_floats;
 	uint32_t	  array_index_id;
 	struct {
-		struct var_info vars[MAX_PERCPU_VAR_CNT];
-		int		var_cnt;
-		uint32_t	shndx;
-		uint64_t	base_addr;
-		uint64_t	sec_sz;
-	} percpu;
-	struct {
-		struct elf_function *entries;
+		struct btf_fragment *entries;
 		int		    allocated;
 		int		    cnt;
-	} functions;
+	} fragments;
 };
 
 void btf_encoders__add(struct list_head *encoders, struct btf_encoder *encoder)
@@ -677,27 +729,6 @@ static int32_t btf_encoder__add_var_secinfo(struct btf_encoder *encoder, uint32_
 	return gobuffer__add(&encoder->percpu_secinfo, &si, sizeof(si));
 }
 
-int32_t btf_encoder__add_encoder(struct btf_encoder *encoder, struct btf_encoder *other)
-{
-	struct gobuffer *var_secinfo_buf = &other->percpu_secinfo;
-	size_t sz = gobuffer__size(var_secinfo_buf);
-	uint16_t nr_var_secinfo = sz / sizeof(struct btf_var_secinfo);
-	uint32_t type_id;
-	uint32_t next_type_id = btf__type_cnt(encoder->btf);
-	int32_t i, id;
-	struct btf_var_secinfo *vsi;
-
-	for (i = 0; i < nr_var_secinfo; i++) {
-		vsi = (struct btf_var_secinfo *)var_secinfo_buf->entries + i;
-		type_id = next_type_id + vsi->type - 1; /* Type ID starts from 1 */
-		id = btf_encoder__add_var_secinfo(encoder, type_id, vsi->offset, vsi->size);
-		if (id < 0)
-			return id;
-	}
-
-	return btf__add_btf(encoder->btf, other->btf);
-}
-
 static int32_t btf_encoder__add_datasec(struct btf_encoder *encoder, const char *section_name)
 {
 	struct gobuffer *var_secinfo_buf = &encoder->percpu_secinfo;
@@ -768,53 +799,159 @@ static int32_t btf_encoder__add_decl_tag(struct btf_encoder *encoder, const char
  */
 #define KSYM_NAME_LEN 128
 
-static int functions_cmp(const void *_a, const void *_b)
-{
-	const struct elf_function *a = _a;
-	const struct elf_function *b = _b;
-
-	return strcmp(a->name, b->name);
-}
-
 #ifndef max
 #define max(x, y) ((x) < (y) ? (y) : (x))
 #endif
 
-static int btf_encoder__collect_function(struct btf_encoder *encoder, GElf_Sym *sym)
+static int elf_symbols__collect_function(struct elf_symbols *symbols, GElf_Sym *sym)
 {
 	struct elf_function *new;
 	const char *name;
+	size_t len;
 
 	if (elf_sym__type(sym) != STT_FUNC)
 		return 0;
-	name = elf_sym__name(sym, encoder->symtab);
+	name = elf_sym__name(sym, symbols->symtab);
 	if (!name)
 		return 0;
 
-	if (encoder->functions.cnt == encoder->functions.allocated) {
-		encoder->functions.allocated = max(1000, encoder->functions.allocated * 3 / 2);
-		new = realloc(encoder->functions.entries, encoder->functions.allocated * sizeof(*encoder->functions.entries));
+	if (symbols->functions.cnt == symbols->functions.allocated) {
+		symbols->functions.allocated = max(1000, symbols->functions.allocated * 3 / 2);
+		new = realloc(symbols->functions.entries, symbols->functions.allocated * sizeof(*symbols->functions.entries));
 		if (!new) {
 			/*
-			 * The cleanup - delete_functions is called
-			 * in btf_encoder__encode_cu error path.
+			 * The cleanup - elf_symbols__delete() is called
+			 * in elf_symbols__new() error path.
 			 */
 			return -1;
 		}
-		encoder->functions.entries = new;
+		symbols->functions.entries = new;
+	}
+
+	new = &symbols->functions.entries[symbols->functions.cnt++];
+	new->name = name;
+	new->hash = hash_str(name, &len);
+	new->name_len = len;
+	return 0;
+}
+
+static struct elf_function *elf_symbols__find_function(const struct elf_symbols *symbols, const char *name,
+						       uint32_t hash, size_t len)
+{
+	uint32_t slot;
+
+	for (slot = hash & symbols->functions.table_mask; symbols->functions.table[slot] != 0;
+	     slot = (slot + 1) & symbols->functions.table_mask) {
+		struct elf_function *func = &symbols->functions.entries[symbols->functions.table[slot] - 1];
+
+		if (func->hash == hash && func->name_len == len && memcmp(func->name, name, len) == 0)
+			return func;
+	}
+
+	return NULL;
+}
+
+/*
+ * Only the first function with a given name is added, that is the one that
+ * will be found by btf_encoder__find_function().
+ */
+static int elf_symbols__hash_functions(struct elf_symbols *symbols)
+{
+	uint32_t nr_slots = 1;
+	int i;
+
+	while (nr_slots < 2 * (uint32_t)symbols->functions.cnt)
+		nr_slots <<= 1;
+
+	symbols->functions.table = calloc(nr_slots, sizeof(symbols->functions.table[0]));
+	if (symbols->functions.table == NULL)
+		return -ENOMEM;
+
+	symbols->functions.table_mask = nr_slots - 1;
+
+	for (i = 0; i < symbols->functions.cnt; ++i) {
+		struct elf_function *func = &symbols->functions.entries[i];
+		uint32_t slot;
+
+		if (elf_symbols__find_function(symbols, func->name, func->hash, func->name_len))
+			continue;
+
+		slot = func->hash & symbols->functions.table_mask;
+		while (symbols->functions.table[slot] != 0)
+			slot = (slot + 1) & symbols->functions.table_mask;
+
+		symbols->functions.table[slot] = i + 1;
 	}
 
-	encoder->functions.entries[encoder->functions.cnt].name = name;
-	encoder->functions.entries[encoder->functions.cnt].generated = false;
-	encoder->functions.cnt++;
 	return 0;
 }
 
 static struct elf_function *btf_encoder__find_function(const struct btf_encoder *encoder, const char *name)
 {
-	struct elf_function key = { .name = name };
+	size_t len;
+	uint32_t hash = hash_str(name, &len);
 
-	return bsearch(&key, encoder->functions.entries, encoder->functions.cnt, sizeof(key), functions_cmp);
+	return elf_symbols__find_function(encoder->symbols, name, hash, len);
+}
+
+/*
+ * With -j the functions are claimed by the CU that will encode them, the one
+ * with the lowest seq wins, i.e. the one that would encode it when encoding
+ * serially, with the claim done atomically, as the table is shared by all
+ * the worker threads.
+ *
+ * Returns true if this CU is, for now, the one to encode the function. Since
+ * CUs are not processed in order, one that comes before it in the file may
+ * still take it, in which case it is dropped when splicing the fragments,
+ * see btf_encoder__add_fragment().
+ */
+static bool elf_symbols__claim_function(struct elf_symbols *symbols, uint32_t idx, uint32_t seq)
+{
+	uint32_t *claim = &symbols->functions.claims[idx];
+	uint32_t old = __atomic_load_n(claim, __ATOMIC_RELAXED);
+
+	while (seq < old) {
+		if (__atomic_compare_exchange_n(claim, &old, seq, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return true;
+	}
+
+	return old == seq;
+}
+
+static bool btf_encoder__test_and_set_generated(struct btf_encoder *encoder, uint32_t idx)
+{
+	uint8_t bit = 1 << (idx % 8);
+	bool generated = encoder->generated[idx / 8] & bit;
+
+	encoder->generated[idx / 8] |= bit;
+	return generated;
+}
+
+static void btf_encoder__clear_generated(struct btf_encoder *encoder, uint32_t idx)
+{
+	encoder->generated[idx / 8] &= ~(1 << (idx % 8));
+}
+
+static int btf_fragment__add_func(struct btf_fragment *fragment, uint32_t idx, uint32_t first_id, uint32_t end_id)
+{
+	struct btf_fragment_func *func;
+
+	if (fragment->nr_funcs == fragment->allocated_funcs) {
+		uint32_t allocated = max(16U, fragment->allocated_funcs * 2);
+
+		func = realloc(fragment->funcs, allocated * sizeof(*func));
+		if (func == NULL)
+			return -ENOMEM;
+
+		fragment->funcs		  = func;
+		fragment->allocated_funcs = allocated;
+	}
+
+	func = &fragment->funcs[fragment->nr_funcs++];
+	func->idx      = idx;
+	func->first_id = first_id;
+	func->end_id   = end_id;
+	return 0;
 }
 
 static bool btf_name_char_ok(char c, bool first)
@@ -1031,6 +1168,108 @@ static int btf_encoder__write_raw_file(struct btf_encoder *encoder)
 	return err;
 }
 
+static uint64_t align_up(uint64_t offset, uint64_t align)
+{
+	return align > 1 ? (offset + align - 1) & ~(align - 1) : offset;
+}
+
+/*
+ * Add a .BTF section to an ELF file opened with ELF_C_RDWR without moving
+ * anything else, as vmlinux and modules have to keep their layout: the
+ * section string table, now with ".BTF", then the new section and then the
+ * section headers go after everything else already in the file.
+ *
+ * The new section string table buffer is returned in *shstrtab_buf, to be
+ * freed after elf_end().
+ */
+static int elf__add_btf_section(Elf *elf, size_t strndx, const void *btf_data, size_t btf_size,
+				void **shstrtab_buf)
+{
+	static const char btf_name[] = ".BTF";
+	GElf_Shdr shdr_mem, *shdr;
+	GElf_Ehdr ehdr_mem, *ehdr;
+	Elf_Scn *scn = NULL, *strscn;
+	Elf_Data *data;
+	size_t shnum, name_off;
+	uint64_t end;
+	char *buf;
+
+	ehdr = gelf_getehdr(elf, &ehdr_mem);
+	if (ehdr == NULL || elf_getshdrnum(elf, &shnum) != 0)
+		return -1;
+
+	end = ehdr->e_phoff + (uint64_t)ehdr->e_phnum * ehdr->e_phentsize;
+	if (ehdr->e_shoff + (uint64_t)shnum * ehdr->e_shentsize > end)
+		end = ehdr->e_shoff + (uint64_t)shnum * ehdr->e_shentsize;
+
+	while ((scn = elf_nextscn(elf, scn)) != NULL) {
+		shdr = gelf_getshdr(scn, &shdr_mem);
+		if (shdr == NULL)
+			return -1;
+		if (shdr->sh_type != SHT_NOBITS && shdr->sh_offset + shdr->sh_size > end)
+			end = shdr->sh_offset + shdr->sh_size;
+	}
+
+	strscn = elf_getscn(elf, strndx);
+	if (strscn == NULL || (shdr = gelf_getshdr(strscn, &shdr_mem)) == NULL ||
+	    (data = elf_getdata(strscn, NULL)) == NULL)
+		return -1;
+
+	buf = malloc(data->d_size + sizeof(btf_name));
+	if (buf == NULL)
+		return -1;
+	*shstrtab_buf = buf;
+
+	name_off = data->d_size;
+	memcpy(buf, data->d_buf, name_off);
+	memcpy(buf + name_off, btf_name, sizeof(btf_name));
+	data->d_buf   = buf;
+	data->d_size += sizeof(btf_name);
+	elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY);
+
+	shdr->sh_offset = align_up(end, shdr->sh_addralign);
+	shdr->sh_size	= data->d_size;
+	end = shdr->sh_offset + shdr->sh_size;
+	if (!gelf_update_shdr(strscn, shdr))
+		return -1;
+
+	scn = elf_newscn(elf);
+	if (scn == NULL)
+		return -1;
+
+	data = elf_newdata(scn);
+	if (data == NULL)
+		return -1;
+
+	data->d_buf	= (void *)btf_data;
+	data->d_size	= btf_size;
+	data->d_type	= ELF_T_BYTE;
+	data->d_align	= 4;
+	data->d_version = EV_CURRENT;
+
+	shdr = gelf_getshdr(scn, &shdr_mem);
+	if (shdr == NULL)
+		return -1;
+
+	shdr->sh_name	   = name_off;
+	shdr->sh_type	   = SHT_PROGBITS;
+	shdr->sh_flags	   = 0;
+	shdr->sh_addr	   = 0;
+	shdr->sh_addralign = data->d_align;
+	shdr->sh_offset	   = align_up(end, shdr->sh_addralign);
+	shdr->sh_size	   = btf_size;
+	end = shdr->sh_offset + shdr->sh_size;
+	if (!gelf_update_shdr(scn, shdr))
+		return -1;
+
+	ehdr->e_shoff = align_up(end, gelf_getclass(elf) == ELFCLASS64 ? 8 : 4);
+	if (!gelf_update_ehdr(elf, ehdr))
+		return -1;
+
+	elf_flagelf(elf, ELF_C_SET, ELF_F_LAYOUT);
+	return 0;
+}
+
 static int btf_encoder__write_elf(struct btf_encoder *encoder)
 {
 	struct btf *btf = encoder->btf;
@@ -1041,6 +1280,7 @@ static int btf_encoder__write_elf(struct btf_encoder *encoder)
 	Elf *elf = NULL;
 	const void *raw_btf_data;
 	uint32_t raw_btf_size;
+	void *shstrtab_buf = NULL;
 	int fd, err = -1;
 	size_t strndx;
 
@@ -1093,41 +1333,12 @@ static int btf_encoder__write_elf(struct btf_encoder *encoder)
 		else
 			elf_error("elf_update failed");
 	} else {
-		const char *llvm_objcopy;
-		char tmp_fn[PATH_MAX];
-		char cmd[PATH_MAX * 2];
-
-		llvm_objcopy = getenv("LLVM_OBJCOPY");
-		if (!llvm_objcopy)
-			llvm_objcopy = "llvm-objcopy";
-
-		/* Use objcopy to add a .BTF section */
-		snprintf(tmp_fn, sizeof(tmp_fn), "%s.btf", filename);
-		close(fd);
-		fd = creat(tmp_fn, S_IRUSR | S_IWUSR);
-		if (fd == -1) {
-			fprintf(stderr, "%s: open(%s) failed!\n", __func__,
-				tmp_fn);
-			goto out;
-		}
-
-		if (write(fd, raw_btf_data, raw_btf_size) != raw_btf_size) {
-			fprintf(stderr, "%s: write of %d bytes to '%s' failed: %d!\n",
-				__func__, raw_btf_size, tmp_fn, errno);
-			goto unlink;
-		}
-
-		snprintf(cmd, sizeof(cmd), "%s --add-section .BTF=%s %s",
-			 llvm_objcopy, tmp_fn, filename);
-		if (system(cmd)) {
-			fprintf(stderr, "%s: failed to add .BTF section to '%s': %d!\n",
-				__func__, filename, errno);
-			goto unlink;
-		}
-
-		err = 0;
-	unlink:
-		unlink(tmp_fn);
+		/* Append a new .BTF section */
+		if (elf__add_btf_section(elf, strndx, raw_btf_data, raw_btf_size, &shstrtab_buf) == 0 &&
+		    elf_update(elf, ELF_C_WRITE) >= 0)
+			err = 0;
+		else
+			elf_error("failed to add .BTF section to '%s'", filename);
 	}
 
 out:
@@ -1135,6 +1346,7 @@ out:
 		close(fd);
 	if (elf)
 		elf_end(elf);
+	free(shstrtab_buf);
 	return err;
 }
 
@@ -1174,9 +1386,10 @@ static int percpu_var_cmp(const void *_a, const void *_b)
 
 static bool btf_encoder__percpu_var_exists(struct btf_encoder *encoder, uint64_t addr, uint32_t *sz, const char **name)
 {
+	const struct elf_symbols *symbols = encoder->symbols;
 	struct var_info key = { .addr = addr };
-	const struct var_info *p = bsearch(&key, encoder->percpu.vars, encoder->percpu.var_cnt,
-					   sizeof(encoder->percpu.vars[0]), percpu_var_cmp);
+	const struct var_info *p = bsearch(&key, symbols->percpu.vars, symbols->percpu.var_cnt,
+					   sizeof(symbols->percpu.vars[0]), percpu_var_cmp);
 	if (!p)
 		return false;
 
@@ -1185,14 +1398,15 @@ static bool btf_encoder__percpu_var_exists(struct btf_encoder *encoder, uint64_t
 	return true;
 }
 
-static int btf_encoder__collect_percpu_var(struct btf_encoder *encoder, GElf_Sym *sym, size_t sym_sec_idx)
+static int elf_symbols__collect_percpu_var(struct elf_symbols *symbols, GElf_Sym *sym, size_t sym_sec_idx,
+					   bool is_rel, bool verbose, bool force)
 {
 	const char *sym_name;
 	uint64_t addr;
 	uint32_t size;
 
 	/* compare a symbol's shndx to determine if it's a percpu variable */
-	if (sym_sec_idx != encoder->percpu.shndx)
+	if (sym_sec_idx != symbols->percpu.shndx)
 		return 0;
 	if (elf_sym__type(sym) != STT_OBJECT)
 		return 0;
@@ -1203,73 +1417,176 @@ static int btf_encoder__collect_percpu_var(struct btf_encoder *encoder, GElf_Sym
 	if (!size)
 		return 0; /* ignore zero-sized symbols */
 
-	sym_name = elf_sym__name(sym, encoder->symtab);
+	sym_name = elf_sym__name(sym, symbols->symtab);
 	if (!btf_name_valid(sym_name)) {
 		dump_invalid_symbol("Found symbol of invalid name when encoding btf",
-				    sym_name, encoder->verbose, encoder->force);
-		if (encoder->force)
+				    sym_name, verbose, force);
+		if (force)
 			return 0;
 		return -1;
 	}
 
-	if (encoder->verbose)
+	if (verbose)
 		printf("Found per-CPU symbol '%s' at address 0x%" PRIx64 "\n", sym_name, addr);
 
 	/* Make sure addr is section-relative. For kernel modules (which are
 	 * ET_REL files) this is already the case. For vmlinux (which is an
 	 * ET_EXEC file) we need to subtract the section address.
 	 */
-	if (!encoder->is_rel)
-		addr -= encoder->percpu.base_addr;
+	if (!is_rel)
+		addr -= symbols->percpu.base_addr;
 
-	if (encoder->percpu.var_cnt == MAX_PERCPU_VAR_CNT) {
+	if (symbols->percpu.var_cnt == MAX_PERCPU_VAR_CNT) {
 		fprintf(stderr, "Reached the limit of per-CPU variables: %d\n",
 			MAX_PERCPU_VAR_CNT);
 		return -1;
 	}
-	encoder->percpu.vars[encoder->percpu.var_cnt].addr = addr;
-	encoder->percpu.vars[encoder->percpu.var_cnt].sz = size;
-	encoder->percpu.vars[encoder->percpu.var_cnt].name = sym_name;
-	encoder->percpu.var_cnt++;
+	symbols->percpu.vars[symbols->percpu.var_cnt].addr = addr;
+	symbols->percpu.vars[symbols->percpu.var_cnt].sz = size;
+	symbols->percpu.vars[symbols->percpu.var_cnt].name = sym_name;
+	symbols->percpu.var_cnt++;
 
 	return 0;
 }
 
-static int btf_encoder__collect_symbols(struct btf_encoder *encoder, bool collect_percpu_vars)
+static int elf_symbols__collect(struct elf_symbols *symbols, bool is_rel, bool verbose, bool force)
 {
 	Elf32_Word sym_sec_idx;
 	uint32_t core_id;
 	GElf_Sym sym;
 
 	/* cache variables' addresses, preparing for searching in symtab. */
-	encoder->percpu.var_cnt = 0;
+	symbols->percpu.var_cnt = 0;
 
 	/* search within symtab for percpu variables */
-	elf_symtab__for_each_symbol_index(encoder->symtab, core_id, sym, sym_sec_idx) {
-		if (collect_percpu_vars && btf_encoder__collect_percpu_var(encoder, &sym, sym_sec_idx))
+	elf_symtab__for_each_symbol_index(symbols->symtab, core_id, sym, sym_sec_idx) {
+		if (symbols->percpu_vars &&
+		    elf_symbols__collect_percpu_var(symbols, &sym, sym_sec_idx, is_rel, verbose, force))
 			return -1;
-		if (btf_encoder__collect_function(encoder, &sym))
+		if (elf_symbols__collect_function(symbols, &sym))
 			return -1;
 	}
 
-	if (collect_percpu_vars) {
-		if (encoder->percpu.var_cnt)
-			qsort(encoder->percpu.vars, encoder->percpu.var_cnt, sizeof(encoder->percpu.vars[0]), percpu_var_cmp);
+	if (symbols->percpu_vars) {
+		if (symbols->percpu.var_cnt)
+			qsort(symbols->percpu.vars, symbols->percpu.var_cnt, sizeof(symbols->percpu.vars[0]), percpu_var_cmp);
 
-		if (encoder->verbose)
-			printf("Found %d per-CPU variables!\n", encoder->percpu.var_cnt);
+		if (verbose)
+			printf("Found %d per-CPU variables!\n", symbols->percpu.var_cnt);
 	}
 
-	if (encoder->functions.cnt) {
-		qsort(encoder->functions.entries, encoder->functions.cnt, sizeof(encoder->functions.entries[0]),
-		      functions_cmp);
-		if (encoder->verbose)
-			printf("Found %d functions!\n", encoder->functions.cnt);
+	if (symbols->functions.cnt) {
+		if (elf_symbols__hash_functions(symbols))
+			return -1;
+
+		symbols->functions.claims = malloc(symbols->functions.cnt * sizeof(symbols->functions.claims[0]));
+		if (symbols->functions.claims == NULL)
+			return -1;
+		memset(symbols->functions.claims, 0xff, symbols->functions.cnt * sizeof(symbols->functions.claims[0]));
+		if (verbose)
+			printf("Found %d functions!\n", symbols->functions.cnt);
 	}
 
 	return 0;
 }
 
+static void elf_symbols__delete(struct elf_symbols *symbols)
+{
+	if (symbols == NULL)
+		return;
+
+	elf_symtab__delete(symbols->symtab);
+	free(symbols->functions.entries);
+	free(symbols->functions.table);
+	free(symbols->functions.claims);
+	free(symbols);
+}
+
+static struct elf_symbols *elf_symbols__new(Elf *elf, const char *filename, bool percpu_vars,
+					    bool is_rel, bool verbose, bool force)
+{
+	struct elf_symbols *symbols = zalloc(sizeof(*symbols));
+
+	if (symbols == NULL)
+		return NULL;
+
+	symbols->elf	     = elf;
+	symbols->refcnt	     = 1;
+	symbols->percpu_vars = percpu_vars;
+
+	symbols->symtab = elf_symtab__new(NULL, elf);
+	if (!symbols->symtab) {
+		if (verbose)
+			printf("%s: '%s' doesn't have symtab.\n", __func__, filename);
+		return symbols;
+	}
+
+	/* find percpu section's shndx */
+
+	GElf_Shdr shdr;
+	Elf_Scn *sec = elf_section_by_name(elf, &shdr, PERCPU_SECTION, NULL);
+
+	if (!sec) {
+		if (verbose)
+			printf("%s: '%s' doesn't have '%s' section\n", __func__, filename, PERCPU_SECTION);
+	} else {
+		symbols->percpu.shndx	  = elf_ndxscn(sec);
+		symbols->percpu.base_addr = shdr.sh_addr;
+		symbols->percpu.sec_sz	  = shdr.sh_size;
+	}
+
+	if (elf_symbols__collect(symbols, is_rel, verbose, force)) {
+		elf_symbols__delete(symbols);
+		return NULL;
+	}
+
+	return symbols;
+}
+
+static LIST_HEAD(elf_symbols__list);
+static pthread_mutex_t elf_symbols__lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Find the symbols for this ELF file, collecting them if this is the first
+ * encoder for it, other threads creating their encoders wait for that.
+ */
+static struct elf_symbols *elf_symbols__get(Elf *elf, const char *filename, bool percpu_vars,
+					    bool is_rel, bool verbose, bool force)
+{
+	struct elf_symbols *symbols;
+
+	pthread_mutex_lock(&elf_symbols__lock);
+
+	list_for_each_entry(symbols, &elf_symbols__list, node) {
+		if (symbols->elf == elf && symbols->percpu_vars == percpu_vars) {
+			++symbols->refcnt;
+			goto out_unlock;
+		}
+	}
+
+	symbols = elf_symbols__new(elf, filename, percpu_vars, is_rel, verbose, force);
+	if (symbols)
+		list_add_tail(&symbols->node, &elf_symbols__list);
+out_unlock:
+	pthread_mutex_unlock(&elf_symbols__lock);
+	return symbols;
+}
+
+static void elf_symbols__put(struct elf_symbols *symbols)
+{
+	if (symbols == NULL)
+		return;
+
+	pthread_mutex_lock(&elf_symbols__lock);
+	if (--symbols->refcnt == 0)
+		list_del(&symbols->node);
+	else
+		symbols = NULL;
+	pthread_mutex_unlock(&elf_symbols__lock);
+
+	elf_symbols__delete(symbols);
+}
+
 static bool ftype__has_arg_names(const struct ftype *ftype)
 {
 	struct parameter *param;
@@ -1288,7 +1605,7 @@ static int btf_encoder__encode_cu_variables(struct btf_encoder *encoder, uint32_
 	struct tag *pos;
 	int err = -1;
 
-	if (encoder->percpu.shndx == 0 || !encoder->symtab)
+	if (encoder->symbols->percpu.shndx == 0 || !encoder->symbols->symtab)
 		return 0;
 
 	if (encoder->verbose)
@@ -1318,9 +1635,10 @@ static int btf_encoder__encode_cu_variables(struct btf_encoder *encoder, uint32_
 		 * always contains virtual symbol addresses, so subtract
 		 * the section address unconditionally.
 		 */
-		if (addr < encoder->percpu.base_addr || addr >= encoder->percpu.base_addr + encoder->percpu.sec_sz)
+		if (addr < encoder->symbols->percpu.base_addr ||
+		    addr >= encoder->symbols->percpu.base_addr + encoder->symbols->percpu.sec_sz)
 			continue;
-		addr -= encoder->percpu.base_addr;
+		addr -= encoder->symbols->percpu.base_addr;
 
 		if (!btf_encoder__percpu_var_exists(encoder, addr, &size, &name))
 			continue; /* not a per-CPU variable */
@@ -1438,8 +1756,6 @@ struct btf_encoder *btf_encoder__new(struct cu *cu, const char *detached_filenam
 			goto out_delete;
 		}
 
-		encoder->is_rel = ehdr.e_type == ET_REL;
-
 		switch (ehdr.e_ident[EI_DATA]) {
 		case ELFDATA2LSB:
 			btf__set_endianness(encoder->btf, BTF_LITTLE_ENDIAN);
@@ -1452,34 +1768,21 @@ struct btf_encoder *btf_encoder__new(struct cu *cu, const char *detached_filenam
 			goto out_delete;
 		}
 
-		encoder->symtab = elf_symtab__new(NULL, cu->elf);
-		if (!encoder->symtab) {
-			if (encoder->verbose)
-				printf("%s: '%s' doesn't have symtab.\n", __func__, cu->filename);
-			goto out;
-		}
-
-		/* find percpu section's shndx */
-
-		GElf_Shdr shdr;
-		Elf_Scn *sec = elf_section_by_name(cu->elf, &shdr, PERCPU_SECTION, NULL);
+		encoder->symbols = elf_symbols__get(cu->elf, cu->filename, !encoder->skip_encoding_vars,
+						    ehdr.e_type == ET_REL, encoder->verbose, encoder->force);
+		if (encoder->symbols == NULL)
+			goto out_delete;
 
-		if (!sec) {
-			if (encoder->verbose)
-				printf("%s: '%s' doesn't have '%s' section\n", __func__, cu->filename, PERCPU_SECTION);
-		} else {
-			encoder->percpu.shndx	  = elf_ndxscn(sec);
-			encoder->percpu.base_addr = shdr.sh_addr;
-			encoder->percpu.sec_sz	  = shdr.sh_size;
+		if (encoder->symbols->functions.cnt) {
+			encoder->generated = zalloc((encoder->symbols->functions.cnt + 7) / 8);
+			if (encoder->generated == NULL)
+				goto out_delete;
 		}
 
-		if (btf_encoder__collect_symbols(encoder, !encoder->skip_encoding_vars))
-			goto out_delete;
-
 		if (encoder->verbose)
 			printf("File %s:\n", cu->filename);
 	}
-out:
+
 	return encoder;
 
 out_delete:
@@ -1489,6 +1792,8 @@ out_delete:
 
 void btf_encoder__delete(struct btf_encoder *encoder)
 {
+	int i;
+
 	if (encoder == NULL)
 		return;
 
@@ -1496,11 +1801,19 @@ void btf_encoder__delete(struct btf_encoder *encoder)
 	zfree(&encoder->filename);
 	btf__free(encoder->btf);
 	encoder->btf = NULL;
-	elf_symtab__delete(encoder->symtab);
+	elf_symbols__put(encoder->symbols);
+	encoder->symbols = NULL;
+	zfree(&encoder->generated);
+
+	for (i = 0; i < encoder->fragments.cnt; ++i) {
+		struct btf_fragment *fragment = &encoder->fragments.entries[i];
 
-	encoder->functions.allocated = encoder->functions.cnt = 0;
-	free(encoder->functions.entries);
-	encoder->functions.entries = NULL;
+		btf__free(fragment->btf);
+		__gobuffer__delete(&fragment->percpu_secinfo);
+		free(fragment->funcs);
+	}
+	encoder->fragments.allocated = encoder->fragments.cnt = 0;
+	zfree(&encoder->fragments.entries);
 
 	free(encoder);
 }
@@ -1586,6 +1899,8 @@ int btf_encoder__encode_cu(struct btf_encoder *encoder, struct cu *cu, struct co
 
 	cu__for_each_function(cu, core_id, fn) {
 		int btf_fnproto_id, btf_fn_id;
+		struct elf_function *func = NULL;
+		uint32_t first_id, func_idx;
 		const char *name;
 
 		/*
@@ -1599,8 +1914,7 @@ int btf_encoder__encode_cu(struct btf_encoder *encoder, struct cu *cu, struct co
 			continue;
 		if (!ftype__has_arg_names(&fn->proto))
 			continue;
-		if (encoder->functions.cnt) {
-			struct elf_function *func;
+		if (encoder->symbols->functions.cnt) {
 			const char *name;
 
 			name = function__name(fn);
@@ -1608,14 +1922,21 @@ int btf_encoder__encode_cu(struct btf_encoder *encoder, struct cu *cu, struct co
 				continue;
 
 			func = btf_encoder__find_function(encoder, name);
-			if (!func || func->generated)
+			if (!func)
+				continue;
+
+			func_idx = func - encoder->symbols->functions.entries;
+			if (encoder->fragment &&
+			    !elf_symbols__claim_function(encoder->symbols, func_idx, encoder->fragment->seq))
+				continue;
+			if (btf_encoder__test_and_set_generated(encoder, func_idx))
 				continue;
-			func->generated = true;
 		} else {
 			if (!fn->external)
 				continue;
 		}
 
+		first_id = btf__type_cnt(encoder->btf);
 		btf_fnproto_id = btf_encoder__add_func_proto(encoder, &fn->proto, type_id_off);
 		name = function__name(fn);
 		btf_fn_id = btf_encoder__add_ref_type(encoder, BTF_KIND_FUNC, btf_fnproto_id, name, false);
@@ -1633,6 +1954,13 @@ int btf_encoder__encode_cu(struct btf_encoder *encoder, struct cu *cu, struct co
 				goto out;
 			}
 		}
+
+		if (encoder->fragment && func &&
+		    btf_fragment__add_func(encoder->fragment, func_idx,
+					   first_id, btf__type_cnt(encoder->btf))) {
+			err = -1;
+			goto out;
+		}
 	}
 
 	if (!encoder->skip_encoding_vars)
@@ -1642,6 +1970,245 @@ out:
 	return err;
 }
 
+/*
+ * Encode the cu in a new fragment, not in encoder->btf, to be later spliced
+ * into the primary encoder by btf_encoder__add_fragments(). Its contents
+ * don't depend on which other CUs this encoder got, that is the index type
+ * is looked up again and the functions it encoded are cleared from the
+ * generated bitmap after it is done, what is encoded across threads is
+ * decided by elf_symbols__claim_function().
+ */
+int btf_encoder__encode_cu_fragment(struct btf_encoder *encoder, struct cu *cu, struct conf_load *conf_load)
+{
+	struct gobuffer percpu_secinfo = encoder->percpu_secinfo;
+	struct btf *btf = encoder->btf;
+	struct btf_fragment *fragment;
+	uint32_t i;
+	int err;
+
+	if (encoder->fragments.cnt == encoder->fragments.allocated) {
+		int allocated = max(256, encoder->fragments.allocated * 2);
+
+		fragment = realloc(encoder->fragments.entries, allocated * sizeof(*fragment));
+		if (fragment == NULL)
+			return -ENOMEM;
+
+		encoder->fragments.entries   = fragment;
+		encoder->fragments.allocated = allocated;
+	}
+
+	fragment = &encoder->fragments.entries[encoder->fragments.cnt];
+	memset(fragment, 0, sizeof(*fragment));
+	fragment->seq = cu->seq;
+	fragment->btf = btf__new_empty();
+	if (fragment->btf == NULL)
+		return -ENOMEM;
+	++encoder->fragments.cnt;
+
+	encoder->btf		 = fragment->btf;
+	encoder->fragment	 = fragment;
+	encoder->has_index_type	 = false;
+	encoder->need_index_type = false;
+	memset(&encoder->percpu_secinfo, 0, sizeof(encoder->percpu_secinfo));
+
+	err = btf_encoder__encode_cu(encoder, cu, conf_load);
+
+	fragment->percpu_secinfo = encoder->percpu_secinfo;
+	encoder->percpu_secinfo	 = percpu_secinfo;
+	encoder->fragment	 = NULL;
+	encoder->btf		 = btf;
+
+	for (i = 0; i < fragment->nr_funcs; ++i)
+		btf_encoder__clear_generated(encoder, fragment->funcs[i].idx);
+
+	return err;
+}
+
+static int btf_fragment__cmp(const void *a, const void *b)
+{
+	const struct btf_fragment *fa = *(const struct btf_fragment **)a,
+				  *fb = *(const struct btf_fragment **)b;
+
+	return fa->seq < fb->seq ? -1 : fa->seq > fb->seq ? 1 : 0;
+}
+
+static int btf_type__remap_id(uint32_t *id, const uint32_t *ids, uint32_t nr_ids)
+{
+	if (*id == 0) /* void */
+		return 0;
+
+	if (*id >= nr_ids || ids[*id] == UINT32_MAX)
+		return -EINVAL;
+
+	*id = ids[*id];
+	return 0;
+}
+
+static int btf_type__remap_ids(struct btf_type *t, const uint32_t *ids, uint32_t nr_ids)
+{
+	int i, vlen = btf_vlen(t), err = 0;
+
+	switch (btf_kind(t)) {
+	case BTF_KIND_INT:
+	case BTF_KIND_FLOAT:
+	case BTF_KIND_FWD:
+	case BTF_KIND_ENUM:
+	case BTF_KIND_ENUM64:
+		break;
+	case BTF_KIND_PTR:
+	case BTF_KIND_TYPEDEF:
+	case BTF_KIND_VOLATILE:
+	case BTF_KIND_CONST:
+	case BTF_KIND_RESTRICT:
+	case BTF_KIND_FUNC:
+	case BTF_KIND_VAR:
+	case BTF_KIND_DECL_TAG:
+	case BTF_KIND_TYPE_TAG:
+		err = btf_type__remap_id(&t->type, ids, nr_ids);
+		break;
+	case BTF_KIND_ARRAY:
+		err = btf_type__remap_id(&btf_array(t)->type, ids, nr_ids) ?:
+		      btf_type__remap_id(&btf_array(t)->index_type, ids, nr_ids);
+		break;
+	case BTF_KIND_STRUCT:
+	case BTF_KIND_UNION: {
+		struct btf_member *member = btf_members(t);
+
+		for (i = 0; i < vlen && !err; ++i)
+			err = btf_type__remap_id(&member[i].type, ids, nr_ids);
+		break;
+	}
+	case BTF_KIND_FUNC_PROTO: {
+		struct btf_param *param = btf_params(t);
+
+		err = btf_type__remap_id(&t->type, ids, nr_ids);
+		for (i = 0; i < vlen && !err; ++i)
+			err = btf_type__remap_id(&param[i].type, ids, nr_ids);
+		break;
+	}
+	default: /* Fragments don't have DATASECs, that is only added at btf_encoder__encode() */
+		err = -EINVAL;
+		break;
+	}
+
+	return err;
+}
+
+/*
+ * Append the types in fragment, that was encoded without a base, so ids
+ * start at 1, to encoder->btf, dropping the functions that ended up claimed
+ * by a previous CU, just like btf_encoder__encode_cu() does when encoding
+ * all the CUs in order.
+ */
+static int btf_encoder__add_fragment(struct btf_encoder *encoder, struct btf_fragment *fragment)
+{
+	struct gobuffer *var_secinfo_buf = &fragment->percpu_secinfo;
+	uint16_t nr_var_secinfo = gobuffer__size(var_secinfo_buf) / sizeof(struct btf_var_secinfo);
+	uint32_t nr_types = btf__type_cnt(fragment->btf), next_type_id, id, i;
+	uint32_t *ids = calloc(nr_types, sizeof(*ids));
+	int err = -ENOMEM;
+
+	if (ids == NULL)
+		return err;
+
+	for (i = 0; i < fragment->nr_funcs; ++i) {
+		struct btf_fragment_func *func = &fragment->funcs[i];
+
+		if (encoder->symbols->functions.claims[func->idx] == fragment->seq &&
+		    !btf_encoder__test_and_set_generated(encoder, func->idx))
+			continue;
+
+		for (id = func->first_id; id < func->end_id; ++id)
+			ids[id] = UINT32_MAX;
+	}
+
+	next_type_id = btf__type_cnt(encoder->btf);
+	for (id = 1; id < nr_types; ++id) {
+		if (ids[id] != UINT32_MAX)
+			ids[id] = next_type_id++;
+	}
+
+	for (id = 1; id < nr_types; ++id) {
+		int32_t new_id;
+
+		if (ids[id] == UINT32_MAX)
+			continue;
+
+		new_id = btf__add_type(encoder->btf, fragment->btf, btf__type_by_id(fragment->btf, id));
+		if (new_id < 0) {
+			err = new_id;
+			goto out;
+		}
+
+		err = btf_type__remap_ids((struct btf_type *)btf__type_by_id(encoder->btf, new_id), ids, nr_types);
+		if (err) {
+			fprintf(stderr, "%s: type [%u] refers to a dropped or invalid type\n", __func__, id);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr_var_secinfo; i++) {
+		struct btf_var_secinfo *vsi = (struct btf_var_secinfo *)var_secinfo_buf->entries + i;
+		uint32_t type_id = vsi->type;
+
+		err = btf_type__remap_id(&type_id, ids, nr_types);
+		if (err)
+			goto out;
+
+		err = btf_encoder__add_var_secinfo(encoder, type_id, vsi->offset, vsi->size);
+		if (err < 0)
+			goto out;
+	}
+
+	err = 0;
+out:
+	free(ids);
+	return err;
+}
+
+/*
+ * Splice the fragments encoded by the worker threads into encoder in CU
+ * order, so that what is encoded doesn't depend on which thread got which CU
+ * and is the same as when all the CUs are encoded by just one thread.
+ *
+ * The encoders in others must have been created for the same ELF file, as
+ * the functions claimed by each fragment are referred to by their index in
+ * the elf_symbols they all share.
+ */
+int btf_encoder__add_fragments(struct btf_encoder *encoder, struct btf_encoder **others, int nr_others)
+{
+	struct btf_fragment **fragments;
+	int nr_fragments = 0, i, j, err = 0;
+
+	for (i = 0; i < nr_others; ++i)
+		nr_fragments += others[i]->fragments.cnt;
+
+	if (nr_fragments == 0)
+		return 0;
+
+	fragments = malloc(nr_fragments * sizeof(*fragments));
+	if (fragments == NULL)
+		return -ENOMEM;
+
+	for (i = 0, nr_fragments = 0; i < nr_others; ++i) {
+		for (j = 0; j < others[i]->fragments.cnt; ++j)
+			fragments[nr_fragments++] = &others[i]->fragments.entries[j];
+	}
+
+	qsort(fragments, nr_fragments, sizeof(*fragments), btf_fragment__cmp);
+
+	for (i = 0; i < nr_fragments && !err; ++i) {
+		err = btf_encoder__add_fragment(encoder, fragments[i]);
+
+		// Not needed anymore, keep the memory footprint down
+		btf__free(fragments[i]->btf);
+		fragments[i]->btf = NULL;
+	}
+
+	free(fragments);
+	return err;
+}
+
 struct btf *btf_encoder__btf(struct btf_encoder *encoder)
 {
 	return encoder->btf;
@@ -23,6 +23,8 @@ int btf_encoder__encode(struct btf_encoder *encoder);
 
 int btf_encoder__encode_cu(struct btf_encoder *encoder, struct cu *cu, struct conf_load *conf_load);
 
+int btf_encoder__encode_cu_fragment(struct btf_encoder *encoder, struct cu *cu, struct conf_load *conf_load);
+
 void btf_encoders__add(struct list_head *encoders, struct btf_encoder *encoder);
 
 struct btf_encoder *btf_encoders__first(struct list_head *encoders);
@@ -31,6 +33,6 @@ struct btf_encoder *btf_encoders__next(struct btf_encoder *encoder);
 
 struct btf *btf_encoder__btf(struct btf_encoder *encoder);
 
-int btf_encoder__add_encoder(struct btf_encoder *encoder, struct btf_encoder *other);
+int btf_encoder__add_fragments(struct btf_encoder *encoder, struct btf_encoder **others, int nr_others);
 
 #endif /* _BTF_ENCODER_H_ */
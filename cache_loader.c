@@ -0,0 +1,1771 @@
+/*
+  SPDX-License-Identifier: GPL-2.0-only
+
+  Persistent cache of what the DWARF loader produces, keyed by build-id.
+
+  The first time a file is loaded with --cache the DWARF loader does the
+  work and each CU it hands to the tool is also serialized to
+  $XDG_CACHE_HOME/dwarves/BUILD_ID-CONF_FLAGS, the next time the CUs are
+  rebuilt straight from that file, without touching libdw.
+
+  Only what is kept in memory after the DWARF loader finalizes a CU is
+  stored, with the ids in the types, tags and functions tables preserved, so
+  that tag->type and friends need no recoding. CUs with things that are not
+  representable (namespaces, LLVM annotations, vtables, etc) make the whole
+  file not cacheable, in that case we just keep using the DWARF loader.
+
+  The file is mmap'ed and the records, all 8 bytes aligned, are used in
+  place, strings included, the tags are rebuilt from them as the tools want
+  the usual struct tag lists.
+
+  The CUs are written in the order they are in the DWARF file, so the same
+  file always produces the same cache. A cache file is used if its header
+  matches the build-id of the file, the conf_load flags and the size of the
+  cache file, the CUs also have a checksum, checked only for the ones loaded.
+*/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dwarf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dutil.h"
+#include "dwarves.h"
+
+extern struct debug_fmt_ops dwarf__ops, cache__ops;
+
+#define CACHE_MAGIC	   0x48434850 /* "PHCH" */
+#define CACHE_VERSION	   2
+#define CACHE_BYTE_ORDER   0x0102
+#define CACHE_MAX_BUILD_ID 64
+#define CACHE_ALIGN	   8
+
+struct cache_file_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t byte_order;
+	uint32_t conf_flags;
+	uint32_t nr_cus;
+	uint64_t size;		/* Of the whole cache file */
+	uint8_t	 build_id_len;
+	uint8_t	 pad[7];
+	uint8_t	 build_id[CACHE_MAX_BUILD_ID];	/* From the CUs */
+	char	 sbuild_id[SBUILD_ID_SIZE];	/* Of the file, what the cache is looked up by */
+	uint8_t	 pad2[(CACHE_ALIGN - SBUILD_ID_SIZE % CACHE_ALIGN) % CACHE_ALIGN];
+};
+
+struct cache_cu_header {
+	uint32_t size;		/* header + records + strings */
+	uint32_t nr_records;	/* records in cu->tags, children not counted */
+	uint32_t records_size;
+	uint32_t strings_size;
+	uint32_t name;
+	uint32_t unspecified_type;
+	uint16_t language;
+	uint8_t	 addr_size;
+	uint8_t	 little_endian;
+	uint32_t pad;
+	uint64_t checksum;	/* Of the records and strings */
+};
+
+enum cache_record_flags {
+	CACHE_RECORD__IN_TABLE	= 1 << 0,
+	CACHE_RECORD__TOP_LEVEL = 1 << 1,
+};
+
+/*
+ * Followed by a per tag kind payload and then, for the ones with children,
+ * the records for those children.
+ */
+struct cache_record {
+	uint16_t tag;
+	uint8_t	 flags;
+	uint8_t	 pad;
+	uint32_t id;
+	uint32_t type;
+	uint32_t name;
+};
+
+struct cache_base_type {
+	uint16_t bit_size;
+	uint8_t	 name_has_encoding:1;
+	uint8_t	 is_signed:1;
+	uint8_t	 is_bool:1;
+	uint8_t	 is_varargs:1;
+	uint8_t	 float_type;
+};
+
+struct cache_array_type {
+	uint8_t	 dimensions;
+	uint8_t	 is_vector;
+	uint16_t pad;
+	/* followed by dimensions uint32_t entries */
+};
+
+struct cache_type {
+	uint32_t size;
+	uint32_t alignment;
+	uint16_t nr_tags;
+	uint8_t	 declaration:1;
+	uint8_t	 is_signed_enum:1;
+	uint8_t	 pad;
+};
+
+struct cache_class_member {
+	uint64_t byte_size;
+	uint64_t const_value;
+	uint32_t bit_offset;
+	uint32_t bit_size;
+	uint32_t byte_offset;
+	uint32_t alignment;
+	int8_t	 bitfield_offset;
+	uint8_t	 bitfield_size;
+	uint8_t	 accessibility;
+	uint8_t	 virtuality;
+	uint8_t	 is_static:1;
+	uint8_t	 has_bit_offset:1;
+	uint8_t	 pad[3];
+};
+
+struct cache_ftype {
+	uint16_t nr_parms;
+	uint8_t	 unspec_parms;
+	uint8_t	 pad;
+};
+
+struct cache_function {
+	uint64_t addr;
+	uint32_t size;
+	uint32_t linkage_name;
+	int32_t	 vtable_entry;
+	uint16_t nr_parms;
+	uint16_t nr_lexblock_tags;
+	uint8_t	 inlined;
+	uint8_t	 accessibility;
+	uint8_t	 virtuality;
+	uint8_t	 unspec_parms:1;
+	uint8_t	 abstract_origin:1;
+	uint8_t	 external:1;
+	uint8_t	 declaration:1;
+	uint32_t pad;
+};
+
+struct cache_lexblock {
+	uint64_t addr;
+	uint32_t size;
+	uint32_t nr_tags;
+};
+
+struct cache_variable {
+	uint64_t addr;
+	uint32_t spec;		/* tags table id + 1, 0 if none */
+	uint8_t	 scope;
+	uint8_t	 external:1;
+	uint8_t	 declaration:1;
+	uint8_t	 has_specification:1;
+	uint16_t pad;
+};
+
+struct cache_inline_expansion {
+	uint64_t addr;
+	uint64_t size;
+	uint64_t high_pc;
+};
+
+/*
+ * FNV-1a like, but a word at a time, just to catch truncated or otherwise
+ * corrupted cache files, not meant to withstand anything else.
+ */
+static uint64_t cache__hash(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+		uint64_t word;
+
+		memcpy(&word, p, sizeof(word));
+		hash ^= word;
+		hash *= 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+
+	while (len-- != 0) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+#define CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+/*
+ * Everything in struct conf_load that changes what ends up in the CUs, a
+ * different combination gets a different cache file.
+ */
+static uint32_t cache__conf_flags(const struct conf_load *conf)
+{
+	return (conf->fixup_silly_bitfields	  << 0) |
+	       (conf->ignore_alignment_attr	  << 1) |
+	       (conf->ignore_inline_expansions	  << 2) |
+	       (conf->ignore_labels		  << 3) |
+	       (conf->ignore_lexblocks		  << 4) |
+	       (conf->ignore_local_variables	  << 5) |
+	       (conf->ignore_global_variables	  << 6) |
+	       (conf->skip_encoding_btf_type_tag  << 7) |
+	       (conf->skip_encoding_btf_decl_tag  << 8) |
+	       (no_bitfield_type_recode		  << 9) |
+	       (conf->get_addr_info		  << 10);
+}
+
+/*
+ * Things that are only available while libdw is around or that need the ELF
+ * file, such as the symtab for the BTF encoder, can't come from the cache.
+ */
+static bool cache__usable(const struct conf_load *conf)
+{
+	return conf != NULL && conf->use_cache && !conf->extra_dbg_info &&
+	       conf->kabi_prefix == NULL;
+}
+
+static int cache__dirname(const struct conf_load *conf, char *bf, size_t len)
+{
+	const char *dir;
+
+	if (conf->cache_dir != NULL)
+		return snprintf(bf, len, "%s", conf->cache_dir) < (int)len ? 0 : -ENAMETOOLONG;
+
+	dir = getenv("XDG_CACHE_HOME");
+	if (dir != NULL && dir[0] != '\0')
+		return snprintf(bf, len, "%s/dwarves", dir) < (int)len ? 0 : -ENAMETOOLONG;
+
+	dir = getenv("HOME");
+	if (dir == NULL || dir[0] == '\0')
+		return -ENOENT;
+
+	return snprintf(bf, len, "%s/.cache/dwarves", dir) < (int)len ? 0 : -ENAMETOOLONG;
+}
+
+static int cache__mkdir(char *dir)
+{
+	char *slash = dir;
+
+	while ((slash = strchr(slash + 1, '/')) != NULL) {
+		*slash = '\0';
+		int err = mkdir(dir, 0700);
+		*slash = '/';
+		if (err != 0 && errno != EEXIST)
+			return -errno;
+	}
+
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+		return -errno;
+
+	return 0;
+}
+
+static int cache__pathname(const struct conf_load *conf, const char *filename, char *sbuild_id,
+			   char *dir, char *bf, size_t len)
+{
+	int err = filename__sprintf_build_id(filename, sbuild_id);
+
+	if (err < 0)
+		return err;
+
+	err = cache__dirname(conf, dir, PATH_MAX);
+	if (err < 0)
+		return err;
+
+	if (snprintf(bf, len, "%s/%s-%08x", dir, sbuild_id, cache__conf_flags(conf)) >= (int)len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+struct cache_buf {
+	uint8_t *data;
+	size_t	 size;
+	size_t	 allocated;
+};
+
+static int cache_buf__add(struct cache_buf *buf, const void *data, size_t size)
+{
+	if (buf->size + size + CACHE_ALIGN > buf->allocated) {
+		size_t allocated = buf->allocated ? buf->allocated * 2 : 4096;
+
+		while (allocated < buf->size + size + CACHE_ALIGN)
+			allocated *= 2;
+
+		uint8_t *new_data = realloc(buf->data, allocated);
+
+		if (new_data == NULL)
+			return -ENOMEM;
+
+		buf->data = new_data;
+		buf->allocated = allocated;
+	}
+
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+	return 0;
+}
+
+// So that the reader can use what is in the mmap'ed file in place
+static int cache_buf__align(struct cache_buf *buf)
+{
+	size_t pad = (CACHE_ALIGN - buf->size % CACHE_ALIGN) % CACHE_ALIGN;
+
+	if (pad == 0)
+		return 0;
+
+	if (buf->data == NULL && cache_buf__add(buf, "", 0) != 0)
+		return -ENOMEM;
+
+	memset(buf->data + buf->size, 0, pad);
+	buf->size += pad;
+	return 0;
+}
+
+/*
+ * Per CU string table, offset 0 is NULL, strings are interned so that things
+ * like "int" or "unsigned long" appear just once.
+ */
+struct cache_strings {
+	struct cache_buf buf;
+	uint32_t	 *slots;
+	uint32_t	 nr_slots;
+	uint32_t	 nr_entries;
+};
+
+static int cache_strings__grow(struct cache_strings *strs)
+{
+	uint32_t nr_slots = strs->nr_slots ? strs->nr_slots * 2 : 1024, i;
+	uint32_t *slots = calloc(nr_slots, sizeof(*slots));
+
+	if (slots == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < strs->nr_slots; ++i) {
+		uint32_t offset = strs->slots[i];
+
+		if (offset == 0)
+			continue;
+
+		const char *s = (const char *)strs->buf.data + offset;
+		uint32_t slot = cache__hash(CACHE_HASH_INIT, s, strlen(s)) & (nr_slots - 1);
+
+		while (slots[slot] != 0)
+			slot = (slot + 1) & (nr_slots - 1);
+		slots[slot] = offset;
+	}
+
+	free(strs->slots);
+	strs->slots = slots;
+	strs->nr_slots = nr_slots;
+	return 0;
+}
+
+static int cache_strings__add(struct cache_strings *strs, const char *s, uint32_t *offset)
+{
+	if (s == NULL) {
+		*offset = 0;
+		return 0;
+	}
+
+	if (strs->buf.size == 0 && cache_buf__add(&strs->buf, "", 1) != 0)
+		return -ENOMEM;
+
+	if ((strs->nr_entries + 1) * 2 > strs->nr_slots && cache_strings__grow(strs) != 0)
+		return -ENOMEM;
+
+	size_t len = strlen(s);
+	uint32_t slot = cache__hash(CACHE_HASH_INIT, s, len) & (strs->nr_slots - 1);
+
+	while (strs->slots[slot] != 0) {
+		if (strcmp((const char *)strs->buf.data + strs->slots[slot], s) == 0) {
+			*offset = strs->slots[slot];
+			return 0;
+		}
+		slot = (slot + 1) & (strs->nr_slots - 1);
+	}
+
+	*offset = strs->buf.size;
+	if (cache_buf__add(&strs->buf, s, len + 1) != 0)
+		return -ENOMEM;
+
+	strs->slots[slot] = *offset;
+	++strs->nr_entries;
+	return 0;
+}
+
+struct cache_tag_id {
+	const struct tag *tag;
+	uint32_t	 id;
+};
+
+static int cache_tag_id__cmp(const void *a, const void *b)
+{
+	const struct cache_tag_id *ida = a, *idb = b;
+
+	return ida->tag < idb->tag ? -1 : ida->tag > idb->tag ? 1 : 0;
+}
+
+struct cache_cu_writer {
+	struct cu	     *cu;
+	struct cache_buf     records;
+	struct cache_strings strings;
+	struct cache_tag_id  *ids;
+	uint32_t	     nr_ids;
+	uint32_t	     nr_in_table;
+};
+
+static void cache_cu_writer__exit(struct cache_cu_writer *w)
+{
+	free(w->records.data);
+	free(w->strings.buf.data);
+	free(w->strings.slots);
+	free(w->ids);
+}
+
+static int cache_cu_writer__add_table(struct cache_cu_writer *w, const struct ptr_table *pt)
+{
+	uint32_t i;
+
+	for (i = 0; i < pt->nr_entries; ++i) {
+		if (pt->entries[i] == NULL)
+			continue;
+		w->ids[w->nr_ids].tag = pt->entries[i];
+		w->ids[w->nr_ids].id  = i;
+		++w->nr_ids;
+	}
+
+	return 0;
+}
+
+/*
+ * The ids are what tag->type and friends point to, so we need to find, for
+ * each tag we write, if it is in one of the tables and with what id.
+ */
+static int cache_cu_writer__init(struct cache_cu_writer *w, struct cu *cu)
+{
+	memset(w, 0, sizeof(*w));
+	w->cu = cu;
+	w->ids = malloc((cu->types_table.nr_entries + cu->tags_table.nr_entries +
+			 cu->functions_table.nr_entries + 1) * sizeof(*w->ids));
+	if (w->ids == NULL)
+		return -ENOMEM;
+
+	cache_cu_writer__add_table(w, &cu->types_table);
+	cache_cu_writer__add_table(w, &cu->tags_table);
+	cache_cu_writer__add_table(w, &cu->functions_table);
+	qsort(w->ids, w->nr_ids, sizeof(*w->ids), cache_tag_id__cmp);
+	return 0;
+}
+
+static const struct cache_tag_id *cache_cu_writer__find_id(const struct cache_cu_writer *w,
+							   const struct tag *tag)
+{
+	const struct cache_tag_id key = { .tag = tag, };
+
+	return bsearch(&key, w->ids, w->nr_ids, sizeof(*w->ids), cache_tag_id__cmp);
+}
+
+static int cache_cu_writer__add(struct cache_cu_writer *w, const void *data, size_t size)
+{
+	return cache_buf__add(&w->records, data, size) ?: cache_buf__align(&w->records);
+}
+
+static int cache_cu_writer__string(struct cache_cu_writer *w, const char *s, uint32_t *offset)
+{
+	return cache_strings__add(&w->strings, s, offset);
+}
+
+static int cache_cu_writer__record(struct cache_cu_writer *w, const struct tag *tag, const char *name)
+{
+	const struct cache_tag_id *id = cache_cu_writer__find_id(w, tag);
+	struct cache_record rec = {
+		.tag  = tag->tag,
+		.type = tag->type,
+	};
+
+	if (id != NULL) {
+		rec.flags |= CACHE_RECORD__IN_TABLE;
+		rec.id = id->id;
+		++w->nr_in_table;
+	}
+
+	if (tag->top_level)
+		rec.flags |= CACHE_RECORD__TOP_LEVEL;
+
+	if (cache_cu_writer__string(w, name, &rec.name) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__add(w, &rec, sizeof(rec));
+}
+
+static int cache_cu_writer__tag(struct cache_cu_writer *w, struct tag *tag);
+
+static int cache_cu_writer__base_type(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct base_type *bt = tag__base_type(tag);
+	struct cache_base_type cbt = {
+		.bit_size	   = bt->bit_size,
+		.name_has_encoding = bt->name_has_encoding,
+		.is_signed	   = bt->is_signed,
+		.is_bool	   = bt->is_bool,
+		.is_varargs	   = bt->is_varargs,
+		.float_type	   = bt->float_type,
+	};
+
+	if (cache_cu_writer__record(w, tag, bt->name) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__add(w, &cbt, sizeof(cbt));
+}
+
+static int cache_cu_writer__array_type(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct array_type *at = tag__array_type(tag);
+	struct cache_array_type cat = {
+		.dimensions = at->dimensions,
+		.is_vector  = at->is_vector,
+	};
+
+	if (cache_cu_writer__record(w, tag, NULL) != 0 ||
+	    cache_cu_writer__add(w, &cat, sizeof(cat)) != 0 ||
+	    cache_cu_writer__add(w, at->nr_entries, at->dimensions * sizeof(uint32_t)) != 0)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int cache_cu_writer__string_type(struct cache_cu_writer *w, struct tag *tag)
+{
+	uint32_t nr_entries = tag__string_type(tag)->nr_entries;
+
+	if (cache_cu_writer__record(w, tag, NULL) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__add(w, &nr_entries, sizeof(nr_entries));
+}
+
+static int cache_cu_writer__type(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct type *type = tag__type(tag);
+	struct cache_type ctype = {
+		.size		= type->size,
+		.alignment	= type->alignment,
+		.nr_tags	= type->namespace.nr_tags,
+		.declaration	= type->declaration,
+		.is_signed_enum = type->is_signed_enum,
+	};
+	struct tag *pos;
+	int err;
+
+	if (type->namespace.shared_tags || !list_empty(&type->namespace.annots))
+		return -ENOTSUP;
+
+	if (tag__is_struct(tag) && !list_empty(&type__class(type)->vtable))
+		return -ENOTSUP;
+
+	if (cache_cu_writer__record(w, tag, type->namespace.name) != 0 ||
+	    cache_cu_writer__add(w, &ctype, sizeof(ctype)) != 0)
+		return -ENOMEM;
+
+	namespace__for_each_tag(&type->namespace, pos) {
+		err = cache_cu_writer__tag(w, pos);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int cache_cu_writer__class_member(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct class_member *member = tag__class_member(tag);
+	struct cache_class_member cmember = {
+		.byte_size	 = member->byte_size,
+		.const_value	 = member->const_value,
+		.bit_offset	 = member->bit_offset,
+		.bit_size	 = member->bit_size,
+		.byte_offset	 = member->byte_offset,
+		.alignment	 = member->alignment,
+		.bitfield_offset = member->bitfield_offset,
+		.bitfield_size	 = member->bitfield_size,
+		.accessibility	 = member->accessibility,
+		.virtuality	 = member->virtuality,
+		.is_static	 = member->is_static,
+		.has_bit_offset	 = member->has_bit_offset,
+	};
+
+	if (cache_cu_writer__record(w, tag, member->name) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__add(w, &cmember, sizeof(cmember));
+}
+
+static int cache_cu_writer__enumerator(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct enumerator *enumerator = tag__enumerator(tag);
+
+	if (cache_cu_writer__record(w, tag, enumerator->name) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__add(w, &enumerator->value, sizeof(enumerator->value));
+}
+
+static int cache_cu_writer__parms(struct cache_cu_writer *w, struct ftype *ftype)
+{
+	struct parameter *pos;
+
+	ftype__for_each_parameter(ftype, pos) {
+		if (cache_cu_writer__record(w, &pos->tag, pos->name) != 0)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int cache_cu_writer__ftype(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct ftype *ftype = tag__ftype(tag);
+	struct cache_ftype cftype = {
+		.nr_parms     = ftype->nr_parms,
+		.unspec_parms = ftype->unspec_parms,
+	};
+
+	if (cache_cu_writer__record(w, tag, NULL) != 0 ||
+	    cache_cu_writer__add(w, &cftype, sizeof(cftype)) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__parms(w, ftype);
+}
+
+static int cache_cu_writer__lexblock_tags(struct cache_cu_writer *w, struct lexblock *block)
+{
+	struct tag *pos;
+	int err;
+
+	list_for_each_entry(pos, &block->tags, node) {
+		switch (pos->tag) {
+		case DW_TAG_formal_parameter:
+			err = cache_cu_writer__record(w, pos, tag__parameter(pos)->name);
+			break;
+		case DW_TAG_variable:
+		case DW_TAG_lexical_block:
+		case DW_TAG_label:
+		case DW_TAG_inlined_subroutine:
+			err = cache_cu_writer__tag(w, pos);
+			break;
+		default:
+			err = -ENOTSUP;
+			break;
+		}
+
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static uint32_t lexblock__nr_tags(const struct lexblock *block)
+{
+	struct tag *pos;
+	uint32_t nr_tags = 0;
+
+	list_for_each_entry(pos, &block->tags, node)
+		++nr_tags;
+
+	return nr_tags;
+}
+
+static int cache_cu_writer__lexblock(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct lexblock *block = tag__lexblock(tag);
+	struct cache_lexblock cblock = {
+		.addr	 = block->ip.addr,
+		.size	 = block->size,
+		.nr_tags = lexblock__nr_tags(block),
+	};
+
+	if (cache_cu_writer__record(w, tag, NULL) != 0 ||
+	    cache_cu_writer__add(w, &cblock, sizeof(cblock)) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__lexblock_tags(w, block);
+}
+
+static int cache_cu_writer__function(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct function *func = tag__function(tag);
+	struct cache_function cfunc = {
+		.addr		  = func->lexblock.ip.addr,
+		.size		  = func->lexblock.size,
+		.vtable_entry	  = func->vtable_entry,
+		.nr_parms	  = func->proto.nr_parms,
+		.nr_lexblock_tags = lexblock__nr_tags(&func->lexblock),
+		.inlined	  = func->inlined,
+		.accessibility	  = func->accessibility,
+		.virtuality	  = func->virtuality,
+		.unspec_parms	  = func->proto.unspec_parms,
+		.abstract_origin  = func->abstract_origin,
+		.external	  = func->external,
+		.declaration	  = func->declaration,
+	};
+
+	if (func->btf || !list_empty(&func->annots) || !list_empty(&func->vtable_node))
+		return -ENOTSUP;
+
+	if (cache_cu_writer__record(w, tag, func->name) != 0 ||
+	    cache_cu_writer__string(w, func->linkage_name, &cfunc.linkage_name) != 0 ||
+	    cache_cu_writer__add(w, &cfunc, sizeof(cfunc)) != 0 ||
+	    cache_cu_writer__parms(w, &func->proto) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__lexblock_tags(w, &func->lexblock);
+}
+
+static int cache_cu_writer__variable(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct variable *var = tag__variable(tag);
+	struct cache_variable cvar = {
+		.addr		   = var->ip.addr,
+		.scope		   = var->scope,
+		.external	   = var->external,
+		.declaration	   = var->declaration,
+		.has_specification = var->has_specification,
+	};
+
+	if (!list_empty(&var->annots))
+		return -ENOTSUP;
+
+	if (var->spec != NULL) {
+		const struct cache_tag_id *id = cache_cu_writer__find_id(w, &var->spec->ip.tag);
+
+		if (id == NULL)
+			return -ENOTSUP;
+		cvar.spec = id->id + 1;
+	}
+
+	if (cache_cu_writer__record(w, tag, var->name) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__add(w, &cvar, sizeof(cvar));
+}
+
+static int cache_cu_writer__label(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct label *label = tag__label(tag);
+
+	if (cache_cu_writer__record(w, tag, label->name) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__add(w, &label->ip.addr, sizeof(label->ip.addr));
+}
+
+static int cache_cu_writer__inline_expansion(struct cache_cu_writer *w, struct tag *tag)
+{
+	struct inline_expansion *exp = tag__inline_expansion(tag);
+	struct cache_inline_expansion cexp = {
+		.addr	 = exp->ip.addr,
+		.size	 = exp->size,
+		.high_pc = exp->high_pc,
+	};
+
+	if (cache_cu_writer__record(w, tag, NULL) != 0)
+		return -ENOMEM;
+
+	return cache_cu_writer__add(w, &cexp, sizeof(cexp));
+}
+
+static int cache_cu_writer__tag(struct cache_cu_writer *w, struct tag *tag)
+{
+	switch (tag->tag) {
+	case DW_TAG_base_type:
+		return cache_cu_writer__base_type(w, tag);
+	case DW_TAG_array_type:
+		return cache_cu_writer__array_type(w, tag);
+	case DW_TAG_string_type:
+		return cache_cu_writer__string_type(w, tag);
+	case DW_TAG_pointer_type:
+		if (tag->has_btf_type_tag)
+			return -ENOTSUP;
+		/* fall thru */
+	case DW_TAG_const_type:
+	case DW_TAG_imported_declaration:
+	case DW_TAG_imported_module:
+	case DW_TAG_reference_type:
+	case DW_TAG_restrict_type:
+	case DW_TAG_volatile_type:
+	case DW_TAG_atomic_type:
+	case DW_TAG_unspecified_type:
+		return cache_cu_writer__record(w, tag, NULL);
+	case DW_TAG_class_type:
+	case DW_TAG_interface_type:
+	case DW_TAG_structure_type:
+	case DW_TAG_union_type:
+	case DW_TAG_enumeration_type:
+	case DW_TAG_typedef:
+	case DW_TAG_rvalue_reference_type:
+		return cache_cu_writer__type(w, tag);
+	case DW_TAG_inheritance:
+	case DW_TAG_member:
+		return cache_cu_writer__class_member(w, tag);
+	case DW_TAG_enumerator:
+		return cache_cu_writer__enumerator(w, tag);
+	case DW_TAG_subroutine_type:
+		return cache_cu_writer__ftype(w, tag);
+	case DW_TAG_subprogram:
+		return cache_cu_writer__function(w, tag);
+	case DW_TAG_lexical_block:
+		return cache_cu_writer__lexblock(w, tag);
+	case DW_TAG_variable:
+		return cache_cu_writer__variable(w, tag);
+	case DW_TAG_label:
+		return cache_cu_writer__label(w, tag);
+	case DW_TAG_inlined_subroutine:
+		return cache_cu_writer__inline_expansion(w, tag);
+	}
+
+	return -ENOTSUP;
+}
+
+static int cache_cu_writer__write(struct cache_cu_writer *w, struct cache_cu_header *hdr)
+{
+	struct cu *cu = w->cu;
+	struct tag *pos;
+	int err;
+
+	memset(hdr, 0, sizeof(*hdr));
+
+	list_for_each_entry(pos, &cu->tags, node) {
+		err = cache_cu_writer__tag(w, pos);
+		if (err != 0)
+			return err;
+		++hdr->nr_records;
+	}
+
+	/* Something in the tables is not reachable from cu->tags, can't rebuild it */
+	if (w->nr_in_table != w->nr_ids)
+		return -ENOTSUP;
+
+	if (cache_cu_writer__string(w, cu->name, &hdr->name) != 0 ||
+	    /* So that strings_size is never zero and always '\0' terminated */
+	    (w->strings.buf.size == 0 && cache_buf__add(&w->strings.buf, "", 1) != 0) ||
+	    /* And the next CU header is aligned */
+	    cache_buf__align(&w->strings.buf) != 0)
+		return -ENOMEM;
+
+	hdr->records_size     = w->records.size;
+	hdr->strings_size     = w->strings.buf.size;
+	hdr->size	      = sizeof(*hdr) + hdr->records_size + hdr->strings_size;
+	hdr->unspecified_type = cu->unspecified_type.type;
+	hdr->language	      = cu->language;
+	hdr->addr_size	      = cu->addr_size;
+	hdr->little_endian    = cu->little_endian;
+	hdr->checksum	      = cache__hash(CACHE_HASH_INIT, w->records.data, w->records.size);
+	hdr->checksum	      = cache__hash(hdr->checksum, w->strings.buf.data, w->strings.buf.size);
+	return 0;
+}
+
+struct cache_writer {
+	struct conf_load	 conf;
+	struct conf_load	 *orig;
+	pthread_mutex_t		 lock;
+	FILE			 *fp;
+	struct cache_file_header header;
+	bool			 failed;
+};
+
+static struct cache_writer *cache_writer__from_conf(struct conf_load *conf)
+{
+	return container_of(conf, struct cache_writer, conf);
+}
+
+static void cache_writer__add_cu(struct cache_writer *writer, struct cu *cu)
+{
+	struct cache_cu_writer w;
+	struct cache_cu_header hdr;
+	int err = cache_cu_writer__init(&w, cu) ?: cache_cu_writer__write(&w, &hdr);
+
+	pthread_mutex_lock(&writer->lock);
+
+	if (err != 0) {
+		writer->failed = true;
+		goto out_unlock;
+	}
+
+	if (writer->header.build_id_len == 0 && cu->build_id_len > 0 &&
+	    cu->build_id_len <= CACHE_MAX_BUILD_ID) {
+		writer->header.build_id_len = cu->build_id_len;
+		memcpy(writer->header.build_id, cu->build_id, cu->build_id_len);
+	}
+
+	if (!writer->failed &&
+	    (fwrite(&hdr, sizeof(hdr), 1, writer->fp) != 1 ||
+	     fwrite(w.records.data ?: (void *)"", 1, w.records.size, writer->fp) != w.records.size ||
+	     fwrite(w.strings.buf.data, 1, w.strings.buf.size, writer->fp) != w.strings.buf.size)) {
+		writer->failed = true;
+	} else {
+		writer->header.size += hdr.size;
+		++writer->header.nr_cus;
+	}
+out_unlock:
+	pthread_mutex_unlock(&writer->lock);
+	cache_cu_writer__exit(&w);
+}
+
+/*
+ * Sits between the DWARF loader and the tool, storing each CU before the
+ * tool gets to see (and possibly change) it.
+ */
+static enum load_steal_kind cache_writer__steal(struct cu *cu, struct conf_load *conf, void *thr_data)
+{
+	struct cache_writer *writer = cache_writer__from_conf(conf);
+	struct conf_load *orig = writer->orig;
+	enum load_steal_kind lsk = LSK__KEEPIT;
+
+	cache_writer__add_cu(writer, cu);
+
+	if (orig->early_cu_filter && orig->early_cu_filter(cu) == NULL)
+		return LSK__DELETE;
+
+	if (orig->steal)
+		lsk = orig->steal(cu, orig, thr_data);
+
+	/* The tool stopped before we got all the CUs */
+	if (lsk == LSK__STOP_LOADING) {
+		pthread_mutex_lock(&writer->lock);
+		writer->failed = true;
+		pthread_mutex_unlock(&writer->lock);
+	}
+
+	return lsk;
+}
+
+static int cache__write(struct cus *cus, struct conf_load *conf, const char *filename,
+			const char *sbuild_id, char *dir, const char *pathname)
+{
+	char tmp_pathname[PATH_MAX];
+	struct cache_writer writer = {
+		.conf = *conf,
+		.orig = conf,
+		.header = {
+			.magic	    = CACHE_MAGIC,
+			.version    = CACHE_VERSION,
+			.byte_order = CACHE_BYTE_ORDER,
+			.conf_flags = cache__conf_flags(conf),
+			.size	    = sizeof(struct cache_file_header),
+		},
+	};
+	int err, fd;
+
+	/* Every CU has to go thru the cache, the filter is applied in cache_writer__steal() */
+	writer.conf.steal = cache_writer__steal;
+	writer.conf.early_cu_filter = NULL;
+	/* In the DWARF order, not in the order the threads finish them, so that the cache is reproducible */
+	writer.conf.in_order_steal = true;
+	snprintf(writer.header.sbuild_id, sizeof(writer.header.sbuild_id), "%s", sbuild_id);
+
+	if (cache__mkdir(dir) != 0 ||
+	    snprintf(tmp_pathname, sizeof(tmp_pathname), "%s.XXXXXX", pathname) >= (int)sizeof(tmp_pathname) ||
+	    (fd = mkstemp(tmp_pathname)) < 0)
+		return dwarf__ops.load_file(cus, conf, filename);
+
+	writer.fp = fdopen(fd, "w");
+	if (writer.fp == NULL) {
+		close(fd);
+		unlink(tmp_pathname);
+		return dwarf__ops.load_file(cus, conf, filename);
+	}
+
+	pthread_mutex_init(&writer.lock, NULL);
+
+	if (fwrite(&writer.header, sizeof(writer.header), 1, writer.fp) != 1)
+		writer.failed = true;
+
+	err = dwarf__ops.load_file(cus, &writer.conf, filename);
+
+	if (err != 0 || writer.failed ||
+	    fseek(writer.fp, 0, SEEK_SET) != 0 ||
+	    fwrite(&writer.header, sizeof(writer.header), 1, writer.fp) != 1)
+		writer.failed = true;
+
+	if (fclose(writer.fp) != 0 || writer.failed || rename(tmp_pathname, pathname) != 0)
+		unlink(tmp_pathname);
+
+	pthread_mutex_destroy(&writer.lock);
+	return err;
+}
+
+/*
+ * The strings in the CUs point to the mmap'ed cache file, so keep it around
+ * till the last CU loaded from it goes away.
+ */
+struct cache_map {
+	void		*addr;
+	size_t		size;
+	pthread_mutex_t lock;
+	int		refcnt;
+};
+
+static struct cache_map *cache_map__get(struct cache_map *map)
+{
+	pthread_mutex_lock(&map->lock);
+	++map->refcnt;
+	pthread_mutex_unlock(&map->lock);
+	return map;
+}
+
+static void cache_map__put(struct cache_map *map)
+{
+	pthread_mutex_lock(&map->lock);
+	int refcnt = --map->refcnt;
+	pthread_mutex_unlock(&map->lock);
+
+	if (refcnt == 0) {
+		munmap(map->addr, map->size);
+		pthread_mutex_destroy(&map->lock);
+		free(map);
+	}
+}
+
+static void cache__cu_delete(struct cu *cu)
+{
+	if (cu->priv != NULL) {
+		cache_map__put(cu->priv);
+		cu->priv = NULL;
+	}
+}
+
+struct cache_var_spec {
+	struct variable *var;
+	uint32_t	id;
+};
+
+struct cache_reader {
+	const uint8_t	      *pos;
+	const uint8_t	      *end;
+	const char	      *strings;
+	uint32_t	      strings_size;
+	struct cu	      *cu;
+	struct cache_var_spec *specs;
+	uint32_t	      nr_specs;
+	uint32_t	      allocated_specs;
+	bool		      error;
+};
+
+/* Everything was written CACHE_ALIGN aligned, so we use it in place */
+static const void *cache_reader__get(struct cache_reader *rd, size_t size)
+{
+	const void *data = rd->pos;
+
+	size = (size + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+	if ((size_t)(rd->end - rd->pos) < size) {
+		rd->error = true;
+		return NULL;
+	}
+
+	rd->pos += size;
+	return data;
+}
+
+static const char *cache_reader__string(struct cache_reader *rd, uint32_t offset)
+{
+	if (offset == 0)
+		return NULL;
+
+	if (offset >= rd->strings_size) {
+		rd->error = true;
+		return NULL;
+	}
+
+	return rd->strings + offset;
+}
+
+static void *cache_reader__zalloc(struct cache_reader *rd, const struct cache_record *rec, size_t size)
+{
+	struct tag *tag = cu__zalloc(rd->cu, size);
+
+	if (tag != NULL) {
+		INIT_LIST_HEAD(&tag->node);
+		tag->tag       = rec->tag;
+		tag->type      = rec->type;
+		tag->top_level = (rec->flags & CACHE_RECORD__TOP_LEVEL) != 0;
+	}
+
+	return tag;
+}
+
+static struct tag *cache_reader__tag(struct cache_reader *rd);
+
+static struct tag *cache_reader__base_type(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const struct cache_base_type *cbt;
+	struct base_type *bt;
+
+	cbt = cache_reader__get(rd, sizeof(*cbt));
+	if (cbt == NULL)
+		return NULL;
+
+	bt = cache_reader__zalloc(rd, rec, sizeof(*bt));
+	if (bt == NULL)
+		return NULL;
+
+	bt->name	      = cache_reader__string(rd, rec->name);
+	bt->bit_size	      = cbt->bit_size;
+	bt->name_has_encoding = cbt->name_has_encoding;
+	bt->is_signed	      = cbt->is_signed;
+	bt->is_bool	      = cbt->is_bool;
+	bt->is_varargs	      = cbt->is_varargs;
+	bt->float_type	      = cbt->float_type;
+	INIT_LIST_HEAD(&bt->node);
+	return &bt->tag;
+}
+
+static struct tag *cache_reader__array_type(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const struct cache_array_type *cat;
+	struct array_type *at;
+
+	cat = cache_reader__get(rd, sizeof(*cat));
+	if (cat == NULL)
+		return NULL;
+
+	at = cache_reader__zalloc(rd, rec, sizeof(*at));
+	if (at == NULL)
+		return NULL;
+
+	at->dimensions = cat->dimensions;
+	at->is_vector  = cat->is_vector;
+	if (at->dimensions != 0) {
+		const uint32_t *nr_entries = cache_reader__get(rd, at->dimensions * sizeof(uint32_t));
+
+		at->nr_entries = cu__malloc(rd->cu, at->dimensions * sizeof(uint32_t));
+		if (nr_entries == NULL || at->nr_entries == NULL)
+			return NULL;
+		memcpy(at->nr_entries, nr_entries, at->dimensions * sizeof(uint32_t));
+	}
+
+	return &at->tag;
+}
+
+static struct tag *cache_reader__string_type(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const uint32_t *nr_entries = cache_reader__get(rd, sizeof(*nr_entries));
+	struct string_type *st;
+
+	if (nr_entries == NULL)
+		return NULL;
+
+	st = cache_reader__zalloc(rd, rec, sizeof(*st));
+	if (st != NULL)
+		st->nr_entries = *nr_entries;
+
+	return st ? &st->tag : NULL;
+}
+
+static struct tag *cache_reader__type(struct cache_reader *rd, const struct cache_record *rec, bool is_class)
+{
+	const struct cache_type *ctype;
+	struct type *type;
+	uint16_t i;
+
+	ctype = cache_reader__get(rd, sizeof(*ctype));
+	if (ctype == NULL)
+		return NULL;
+
+	type = cache_reader__zalloc(rd, rec, is_class ? sizeof(struct class) : sizeof(struct type));
+	if (type == NULL)
+		return NULL;
+
+	INIT_LIST_HEAD(&type->namespace.tags);
+	INIT_LIST_HEAD(&type->namespace.annots);
+	__type__init(type);
+	type->namespace.name = cache_reader__string(rd, rec->name);
+	type->size	     = ctype->size;
+	type->alignment	     = ctype->alignment;
+	type->declaration    = ctype->declaration;
+	type->is_signed_enum = ctype->is_signed_enum;
+
+	if (is_class)
+		INIT_LIST_HEAD(&type__class(type)->vtable);
+
+	for (i = 0; i < ctype->nr_tags; ++i) {
+		struct tag *child = cache_reader__tag(rd);
+
+		if (child == NULL)
+			return NULL;
+
+		switch (child->tag) {
+		case DW_TAG_inheritance:
+		case DW_TAG_member:
+			type__add_member(type, tag__class_member(child));
+			break;
+		case DW_TAG_enumerator:
+			enumeration__add(type, tag__enumerator(child));
+			break;
+		default:
+			namespace__add_tag(&type->namespace, child);
+			break;
+		}
+	}
+
+	return &type->namespace.tag;
+}
+
+static struct tag *cache_reader__class_member(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const struct cache_class_member *cmember;
+	struct class_member *member;
+
+	cmember = cache_reader__get(rd, sizeof(*cmember));
+	if (cmember == NULL)
+		return NULL;
+
+	member = cache_reader__zalloc(rd, rec, sizeof(*member));
+	if (member == NULL)
+		return NULL;
+
+	member->name		= cache_reader__string(rd, rec->name);
+	member->byte_size	= cmember->byte_size;
+	member->const_value	= cmember->const_value;
+	member->bit_offset	= cmember->bit_offset;
+	member->bit_size	= cmember->bit_size;
+	member->byte_offset	= cmember->byte_offset;
+	member->alignment	= cmember->alignment;
+	member->bitfield_offset = cmember->bitfield_offset;
+	member->bitfield_size	= cmember->bitfield_size;
+	member->accessibility	= cmember->accessibility;
+	member->virtuality	= cmember->virtuality;
+	member->is_static	= cmember->is_static;
+	member->has_bit_offset	= cmember->has_bit_offset;
+	return &member->tag;
+}
+
+static struct tag *cache_reader__enumerator(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const uint64_t *value = cache_reader__get(rd, sizeof(*value));
+	struct enumerator *enumerator;
+
+	if (value == NULL)
+		return NULL;
+
+	enumerator = cache_reader__zalloc(rd, rec, sizeof(*enumerator));
+	if (enumerator == NULL)
+		return NULL;
+
+	enumerator->name  = cache_reader__string(rd, rec->name);
+	enumerator->value = *value;
+	return &enumerator->tag;
+}
+
+static struct tag *cache_reader__parameter(struct cache_reader *rd, const struct cache_record *rec)
+{
+	struct parameter *parm = cache_reader__zalloc(rd, rec, sizeof(*parm));
+
+	if (parm != NULL)
+		parm->name = cache_reader__string(rd, rec->name);
+
+	return parm ? &parm->tag : NULL;
+}
+
+static int cache_reader__parms(struct cache_reader *rd, struct ftype *ftype, uint16_t nr_parms)
+{
+	uint16_t i;
+
+	INIT_LIST_HEAD(&ftype->parms);
+
+	for (i = 0; i < nr_parms; ++i) {
+		struct tag *parm = cache_reader__tag(rd);
+
+		if (parm == NULL || parm->tag != DW_TAG_formal_parameter)
+			return -EINVAL;
+
+		ftype__add_parameter(ftype, tag__parameter(parm));
+	}
+
+	return 0;
+}
+
+static struct tag *cache_reader__ftype(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const struct cache_ftype *cftype;
+	struct ftype *ftype;
+
+	cftype = cache_reader__get(rd, sizeof(*cftype));
+	if (cftype == NULL)
+		return NULL;
+
+	ftype = cache_reader__zalloc(rd, rec, sizeof(*ftype));
+	if (ftype == NULL || cache_reader__parms(rd, ftype, cftype->nr_parms) != 0)
+		return NULL;
+
+	ftype->unspec_parms = cftype->unspec_parms;
+	return &ftype->tag;
+}
+
+static int cache_reader__lexblock_tags(struct cache_reader *rd, struct lexblock *block, uint32_t nr_tags)
+{
+	uint32_t i;
+
+	INIT_LIST_HEAD(&block->tags);
+
+	for (i = 0; i < nr_tags; ++i) {
+		struct tag *tag = cache_reader__tag(rd);
+
+		if (tag == NULL)
+			return -EINVAL;
+
+		switch (tag->tag) {
+		case DW_TAG_formal_parameter:
+			lexblock__add_tag(block, tag);			break;
+		case DW_TAG_variable:
+			lexblock__add_variable(block, tag__variable(tag)); break;
+		case DW_TAG_lexical_block:
+			lexblock__add_lexblock(block, tag__lexblock(tag)); break;
+		case DW_TAG_label:
+			lexblock__add_label(block, tag__label(tag));	break;
+		case DW_TAG_inlined_subroutine:
+			lexblock__add_inline_expansion(block, tag__inline_expansion(tag)); break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static struct tag *cache_reader__lexblock(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const struct cache_lexblock *cblock;
+	struct lexblock *block;
+
+	cblock = cache_reader__get(rd, sizeof(*cblock));
+	if (cblock == NULL)
+		return NULL;
+
+	block = cache_reader__zalloc(rd, rec, sizeof(*block));
+	if (block == NULL)
+		return NULL;
+
+	block->ip.addr = cblock->addr;
+	block->size    = cblock->size;
+	return cache_reader__lexblock_tags(rd, block, cblock->nr_tags) == 0 ? &block->ip.tag : NULL;
+}
+
+static struct tag *cache_reader__function(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const struct cache_function *cfunc;
+	struct function *func;
+
+	cfunc = cache_reader__get(rd, sizeof(*cfunc));
+	if (cfunc == NULL)
+		return NULL;
+
+	func = cache_reader__zalloc(rd, rec, sizeof(*func));
+	if (func == NULL)
+		return NULL;
+
+	func->name		  = cache_reader__string(rd, rec->name);
+	func->linkage_name	  = cache_reader__string(rd, cfunc->linkage_name);
+	func->lexblock.ip.addr	  = cfunc->addr;
+	func->lexblock.size	  = cfunc->size;
+	func->vtable_entry	  = cfunc->vtable_entry;
+	func->inlined		  = cfunc->inlined;
+	func->accessibility	  = cfunc->accessibility;
+	func->virtuality	  = cfunc->virtuality;
+	func->abstract_origin	  = cfunc->abstract_origin;
+	func->external		  = cfunc->external;
+	func->declaration	  = cfunc->declaration;
+	func->proto.unspec_parms  = cfunc->unspec_parms;
+	INIT_LIST_HEAD(&func->lexblock.ip.tag.node);
+	INIT_LIST_HEAD(&func->vtable_node);
+	INIT_LIST_HEAD(&func->annots);
+	INIT_LIST_HEAD(&func->tool_node);
+
+	if (cache_reader__parms(rd, &func->proto, cfunc->nr_parms) != 0 ||
+	    cache_reader__lexblock_tags(rd, &func->lexblock, cfunc->nr_lexblock_tags) != 0)
+		return NULL;
+
+	return &func->proto.tag;
+}
+
+static struct tag *cache_reader__variable(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const struct cache_variable *cvar;
+	struct variable *var;
+
+	cvar = cache_reader__get(rd, sizeof(*cvar));
+	if (cvar == NULL)
+		return NULL;
+
+	var = cache_reader__zalloc(rd, rec, sizeof(*var));
+	if (var == NULL)
+		return NULL;
+
+	var->name	       = cache_reader__string(rd, rec->name);
+	var->ip.addr	       = cvar->addr;
+	var->scope	       = cvar->scope;
+	var->external	       = cvar->external;
+	var->declaration       = cvar->declaration;
+	var->has_specification = cvar->has_specification;
+	INIT_LIST_HEAD(&var->annots);
+
+	/* The specification may come later, resolve after loading all tags */
+	if (cvar->spec != 0) {
+		if (rd->nr_specs == rd->allocated_specs) {
+			uint32_t allocated_specs = rd->allocated_specs ? rd->allocated_specs * 2 : 64;
+			struct cache_var_spec *specs = realloc(rd->specs, allocated_specs * sizeof(*specs));
+
+			if (specs == NULL)
+				return NULL;
+
+			rd->specs = specs;
+			rd->allocated_specs = allocated_specs;
+		}
+
+		rd->specs[rd->nr_specs].var = var;
+		rd->specs[rd->nr_specs].id  = cvar->spec - 1;
+		++rd->nr_specs;
+	}
+
+	return &var->ip.tag;
+}
+
+static struct tag *cache_reader__label(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const uint64_t *addr = cache_reader__get(rd, sizeof(*addr));
+	struct label *label;
+
+	if (addr == NULL)
+		return NULL;
+
+	label = cache_reader__zalloc(rd, rec, sizeof(*label));
+	if (label == NULL)
+		return NULL;
+
+	label->name    = cache_reader__string(rd, rec->name);
+	label->ip.addr = *addr;
+	return &label->ip.tag;
+}
+
+static struct tag *cache_reader__inline_expansion(struct cache_reader *rd, const struct cache_record *rec)
+{
+	const struct cache_inline_expansion *cexp;
+	struct inline_expansion *exp;
+
+	cexp = cache_reader__get(rd, sizeof(*cexp));
+	if (cexp == NULL)
+		return NULL;
+
+	exp = cache_reader__zalloc(rd, rec, sizeof(*exp));
+	if (exp == NULL)
+		return NULL;
+
+	exp->ip.addr = cexp->addr;
+	exp->size    = cexp->size;
+	exp->high_pc = cexp->high_pc;
+	return &exp->ip.tag;
+}
+
+static struct tag *cache_reader__tag(struct cache_reader *rd)
+{
+	const struct cache_record *rec = cache_reader__get(rd, sizeof(*rec));
+	struct tag *tag;
+
+	if (rec == NULL)
+		return NULL;
+
+	switch (rec->tag) {
+	case DW_TAG_base_type:
+		tag = cache_reader__base_type(rd, rec);	break;
+	case DW_TAG_array_type:
+		tag = cache_reader__array_type(rd, rec);	break;
+	case DW_TAG_string_type:
+		tag = cache_reader__string_type(rd, rec);	break;
+	case DW_TAG_pointer_type:
+	case DW_TAG_const_type:
+	case DW_TAG_imported_declaration:
+	case DW_TAG_imported_module:
+	case DW_TAG_reference_type:
+	case DW_TAG_restrict_type:
+	case DW_TAG_volatile_type:
+	case DW_TAG_atomic_type:
+	case DW_TAG_unspecified_type:
+		tag = cache_reader__zalloc(rd, rec, sizeof(*tag)); break;
+	case DW_TAG_class_type:
+	case DW_TAG_interface_type:
+	case DW_TAG_structure_type:
+		tag = cache_reader__type(rd, rec, true);	break;
+	case DW_TAG_union_type:
+	case DW_TAG_enumeration_type:
+	case DW_TAG_typedef:
+	case DW_TAG_rvalue_reference_type:
+		tag = cache_reader__type(rd, rec, false);	break;
+	case DW_TAG_inheritance:
+	case DW_TAG_member:
+		tag = cache_reader__class_member(rd, rec);	break;
+	case DW_TAG_enumerator:
+		tag = cache_reader__enumerator(rd, rec);	break;
+	case DW_TAG_formal_parameter:
+		tag = cache_reader__parameter(rd, rec);	break;
+	case DW_TAG_subroutine_type:
+		tag = cache_reader__ftype(rd, rec);		break;
+	case DW_TAG_subprogram:
+		tag = cache_reader__function(rd, rec);		break;
+	case DW_TAG_lexical_block:
+		tag = cache_reader__lexblock(rd, rec);		break;
+	case DW_TAG_variable:
+		tag = cache_reader__variable(rd, rec);		break;
+	case DW_TAG_label:
+		tag = cache_reader__label(rd, rec);		break;
+	case DW_TAG_inlined_subroutine:
+		tag = cache_reader__inline_expansion(rd, rec); break;
+	default:
+		rd->error = true;
+		return NULL;
+	}
+
+	if (tag == NULL || rd->error)
+		return NULL;
+
+	/* After the payload, as functions need their address to be in cu->functions */
+	if ((rec->flags & CACHE_RECORD__IN_TABLE) &&
+	    cu__table_add_tag_with_id(rd->cu, tag, rec->id) != 0)
+		return NULL;
+
+	return tag;
+}
+
+static int cache_reader__cu(struct cache_reader *rd, const struct cache_cu_header *hdr)
+{
+	struct cu *cu = rd->cu;
+	uint32_t i;
+
+	for (i = 0; i < hdr->nr_records; ++i) {
+		struct tag *tag = cache_reader__tag(rd);
+
+		if (tag == NULL)
+			return -EINVAL;
+
+		list_add_tail(&tag->node, &cu->tags);
+	}
+
+	for (i = 0; i < rd->nr_specs; ++i) {
+		struct tag *spec = cu__tag(cu, rd->specs[i].id);
+
+		if (spec == NULL || spec->tag != DW_TAG_variable)
+			return -EINVAL;
+
+		rd->specs[i].var->spec = tag__variable(spec);
+	}
+
+	if (hdr->unspecified_type != 0) {
+		cu->unspecified_type.type = hdr->unspecified_type;
+		cu->unspecified_type.tag  = cu__type(cu, hdr->unspecified_type);
+	}
+
+	return rd->pos == rd->end ? 0 : -EINVAL;
+}
+
+/*
+ * Just the header is checked here, the CUs are checked in cache__load(), their
+ * checksums as they get loaded, so that a hit doesn't cost a pass over the
+ * whole file.
+ */
+static struct cache_map *cache_map__new(const char *pathname, const struct conf_load *conf,
+					const char *sbuild_id)
+{
+	const struct cache_file_header *header;
+	struct cache_map *map;
+	struct stat st;
+	int fd = open(pathname, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header))
+		goto out_close;
+
+	map = zalloc(sizeof(*map));
+	if (map == NULL)
+		goto out_close;
+
+	map->size = st.st_size;
+	map->addr = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map->addr == MAP_FAILED)
+		goto out_free;
+
+	header = map->addr;
+	if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION ||
+	    header->byte_order != CACHE_BYTE_ORDER ||
+	    header->conf_flags != cache__conf_flags(conf) ||
+	    header->build_id_len > CACHE_MAX_BUILD_ID ||
+	    header->size != map->size ||
+	    strncmp(header->sbuild_id, sbuild_id, sizeof(header->sbuild_id)) != 0)
+		goto out_unmap;
+
+	close(fd);
+	pthread_mutex_init(&map->lock, NULL);
+	map->refcnt = 1;
+	return map;
+
+out_unmap:
+	munmap(map->addr, map->size);
+out_free:
+	free(map);
+out_close:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Checks the layout of all the CU headers, without looking at what is in
+ * the CUs, so that a truncated or mangled file is found before any CU is
+ * handed to the tool, see cache__load().
+ */
+static int cache__check_cus(const struct cache_map *map)
+{
+	const struct cache_file_header *header = map->addr;
+	const uint8_t *pos = (const uint8_t *)(header + 1), *end = (const uint8_t *)map->addr + map->size;
+	const uint64_t align_mask = CACHE_ALIGN - 1;
+	uint32_t i;
+
+	for (i = 0; i < header->nr_cus; ++i) {
+		struct cache_cu_header hdr;
+
+		if ((size_t)(end - pos) < sizeof(hdr))
+			return -EINVAL;
+
+		memcpy(&hdr, pos, sizeof(hdr));
+		if (hdr.size < sizeof(hdr) || hdr.size > (size_t)(end - pos) ||
+		    hdr.size - sizeof(hdr) != (uint64_t)hdr.records_size + hdr.strings_size ||
+		    hdr.strings_size == 0 || (hdr.records_size & align_mask) || (hdr.strings_size & align_mask) ||
+		    pos[hdr.size - 1] != '\0')
+			return -EINVAL;
+
+		pos += hdr.size;
+	}
+
+	return pos == end ? 0 : -EINVAL;
+}
+
+/*
+ * Once a CU was handed to the tool, via conf->steal() or cus__add(), falling
+ * back to the next loader would have it see those CUs twice, so from then on
+ * problems are just reported and 0 is returned.
+ */
+static int cache__load(struct cus *cus, struct conf_load *conf, const char *filename,
+		       const char *pathname, struct cache_map *map)
+{
+	const struct cache_file_header *header = map->addr;
+	const uint8_t *pos = (const uint8_t *)(header + 1);
+	struct cache_reader rd = { .specs = NULL, };
+	uint32_t i, nr_delivered = 0;
+	int err = 0;
+
+	if (cache__check_cus(map) != 0)
+		goto out_einval;
+
+	for (i = 0; i < header->nr_cus; ++i) {
+		struct cache_cu_header hdr;
+		struct cu *cu;
+
+		memcpy(&hdr, pos, sizeof(hdr));
+
+		rd.strings	= (const char *)pos + sizeof(hdr) + hdr.records_size;
+		rd.strings_size = hdr.strings_size;
+		rd.pos		= pos + sizeof(hdr);
+		rd.end		= rd.pos + hdr.records_size;
+		rd.nr_specs	= 0;
+		pos += hdr.size;
+
+		cu = cu__new(cache_reader__string(&rd, hdr.name) ?: "", hdr.addr_size,
+			     header->build_id, header->build_id_len, filename, conf->use_arena);
+		if (cu == NULL) {
+			fprintf(stderr, "%s: not enough memory to load %s from the cache\n", __func__, filename);
+			err = -ENOMEM;
+			goto out;
+		}
+
+		cu->priv	  = cache_map__get(map);
+		cu->dfops	  = &cache__ops;
+		cu->seq		  = i;
+		cu->language	  = hdr.language;
+		cu->little_endian = hdr.little_endian;
+		cu->has_addr_info = conf->get_addr_info;
+		cu->uses_global_strings = true;
+
+		if (conf->early_cu_filter && conf->early_cu_filter(cu) == NULL) {
+			cu__delete(cu);
+			continue;
+		}
+
+		if (cache__hash(CACHE_HASH_INIT, rd.pos, hdr.size - sizeof(hdr)) != hdr.checksum) {
+			cu__delete(cu);
+			goto out_einval;
+		}
+
+		rd.cu = cu;
+		if (cache_reader__cu(&rd, &hdr) != 0) {
+			cu__delete(cu);
+			goto out_einval;
+		}
+
+		int lsk = conf->steal ? conf->steal(cu, conf, NULL) : LSK__KEEPIT;
+
+		++nr_delivered;
+		if (lsk == LSK__DELETE)
+			cu__delete(cu);
+		else if (lsk == LSK__KEEPIT)
+			cus__add(cus, cu);
+		else
+			break;
+	}
+out:
+	free(rd.specs);
+	return nr_delivered ? 0 : err;
+out_einval:
+	fprintf(stderr, "%s: corrupted cache for %s\n", __func__, filename);
+	// Start over next time
+	unlink(pathname);
+	err = -EINVAL;
+	goto out;
+}
+
+static int cache__load_file(struct cus *cus, struct conf_load *conf, const char *filename)
+{
+	char dir[PATH_MAX], pathname[PATH_MAX], sbuild_id[SBUILD_ID_SIZE];
+	struct cache_map *map;
+	int err;
+
+	if (!cache__usable(conf) ||
+	    cache__pathname(conf, filename, sbuild_id, dir, pathname, sizeof(pathname)) != 0)
+		return -1;
+
+	map = cache_map__new(pathname, conf, sbuild_id);
+	if (map == NULL)
+		return cache__write(cus, conf, filename, sbuild_id, dir, pathname);
+
+	err = cache__load(cus, conf, filename, pathname, map);
+	cache_map__put(map);
+	return err;
+}
+
+struct debug_fmt_ops cache__ops = {
+	.name		    = "cache",
+	.load_file	    = cache__load_file,
+	.cu__delete	    = cache__cu_delete,
+	.has_alignment_info = true,
+};
@@ -8,6 +8,8 @@
 #include <argp.h>
 #include <assert.h>
 #include <dwarf.h>
+#include <elfutils/version.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,9 +25,11 @@ static int show_function_diffs;
 static int verbose;
 static int quiet;
 static int show_terse_type_changes;
+static int nr_jobs = 1;
 
 static struct conf_load conf_load = {
 	.get_addr_info = true,
+	.use_arena     = true,
 };
 
 static struct strlist *structs_printed;
@@ -136,6 +140,7 @@ static int check_print_change(const struct class_member *old,
 	char old_type_name[128], new_type_name[128];
 	const struct tag *old_type = cu__type(old_cu, old->tag.type);
 	const struct tag *new_type = cu__type(new_cu, new->tag.type);
+	uint32_t tchanges = 0;
 	int changes = 0;
 
 	if (old_type == NULL || new_type == NULL)
@@ -148,17 +153,17 @@ static int check_print_change(const struct class_member *old,
 
 	if (old->byte_offset != new->byte_offset) {
 		changes = 1;
-		terse_type_changes |= TCHANGEF__OFFSET;
+		tchanges |= TCHANGEF__OFFSET;
 	}
 
 	if (old->bitfield_offset != new->bitfield_offset) {
 		changes = 1;
-		terse_type_changes |= TCHANGEF__BIT_OFFSET;
+		tchanges |= TCHANGEF__BIT_OFFSET;
 	}
 
 	if (old->bitfield_size != new->bitfield_size) {
 		changes = 1;
-		terse_type_changes |= TCHANGEF__BIT_SIZE;
+		tchanges |= TCHANGEF__BIT_SIZE;
 	}
 
 	if (strcmp(tag__name(old_type, old_cu, old_type_name,
@@ -166,9 +171,16 @@ static int check_print_change(const struct class_member *old,
 		   tag__name(new_type, new_cu, new_type_name,
 			     sizeof(new_type_name), NULL)) != 0) {
 		changes = 1;
-		terse_type_changes |= TCHANGEF__TYPE;
+		tchanges |= TCHANGEF__TYPE;
 	}
 
+	/*
+	 * Only show_diffs_structure() uses these, and it resets them first, so
+	 * don't touch them when diffing, that may be done in multiple threads.
+	 */
+	if (print)
+		terse_type_changes |= tchanges;
+
 	if (changes && print && !show_terse_type_changes)
 		printf("    %s\n"
 		       "     from:    %-21s /* %5u(%2u) %5zd(%2d) */\n"
@@ -286,10 +298,19 @@ static void diff_struct(const struct cu *new_cu, struct class *structure,
 
 	assert(class__is_struct(new_structure));
 
-	diff = class__size(structure) != class__size(new_structure) ||
-	       class__nr_members(structure) != class__nr_members(new_structure) ||
-	       check_print_members_changes(structure, cu,
-			       		   new_structure, new_cu, 0) ||
+	/*
+	 * Same fingerprint: same size, members, offsets and member type
+	 * names, no need to go member by member formatting type names.
+	 */
+	if (type__fingerprint(&structure->type, cu) == type__fingerprint(&new_structure->type, new_cu))
+		diff = 0;
+	else
+		diff = class__size(structure) != class__size(new_structure) ||
+		       class__nr_members(structure) != class__nr_members(new_structure) ||
+		       check_print_members_changes(structure, cu,
+						   new_structure, new_cu, 0);
+
+	diff = diff ||
 	       structure->padding != new_structure->padding ||
 	       structure->nr_holes != new_structure->nr_holes ||
 	       structure->nr_bit_holes != new_structure->nr_bit_holes;
@@ -303,12 +324,10 @@ static void diff_struct(const struct cu *new_cu, struct class *structure,
 					 new_cu, diff);
 }
 
-static int cu_find_new_tags_iterator(struct cu *new_cu, void *old_cus)
+static void cu_find_new_tags(struct cu *new_cu, struct cu *old_cu)
 {
-	struct cu *old_cu = cus__find_pair(old_cus, new_cu->name);
-
 	if (old_cu != NULL && cu__same_build_id(old_cu, new_cu))
-		return 0;
+		return;
 
 	struct function *function;
 	uint32_t id;
@@ -346,16 +365,18 @@ static int cu_find_new_tags_iterator(struct cu *new_cu, void *old_cus)
 
 		cu__check_max_len_changed_item(new_cu, name, sizeof("struct"));
 	}
+}
 
+static int cu_find_new_tags_iterator(struct cu *new_cu, void *old_cus)
+{
+	cu_find_new_tags(new_cu, cus__find_pair(old_cus, new_cu->name));
 	return 0;
 }
 
-static int cu_diff_iterator(struct cu *cu, void *new_cus)
+static void cu_diff(struct cu *cu, struct cu *new_cu)
 {
-	struct cu *new_cu = cus__find_pair(new_cus, cu->name);
-
 	if (new_cu != NULL && cu__same_build_id(cu, new_cu))
-		return 0;
+		return;
 
 	uint32_t id;
 	struct class *class;
@@ -365,7 +386,130 @@ static int cu_diff_iterator(struct cu *cu, void *new_cus)
 	struct function *function;
 	cu__for_each_function(cu, id, function)
 		diff_function(new_cu, function, cu);
+}
+
+static int cu_diff_iterator(struct cu *cu, void *new_cus)
+{
+	cu_diff(cu, cus__find_pair(new_cus, cu->name));
+	return 0;
+}
+
+/*
+ * With --jobs the CU pairs are diffed in parallel, the results, i.e. the priv
+ * diff_info and the per CU totals, go to the CU being iterated, so the only
+ * thing shared is the paired CU, that we only read, but for the lookups
+ * caching things in it and for check_print_members_changes() marking its
+ * members as visited. So the CUs that pair with the same CU, e.g. all of them
+ * when the other side has just one CU, are diffed in sequence by one thread.
+ *
+ * The output is produced afterwards, serially, in the cus order, as without
+ * --jobs.
+ */
+struct cu_pair {
+	struct cu *cu;
+	struct cu *pair;
+	uint32_t  order;
+};
+
+struct cu_pairs {
+	struct cu_pair	*pairs;
+	uint32_t	nr_pairs;
+	uint32_t	next_pair;
+	pthread_mutex_t	mutex;
+	struct cus	*other_cus;
+	void		(*diff)(struct cu *cu, struct cu *pair);
+};
+
+static int cu_pairs__add_iterator(struct cu *cu, void *cookie)
+{
+	struct cu_pairs *pairs = cookie;
+	struct cu_pair *pair = &pairs->pairs[pairs->nr_pairs];
+
+	pair->cu    = cu;
+	pair->pair  = cus__find_pair(pairs->other_cus, cu->name);
+	pair->order = pairs->nr_pairs++;
+	return 0;
+}
+
+static int cu_pair__cmp(const void *a, const void *b)
+{
+	const struct cu_pair *pa = a, *pb = b;
+
+	if (pa->pair != pb->pair) {
+		// Unpaired CUs share nothing, but sort them together anyway
+		return (uintptr_t)pa->pair < (uintptr_t)pb->pair ? -1 : 1;
+	}
+
+	return pa->order < pb->order ? -1 : pa->order > pb->order ? 1 : 0;
+}
+
+// Takes all the CUs paired with the same CU, or just one if not paired
+static bool cu_pairs__next_group(struct cu_pairs *pairs, uint32_t *first, uint32_t *end)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&pairs->mutex);
+
+	if (pairs->next_pair < pairs->nr_pairs) {
+		struct cu *pair = pairs->pairs[pairs->next_pair].pair;
+
+		*first = pairs->next_pair++;
+		while (pair != NULL && pairs->next_pair < pairs->nr_pairs &&
+		       pairs->pairs[pairs->next_pair].pair == pair)
+			++pairs->next_pair;
+		*end = pairs->next_pair;
+		found = true;
+	}
+
+	pthread_mutex_unlock(&pairs->mutex);
+
+	return found;
+}
+
+static void *cu_pairs__diff_thread(void *arg)
+{
+	struct cu_pairs *pairs = arg;
+	uint32_t first, end;
+
+	while (cu_pairs__next_group(pairs, &first, &end)) {
+		for (; first < end; ++first)
+			pairs->diff(pairs->pairs[first].cu, pairs->pairs[first].pair);
+	}
 
+	return NULL;
+}
+
+static int cus__diff_pairs(struct cus *cus, struct cus *other_cus, void (*diff)(struct cu *cu, struct cu *pair))
+{
+	struct cu_pairs pairs = {
+		.pairs	   = malloc((cus__nr_entries(cus) ?: 1) * sizeof(struct cu_pair)),
+		.other_cus = other_cus,
+		.diff	   = diff,
+	};
+	pthread_t threads[nr_jobs];
+	int i, nr_threads = 0;
+
+	if (pairs.pairs == NULL)
+		return -ENOMEM;
+
+	cus__for_each_cu(cus, cu_pairs__add_iterator, &pairs, NULL);
+	qsort(pairs.pairs, pairs.nr_pairs, sizeof(pairs.pairs[0]), cu_pair__cmp);
+	pthread_mutex_init(&pairs.mutex, NULL);
+
+	for (i = 1; i < nr_jobs; ++i) {
+		if (pthread_create(&threads[i], NULL, cu_pairs__diff_thread, &pairs) != 0)
+			break;
+		++nr_threads;
+	}
+
+	// The main thread does its share too, and all of it if no thread could be created
+	cu_pairs__diff_thread(&pairs);
+
+	for (i = 1; i <= nr_threads; ++i)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&pairs.mutex);
+	free(pairs.pairs);
 	return 0;
 }
 
@@ -698,6 +842,8 @@ static void print_total_function_diff(const char *filename)
 /* Name and version of program.  */
 ARGP_PROGRAM_VERSION_HOOK_DEF = dwarves_print_version;
 
+#define ARGP_cache 300
+
 static const struct argp_option codiff__options[] = {
 	{
 		.key  = 's',
@@ -730,6 +876,20 @@ static const struct argp_option codiff__options[] = {
 		.name = "quiet",
 		.doc  = "Show only differences, no difference? No output",
 	},
+	{
+		.key   = 'j',
+		.name  = "jobs",
+		.arg   = "NR_JOBS",
+		.flags = OPTION_ARG_OPTIONAL, // Use sysconf(_SC_NPROCESSORS_ONLN) * 1.1 by default
+		.doc   = "run N jobs in parallel [default to number of online processors + 10%]",
+	},
+	{
+		.name  = "cache",
+		.key   = ARGP_cache,
+		.arg   = "DIR",
+		.flags = OPTION_ARG_OPTIONAL,
+		.doc   = "Cache what is loaded from DWARF, keyed by build-id [default: $XDG_CACHE_HOME/dwarves]",
+	},
 	{
 		.name = NULL,
 	}
@@ -745,6 +905,20 @@ static error_t codiff__options_parser(int key, char *arg __maybe_unused,
 	case 't': show_terse_type_changes = 1;	break;
 	case 'V': verbose = 1;			break;
 	case 'q': quiet = 1;			break;
+	case 'j': nr_jobs = arg ? atoi(arg) :
+				  sysconf(_SC_NPROCESSORS_ONLN) * 1.1;
+		  if (nr_jobs < 1)
+			  nr_jobs = 1;
+#if _ELFUTILS_PREREQ(0, 178)
+		  // Load in parallel too, but keeping the CUs in the order they are in the file
+		  conf_load.nr_jobs = nr_jobs;
+		  conf_load.in_order_steal = true;
+#endif
+		  break;
+	case ARGP_cache:
+		  conf_load.use_cache = true;
+		  conf_load.cache_dir = arg;
+		  break;
 	default:  return ARGP_ERR_UNKNOWN;
 	}
 	return 0;
@@ -825,8 +999,16 @@ failure:
 		}
 	}
 
-	cus__for_each_cu(old_cus, cu_diff_iterator, new_cus, NULL);
-	cus__for_each_cu(new_cus, cu_find_new_tags_iterator, old_cus, NULL);
+	if (nr_jobs > 1) {
+		if (cus__diff_pairs(old_cus, new_cus, cu_diff) ||
+		    cus__diff_pairs(new_cus, old_cus, cu_find_new_tags)) {
+			fputs("codiff: insufficient memory\n", stderr);
+			goto out_cus_delete_priv;
+		}
+	} else {
+		cus__for_each_cu(old_cus, cu_diff_iterator, new_cus, NULL);
+		cus__for_each_cu(new_cus, cu_find_new_tags_iterator, old_cus, NULL);
+	}
 	cus__for_each_cu(old_cus, cu_show_diffs_iterator, NULL, NULL);
 	if (cus__nr_entries(new_cus) > 1)
 		cus__for_each_cu(new_cus, cu_show_diffs_iterator, (void *)1, NULL);
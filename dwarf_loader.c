@@ -24,7 +24,6 @@
 #include "list.h"
 #include "dwarves.h"
 #include "dutil.h"
-#include "hash.h"
 
 #ifndef DW_AT_alignment
 #define DW_AT_alignment 0x88
@@ -54,14 +53,6 @@
 
 static pthread_mutex_t libdw__lock = PTHREAD_MUTEX_INITIALIZER;
 
-static uint32_t hashtags__bits = 12;
-static uint32_t max_hashtags__bits = 21;
-
-static uint32_t hashtags__fn(Dwarf_Off key)
-{
-	return hash_64(key, hashtags__bits);
-}
-
 bool no_bitfield_type_recode = true;
 
 static void __tag__print_not_supported(uint32_t tag, const char *func)
@@ -89,7 +80,6 @@ struct dwarf_off_ref {
 typedef struct dwarf_off_ref dwarf_off_ref;
 
 struct dwarf_tag {
-	struct hlist_node hash_node;
 	dwarf_off_ref	 type;
 	Dwarf_Off	 id;
 	union {
@@ -99,7 +89,8 @@ struct dwarf_tag {
 	struct tag	 *tag;
 	uint32_t         small_id;
 	uint16_t         decl_line;
-	const char	 *decl_file;
+	uint8_t		 is_type:1;
+	uint32_t	 decl_file;
 };
 
 static dwarf_off_ref dwarf_tag__spec(struct dwarf_tag *dtag)
@@ -112,50 +103,76 @@ static void dwarf_tag__set_spec(struct dwarf_tag *dtag, dwarf_off_ref spec)
 	*(dwarf_off_ref *)(dtag + 1) = spec;
 }
 
+/*
+ * The DIE offset -> dwarf_tag index: while processing the DIEs the dwarf_tags
+ * are just appended to dtags, then, before recoding, dwarf_cu__build_index()
+ * sets one bit per DIE offset in the range of offsets seen in this cu, from
+ * first_off on, and moves the dwarf_tags to the position given by the rank of
+ * their offset, i.e. the number of bits set before it.
+ *
+ * The number of bits set before each cacheline of the bitmap is kept in
+ * ranks, so a lookup is a test of a bit and at most eight popcounts.
+ */
+#define DWARF_CU_INDEX_WORDS_PER_RANK 8
+
+/*
+ * A unit's file table, whose names are in dwarf_cu->decl_files from 'first'
+ * on, so that DW_AT_decl_file 'N' is at decl_files[first + N], index zero
+ * being for tags without DW_AT_decl_file.
+ */
+struct dwarf_cu_files {
+	Dwarf_CU	*unit;
+	uint32_t	first;
+	uint32_t	nr;
+};
+
+/*
+ * dwarf_tag->decl_file is an index in dwarf_cu->decl_files, with the shard
+ * where the tag was loaded in the upper bits, see dwarf_cu__move_shard().
+ */
+#define DWARF_CU_DECL_FILE_SHARD_SHIFT 24
+#define DWARF_CU_MAX_SHARDS	       (1 << (32 - DWARF_CU_DECL_FILE_SHARD_SHIFT))
+
 struct dwarf_cu {
-	struct hlist_head *hash_tags;
-	struct hlist_head *hash_types;
+	struct dwarf_tag **dtags;
+	uint32_t	 nr_dtags;
+	uint32_t	 allocated_dtags;
+	int		 index_err;
+	uint32_t	 nr_offsets_words;
+	uint64_t	 *offsets;
+	uint32_t	 *ranks;
+	Dwarf_Off	 first_off;
 	struct dwarf_tag *last_type_lookup;
 	struct cu *cu;
 	struct dwarf_cu *type_unit;
+	int nr_shards;
+	struct cu **shards;
+	uint32_t shard_nr;
+	uint32_t nr_decl_files;
+	uint32_t allocated_decl_files;
+	const char **decl_files;
+	uint32_t nr_files;
+	uint32_t allocated_files;
+	uint32_t last_files;
+	struct dwarf_cu_files *files;
 };
 
-static int dwarf_cu__init(struct dwarf_cu *dcu, struct cu *cu)
+static void dwarf_cu__init(struct dwarf_cu *dcu, struct cu *cu)
 {
 	static struct dwarf_tag sentinel_dtag = { .id = ULLONG_MAX, };
-	uint64_t hashtags_size = 1UL << hashtags__bits;
 
+	memset(dcu, 0, sizeof(*dcu));
 	dcu->cu = cu;
-
-	dcu->hash_tags = cu__malloc(cu, sizeof(struct hlist_head) * hashtags_size);
-	if (!dcu->hash_tags)
-		return -ENOMEM;
-
-	dcu->hash_types = cu__malloc(cu, sizeof(struct hlist_head) * hashtags_size);
-	if (!dcu->hash_types) {
-		cu__free(cu, dcu->hash_tags);
-		return -ENOMEM;
-	}
-
-	unsigned int i;
-	for (i = 0; i < hashtags_size; ++i) {
-		INIT_HLIST_HEAD(&dcu->hash_tags[i]);
-		INIT_HLIST_HEAD(&dcu->hash_types[i]);
-	}
-	dcu->type_unit = NULL;
 	// To avoid a per-lookup check against NULL in dwarf_cu__find_type_by_ref()
 	dcu->last_type_lookup = &sentinel_dtag;
-	return 0;
 }
 
 static struct dwarf_cu *dwarf_cu__new(struct cu *cu)
 {
 	struct dwarf_cu *dwarf_cu = cu__zalloc(cu, sizeof(*dwarf_cu));
 
-	if (dwarf_cu != NULL && dwarf_cu__init(dwarf_cu, cu) != 0) {
-		cu__free(cu, dwarf_cu);
-		dwarf_cu = NULL;
-	}
+	if (dwarf_cu != NULL)
+		dwarf_cu__init(dwarf_cu, cu);
 
 	return dwarf_cu;
 }
@@ -166,8 +183,19 @@ static void dwarf_cu__delete(struct cu *cu)
 		return;
 
 	struct dwarf_cu *dcu = cu->priv;
+	int i;
+
+	// The tags in the shards were moved to this cu, but live in the shards arenas
+	for (i = 0; i < dcu->nr_shards; ++i)
+		cu__delete(dcu->shards[i]);
+	free(dcu->shards);
+
+	free(dcu->dtags);
+	free(dcu->offsets);
+	free(dcu->ranks);
+	free(dcu->decl_files);
+	free(dcu->files);
 
-	// dcu->hash_tags & dcu->hash_types are on cu->obstack
 	cu__free(cu, dcu);
 	cu->priv = NULL;
 }
@@ -183,39 +211,136 @@ static void __tag__print_type_not_found(struct tag *tag, const char *func)
 #define tag__print_type_not_found(tag) \
 	__tag__print_type_not_found(tag, __func__)
 
-static void hashtags__hash(struct hlist_head *hashtable,
-			   struct dwarf_tag *dtag)
+static int dwarf_cu__add_dtags(struct dwarf_cu *dcu, struct dwarf_tag **dtags, uint32_t nr_dtags)
 {
-	struct hlist_head *head = hashtable + hashtags__fn(dtag->id);
-	hlist_add_head(&dtag->hash_node, head);
+	if (dcu->nr_dtags + nr_dtags > dcu->allocated_dtags) {
+		uint32_t allocated = dcu->allocated_dtags ?: 1024;
+		struct dwarf_tag **entries;
+
+		while (allocated < dcu->nr_dtags + nr_dtags)
+			allocated *= 2;
+
+		entries = realloc(dcu->dtags, allocated * sizeof(*entries));
+		if (entries == NULL)
+			return -ENOMEM;
+
+		dcu->dtags = entries;
+		dcu->allocated_dtags = allocated;
+	}
+
+	memcpy(dcu->dtags + dcu->nr_dtags, dtags, nr_dtags * sizeof(*dtags));
+	dcu->nr_dtags += nr_dtags;
+	return 0;
 }
 
-static struct dwarf_tag *hashtags__find(const struct hlist_head *hashtable,
-					const Dwarf_Off id)
+static void cu__index_tag(struct cu *cu, struct tag *tag)
 {
-	if (id == 0)
-		return NULL;
+	struct dwarf_cu *dcu = cu->priv;
+	struct dwarf_tag *dtag = tag->priv;
 
-	struct dwarf_tag *tpos;
-	struct hlist_node *pos;
-	uint32_t bucket = hashtags__fn(id);
-	const struct hlist_head *head = hashtable + bucket;
+	dtag->is_type = tag__is_tag_type(tag);
 
-	hlist_for_each_entry(tpos, pos, head, hash_node) {
-		if (tpos->id == id)
-			return tpos;
+	// Reported by dwarf_cu__build_index(), before any lookup is made
+	if (dwarf_cu__add_dtags(dcu, &dtag, 1) != 0)
+		dcu->index_err = -ENOMEM;
+}
+
+static uint32_t dwarf_cu__offset_rank(const struct dwarf_cu *dcu, uint64_t word, uint64_t mask)
+{
+	uint32_t rank = dcu->ranks[word / DWARF_CU_INDEX_WORDS_PER_RANK];
+	uint64_t i = word - word % DWARF_CU_INDEX_WORDS_PER_RANK;
+
+	for (; i < word; ++i)
+		rank += __builtin_popcountll(dcu->offsets[i]);
+
+	return rank + __builtin_popcountll(dcu->offsets[word] & (mask - 1));
+}
+
+static int dwarf_cu__build_index(struct dwarf_cu *dcu)
+{
+	Dwarf_Off first_off = ULLONG_MAX, last_off = 0;
+	uint32_t nr_words, nr_ranks, i, rank = 0;
+	struct dwarf_tag **dtags;
+
+	if (dcu->index_err)
+		return dcu->index_err;
+
+	if (dcu->offsets != NULL || dcu->nr_dtags == 0)
+		return 0;
+
+	for (i = 0; i < dcu->nr_dtags; ++i) {
+		Dwarf_Off off = dcu->dtags[i]->id;
+
+		if (off < first_off)
+			first_off = off;
+		if (off > last_off)
+			last_off = off;
 	}
 
-	return NULL;
+	nr_words = (last_off - first_off) / 64 + 1;
+	nr_ranks = (nr_words + DWARF_CU_INDEX_WORDS_PER_RANK - 1) / DWARF_CU_INDEX_WORDS_PER_RANK;
+
+	dcu->offsets = calloc(nr_words, sizeof(dcu->offsets[0]));
+	dcu->ranks = malloc(nr_ranks * sizeof(dcu->ranks[0]));
+	dtags = malloc(dcu->nr_dtags * sizeof(dtags[0]));
+	if (dcu->offsets == NULL || dcu->ranks == NULL || dtags == NULL)
+		goto out_enomem;
+
+	dcu->first_off = first_off;
+	dcu->nr_offsets_words = nr_words;
+
+	for (i = 0; i < dcu->nr_dtags; ++i) {
+		uint64_t bit = dcu->dtags[i]->id - first_off;
+
+		dcu->offsets[bit / 64] |= 1ULL << (bit % 64);
+	}
+
+	for (i = 0; i < nr_words; ++i) {
+		if (i % DWARF_CU_INDEX_WORDS_PER_RANK == 0)
+			dcu->ranks[i / DWARF_CU_INDEX_WORDS_PER_RANK] = rank;
+		rank += __builtin_popcountll(dcu->offsets[i]);
+	}
+
+	/*
+	 * If some DIE was added more than once the last one wins, as it was
+	 * with the hashtables that were used before.
+	 */
+	for (i = 0; i < dcu->nr_dtags; ++i) {
+		uint64_t bit = dcu->dtags[i]->id - first_off;
+
+		dtags[dwarf_cu__offset_rank(dcu, bit / 64, 1ULL << (bit % 64))] = dcu->dtags[i];
+	}
+
+	free(dcu->dtags);
+	dcu->dtags = dtags;
+	dcu->nr_dtags = dcu->allocated_dtags = rank;
+	return 0;
+
+out_enomem:
+	zfree(&dcu->offsets);
+	zfree(&dcu->ranks);
+	free(dtags);
+	dcu->nr_offsets_words = 0;
+	return -ENOMEM;
 }
 
-static void cu__hash(struct cu *cu, struct tag *tag)
+static struct dwarf_tag *dwarf_cu__find_dtag(const struct dwarf_cu *dcu, const Dwarf_Off off)
 {
-	struct dwarf_cu *dcu = cu->priv;
-	struct hlist_head *hashtable = tag__is_tag_type(tag) ?
-							dcu->hash_types :
-							dcu->hash_tags;
-	hashtags__hash(hashtable, tag->priv);
+	uint64_t bit, word, mask;
+
+	if (off < dcu->first_off)
+		return NULL;
+
+	bit  = off - dcu->first_off;
+	word = bit / 64;
+	if (word >= dcu->nr_offsets_words)
+		return NULL;
+
+	mask = 1ULL << (bit % 64);
+	if ((dcu->offsets[word] & mask) == 0)
+		return NULL;
+
+	return dcu->dtags[dwarf_cu__offset_rank(dcu, word, mask)];
 }
 
 static struct dwarf_tag *dwarf_cu__find_tag_by_ref(const struct dwarf_cu *cu,
@@ -226,7 +351,10 @@ static struct dwarf_tag *dwarf_cu__find_tag_by_ref(const struct dwarf_cu *cu,
 	if (ref->from_types) {
 		return NULL;
 	}
-	return hashtags__find(cu->hash_tags, ref->off);
+
+	struct dwarf_tag *dtag = dwarf_cu__find_dtag(cu, ref->off);
+
+	return dtag && !dtag->is_type ? dtag : NULL;
 }
 
 static struct dwarf_tag *dwarf_cu__find_type_by_ref(struct dwarf_cu *dcu,
@@ -244,11 +372,12 @@ static struct dwarf_tag *dwarf_cu__find_type_by_ref(struct dwarf_cu *dcu,
 	if (dcu->last_type_lookup->id == ref->off)
 		return dcu->last_type_lookup;
 
-	struct dwarf_tag *dtag = hashtags__find(dcu->hash_types, ref->off);
+	struct dwarf_tag *dtag = dwarf_cu__find_dtag(dcu, ref->off);
 
-	if (dtag)
-		dcu->last_type_lookup = dtag;
+	if (dtag == NULL || !dtag->is_type)
+		return NULL;
 
+	dcu->last_type_lookup = dtag;
 	return dtag;
 }
 
@@ -294,12 +423,493 @@ static uint64_t __libdw_get_uleb128(uint64_t acc, uint32_t i,
 		var = __libdw_get_uleb128 (var, 1, &(addr));	\
 	} while (0)
 
+/*
+ * dwarf_attr() walks the DIE abbreviation's attribute specs, computing the
+ * size of each preceding attribute value, for each attribute asked, and we
+ * ask for several per DIE, most of them not present.
+ *
+ * So compile each abbreviation once into an array of (name, form) pairs and
+ * then find where all the attribute values for a DIE are in a single pass
+ * over its bytes, remembering the last DIE decoded, so that die__attr() is
+ * a search in a small array that returns a Dwarf_Attribute just like the
+ * one dwarf_attr() would.
+ *
+ * Forms we don't know the size of stop the pass, and then we fall back to
+ * dwarf_attr() for the attributes after it. DW_FORM_implicit_const values
+ * are in the abbreviation, not in the DIE, leave those to libdw as well.
+ *
+ * This is all per thread, the compiled abbreviations for the last few units
+ * seen being kept, see dwarf_abbrevs__reset().
+ */
+#define DWARF_ABBREV_MAX_ATTRS 32
+#define DWARF_ABBREV_NR_UNITS  4
+
+struct dwarf_abbrev_attr {
+	uint16_t name;
+	uint16_t form;
+};
+
+struct dwarf_abbrev_spec {
+	uint8_t			 nr_attrs;
+	bool			 complete; // All the attributes are in attrs[]
+	struct dwarf_abbrev_attr attrs[];
+};
+
+struct dwarf_unit_abbrevs {
+	Dwarf_CU		 *unit;
+	uint8_t			 address_size;
+	uint8_t			 offset_size;
+	uint16_t		 version;
+	uint32_t		 nr_specs;
+	struct dwarf_abbrev_spec **specs; // Indexed by abbreviation code
+};
+
+struct dwarf_die_attrs {
+	void			       *addr;
+	const struct dwarf_abbrev_spec *spec;
+	uint8_t				nr_valps;
+	unsigned char		       *valps[DWARF_ABBREV_MAX_ATTRS];
+};
+
+static __thread struct dwarf_unit_abbrevs dwarf_unit_abbrevs[DWARF_ABBREV_NR_UNITS];
+static __thread uint32_t dwarf_unit_abbrevs__next;
+static __thread struct dwarf_die_attrs dwarf_die_attrs;
+
+static void dwarf_unit_abbrevs__exit(struct dwarf_unit_abbrevs *abbrevs)
+{
+	uint32_t i;
+
+	for (i = 0; i < abbrevs->nr_specs; ++i)
+		free(abbrevs->specs[i]);
+
+	free(abbrevs->specs);
+	memset(abbrevs, 0, sizeof(*abbrevs));
+}
+
+/*
+ * Has to be called when the Dwarf handle the units come from goes away, so
+ * that a new one at the same address isn't mistaken for an old one, and at
+ * thread exit.
+ */
+static void dwarf_abbrevs__reset(void)
+{
+	int i;
+
+	for (i = 0; i < DWARF_ABBREV_NR_UNITS; ++i)
+		dwarf_unit_abbrevs__exit(&dwarf_unit_abbrevs[i]);
+
+	dwarf_unit_abbrevs__next = 0;
+	dwarf_die_attrs.addr = NULL;
+}
+
+static struct dwarf_unit_abbrevs *dwarf_unit_abbrevs__find(Dwarf_CU *unit)
+{
+	struct dwarf_unit_abbrevs *abbrevs;
+	uint8_t address_size, offset_size;
+	Dwarf_Half version;
+	int i;
+
+	for (i = 0; i < DWARF_ABBREV_NR_UNITS; ++i) {
+		if (dwarf_unit_abbrevs[i].unit == unit)
+			return &dwarf_unit_abbrevs[i];
+	}
+
+	if (dwarf_cu_info(unit, &version, NULL, NULL, NULL, NULL, &address_size, &offset_size) != 0)
+		return NULL;
+
+	abbrevs = &dwarf_unit_abbrevs[dwarf_unit_abbrevs__next];
+	dwarf_unit_abbrevs__next = (dwarf_unit_abbrevs__next + 1) % DWARF_ABBREV_NR_UNITS;
+	dwarf_unit_abbrevs__exit(abbrevs);
+
+	abbrevs->unit	      = unit;
+	abbrevs->version      = version;
+	abbrevs->address_size = address_size;
+	abbrevs->offset_size  = offset_size;
+
+	return abbrevs;
+}
+
+static struct dwarf_abbrev_spec *dwarf_abbrev_spec__new(Dwarf_Abbrev *abbrev)
+{
+	struct dwarf_abbrev_spec *spec;
+	size_t nr_attrs, i;
+
+	if (dwarf_getattrcnt(abbrev, &nr_attrs) != 0)
+		return NULL;
+
+	spec = malloc(sizeof(*spec) + (nr_attrs < DWARF_ABBREV_MAX_ATTRS ? nr_attrs : DWARF_ABBREV_MAX_ATTRS) * sizeof(spec->attrs[0]));
+	if (spec == NULL)
+		return NULL;
+
+	spec->nr_attrs = 0;
+	spec->complete = nr_attrs <= DWARF_ABBREV_MAX_ATTRS;
+
+	for (i = 0; i < nr_attrs && i < DWARF_ABBREV_MAX_ATTRS; ++i) {
+		unsigned int name, form;
+
+		if (dwarf_getabbrevattr_data(abbrev, i, &name, &form, NULL, NULL) != 0) {
+			spec->complete = false;
+			break;
+		}
+
+		spec->attrs[i].name = name;
+		spec->attrs[i].form = form;
+		++spec->nr_attrs;
+	}
+
+	return spec;
+}
+
+static const struct dwarf_abbrev_spec *dwarf_unit_abbrevs__spec(struct dwarf_unit_abbrevs *abbrevs, Dwarf_Abbrev *abbrev)
+{
+	unsigned int code = dwarf_getabbrevcode(abbrev);
+
+	if (code >= abbrevs->nr_specs) {
+		uint32_t nr_specs = abbrevs->nr_specs ?: 64;
+		struct dwarf_abbrev_spec **specs;
+
+		while (nr_specs <= code)
+			nr_specs *= 2;
+
+		specs = realloc(abbrevs->specs, nr_specs * sizeof(specs[0]));
+		if (specs == NULL)
+			return NULL;
+
+		memset(specs + abbrevs->nr_specs, 0, (nr_specs - abbrevs->nr_specs) * sizeof(specs[0]));
+		abbrevs->specs	  = specs;
+		abbrevs->nr_specs = nr_specs;
+	}
+
+	if (abbrevs->specs[code] == NULL)
+		abbrevs->specs[code] = dwarf_abbrev_spec__new(abbrev);
+
+	return abbrevs->specs[code];
+}
+
+static void skip_leb128(const uint8_t **addrp)
+{
+	while (*(*addrp)++ & 0x80)
+		;
+}
+
+/*
+ * Returns the size of an attribute value or -1 for the forms we leave for
+ * libdw to handle.
+ */
+static ssize_t dwarf_unit_abbrevs__form_len(const struct dwarf_unit_abbrevs *abbrevs, uint16_t form, const uint8_t *valp)
+{
+	const uint8_t *p = valp;
+	uint64_t len;
+
+	switch (form) {
+	case DW_FORM_flag_present:
+		return 0;
+	case DW_FORM_addrx1:
+	case DW_FORM_data1:
+	case DW_FORM_flag:
+	case DW_FORM_ref1:
+	case DW_FORM_strx1:
+		return 1;
+	case DW_FORM_addrx2:
+	case DW_FORM_data2:
+	case DW_FORM_ref2:
+	case DW_FORM_strx2:
+		return 2;
+	case DW_FORM_addrx3:
+	case DW_FORM_strx3:
+		return 3;
+	case DW_FORM_addrx4:
+	case DW_FORM_data4:
+	case DW_FORM_ref4:
+	case DW_FORM_ref_sup4:
+	case DW_FORM_strx4:
+		return 4;
+	case DW_FORM_data8:
+	case DW_FORM_ref8:
+	case DW_FORM_ref_sig8:
+	case DW_FORM_ref_sup8:
+		return 8;
+	case DW_FORM_data16:
+		return 16;
+	case DW_FORM_addr:
+		return abbrevs->address_size;
+	case DW_FORM_ref_addr:
+		return abbrevs->version == 2 ? abbrevs->address_size : abbrevs->offset_size;
+	case DW_FORM_GNU_ref_alt:
+	case DW_FORM_GNU_strp_alt:
+	case DW_FORM_line_strp:
+	case DW_FORM_sec_offset:
+	case DW_FORM_strp:
+	case DW_FORM_strp_sup:
+		return abbrevs->offset_size;
+	case DW_FORM_addrx:
+	case DW_FORM_loclistx:
+	case DW_FORM_ref_udata:
+	case DW_FORM_rnglistx:
+	case DW_FORM_sdata:
+	case DW_FORM_strx:
+	case DW_FORM_udata:
+		skip_leb128(&p);
+		return p - valp;
+	case DW_FORM_block1:
+		return 1 + *valp;
+	case DW_FORM_block:
+	case DW_FORM_exprloc:
+		get_uleb128(len, p);
+		return p - valp + len;
+	case DW_FORM_string:
+		return strlen((const char *)valp) + 1;
+	}
+
+	// DW_FORM_block2, DW_FORM_block4 need the unit byte order, DW_FORM_indirect, etc
+	return -1;
+}
+
+static const struct dwarf_die_attrs *die__decode_attrs(Dwarf_Die *die)
+{
+	struct dwarf_die_attrs *attrs = &dwarf_die_attrs;
+	struct dwarf_unit_abbrevs *abbrevs;
+	const uint8_t *p;
+	uint8_t i;
+
+	if (attrs->addr == die->addr)
+		return attrs;
+
+	// dwarf_tag() sets die->abbrev
+	if (dwarf_tag(die) == DW_TAG_invalid || die->abbrev == NULL ||
+	    (abbrevs = dwarf_unit_abbrevs__find(die->cu)) == NULL)
+		return NULL;
+
+	attrs->addr = NULL;
+	attrs->spec = dwarf_unit_abbrevs__spec(abbrevs, die->abbrev);
+	if (attrs->spec == NULL)
+		return NULL;
+
+	p = die->addr;
+	skip_leb128(&p); // the abbreviation code
+
+	for (i = 0; i < attrs->spec->nr_attrs; ++i) {
+		uint16_t form = attrs->spec->attrs[i].form;
+		ssize_t len;
+
+		if (form == DW_FORM_implicit_const) {
+			attrs->valps[i] = NULL;
+			continue;
+		}
+
+		len = dwarf_unit_abbrevs__form_len(abbrevs, form, p);
+		if (len < 0)
+			break;
+
+		attrs->valps[i] = (unsigned char *)p;
+		p += len;
+	}
+
+	attrs->nr_valps = i;
+	attrs->addr	= die->addr;
+
+	return attrs;
+}
+
+static Dwarf_Attribute *die__attr(Dwarf_Die *die, uint32_t name, Dwarf_Attribute *attr)
+{
+	const struct dwarf_die_attrs *attrs = die__decode_attrs(die);
+	uint8_t i;
+
+	if (attrs == NULL)
+		return dwarf_attr(die, name, attr);
+
+	for (i = 0; i < attrs->spec->nr_attrs; ++i) {
+		if (attrs->spec->attrs[i].name != name)
+			continue;
+
+		if (i >= attrs->nr_valps || attrs->valps[i] == NULL)
+			return dwarf_attr(die, name, attr);
+
+		attr->code = name;
+		attr->form = attrs->spec->attrs[i].form;
+		attr->valp = attrs->valps[i];
+		attr->cu   = die->cu;
+		return attr;
+	}
+
+	return attrs->spec->complete ? NULL : dwarf_attr(die, name, attr);
+}
+
+static bool die__hasattr(Dwarf_Die *die, uint32_t name)
+{
+	const struct dwarf_die_attrs *attrs = die__decode_attrs(die);
+	uint8_t i;
+
+	if (attrs == NULL)
+		return dwarf_hasattr(die, name);
+
+	for (i = 0; i < attrs->spec->nr_attrs; ++i) {
+		if (attrs->spec->attrs[i].name == name)
+			return true;
+	}
+
+	return attrs->spec->complete ? false : dwarf_hasattr(die, name);
+}
+
+static uint32_t dwarf_cu__add_decl_file(struct dwarf_cu *dcu, const char *file)
+{
+	if (dcu->nr_decl_files == dcu->allocated_decl_files) {
+		uint32_t allocated = dcu->allocated_decl_files ? dcu->allocated_decl_files * 2 : 256;
+		const char **decl_files;
+
+		if (allocated > (1U << DWARF_CU_DECL_FILE_SHARD_SHIFT))
+			return 0;
+
+		decl_files = realloc(dcu->decl_files, allocated * sizeof(decl_files[0]));
+		if (decl_files == NULL)
+			return 0;
+
+		dcu->decl_files = decl_files;
+		dcu->allocated_decl_files = allocated;
+	}
+
+	// Zero is for tags without DW_AT_decl_file
+	if (dcu->nr_decl_files == 0)
+		dcu->decl_files[dcu->nr_decl_files++] = NULL;
+
+	dcu->decl_files[dcu->nr_decl_files] = file;
+	return dcu->nr_decl_files++;
+}
+
+/*
+ * Get the file table for a unit once, then DW_AT_decl_file is just an index
+ * in it, no need to go thru dwarf_decl_file() for each tag, holding the
+ * libdw__lock. The strings are libdw's, valid till dwfl_end().
+ */
+static struct dwarf_cu_files *dwarf_cu__load_files(struct dwarf_cu *dcu, Dwarf_Die *unit_die)
+{
+	struct dwarf_cu_files *files;
+	Dwarf_Files *srcfiles;
+	size_t nr_srcfiles = 0, i;
+
+	if (dcu->nr_files == dcu->allocated_files) {
+		uint32_t allocated = dcu->allocated_files ? dcu->allocated_files * 2 : 4;
+
+		files = realloc(dcu->files, allocated * sizeof(files[0]));
+		if (files == NULL)
+			return NULL;
+
+		dcu->files = files;
+		dcu->allocated_files = allocated;
+	}
+
+	files = &dcu->files[dcu->nr_files];
+	files->unit  = unit_die->cu;
+	files->first = dcu->nr_decl_files ?: 1;
+	files->nr    = 0;
+
+	pthread_mutex_lock(&libdw__lock);
+	if (dwarf_getsrcfiles(unit_die, &srcfiles, &nr_srcfiles) != 0)
+		nr_srcfiles = 0; // No line info, we'll have no decl_file for this unit's tags
+	pthread_mutex_unlock(&libdw__lock);
+
+	for (i = 0; i < nr_srcfiles; ++i) {
+		if (dwarf_cu__add_decl_file(dcu, dwarf_filesrc(srcfiles, i, NULL, NULL)) == 0)
+			return NULL;
+	}
+
+	files->nr = nr_srcfiles;
+	dcu->last_files = dcu->nr_files++;
+	return files;
+}
+
+static int dwarf_cu__load_unit_files(struct dwarf_cu *dcu, Dwarf_Die *unit_die)
+{
+	if (!dcu->cu->extra_dbg_info)
+		return 0;
+
+	return dwarf_cu__load_files(dcu, unit_die) ? 0 : -ENOMEM;
+}
+
+/*
+ * DW_AT_decl_file & co in a DW_AT_abstract_origin or DW_AT_specification may
+ * be in some other unit, say in LTO CUs, look it up in the units seen so far.
+ */
+static struct dwarf_cu_files *dwarf_cu__find_files(struct dwarf_cu *dcu, Dwarf_CU *unit)
+{
+	Dwarf_Die unit_die;
+	uint32_t i;
+
+	if (dcu->nr_files != 0 && dcu->files[dcu->last_files].unit == unit)
+		return &dcu->files[dcu->last_files];
+
+	for (i = 0; i < dcu->nr_files; ++i) {
+		if (dcu->files[i].unit == unit) {
+			dcu->last_files = i;
+			return &dcu->files[i];
+		}
+	}
+
+	if (dwarf_cu_die(unit, &unit_die, NULL, NULL, NULL, NULL, NULL, NULL) == NULL)
+		return NULL;
+
+	return dwarf_cu__load_files(dcu, &unit_die);
+}
+
+/*
+ * Following DW_AT_abstract_origin and DW_AT_specification may have libdw
+ * looking up and adding units to its internal tables, so do it holding the
+ * libdw__lock, the common case, the attribute being in the DIE, doesn't need
+ * it.
+ */
+static Dwarf_Attribute *die__attr_integrate(Dwarf_Die *die, uint32_t name, Dwarf_Attribute *attr)
+{
+	Dwarf_Attribute *found;
+
+	if (die__attr(die, name, attr) != NULL)
+		return attr;
+
+	if (!die__hasattr(die, DW_AT_abstract_origin) && !die__hasattr(die, DW_AT_specification))
+		return NULL;
+
+	pthread_mutex_lock(&libdw__lock);
+	found = dwarf_attr_integrate(die, name, attr);
+	pthread_mutex_unlock(&libdw__lock);
+
+	return found;
+}
+
+static uint32_t dwarf_cu__decl_file(struct dwarf_cu *dcu, Dwarf_Die *die, uint32_t name)
+{
+	struct dwarf_cu_files *files;
+	Dwarf_Attribute attr;
+	Dwarf_Word idx;
+
+	if (die__attr_integrate(die, name, &attr) == NULL ||
+	    dwarf_formudata(&attr, &idx) != 0)
+		return 0;
+
+	files = dwarf_cu__find_files(dcu, attr.cu);
+	if (files == NULL || idx >= files->nr)
+		return 0;
+
+	return (dcu->shard_nr << DWARF_CU_DECL_FILE_SHARD_SHIFT) | (files->first + idx);
+}
+
+static uint32_t die__decl_line(Dwarf_Die *die)
+{
+	Dwarf_Attribute attr;
+	Dwarf_Word line;
+
+	if (die__attr_integrate(die, DW_AT_decl_line, &attr) == NULL ||
+	    dwarf_formudata(&attr, &line) != 0)
+		return 0;
+
+	return line;
+}
+
 static uint64_t attr_numeric(Dwarf_Die *die, uint32_t name)
 {
 	Dwarf_Attribute attr;
 	uint32_t form;
 
-	if (dwarf_attr(die, name, &attr) == NULL)
+	if (die__attr(die, name, &attr) == NULL)
 		return 0;
 
 	form = dwarf_whatform(&attr);
@@ -388,7 +998,7 @@ static Dwarf_Off attr_offset(Dwarf_Die *die, const uint32_t name)
 {
 	Dwarf_Attribute attr;
 
-	if (dwarf_attr(die, name, &attr) == NULL)
+	if (die__attr(die, name, &attr) == NULL)
 		return 0;
 
 	return __attr_offset(&attr);
@@ -399,7 +1009,7 @@ static const char *attr_string(Dwarf_Die *die, uint32_t name, struct conf_load *
 	const char *str = NULL;
 	Dwarf_Attribute attr;
 
-	if (dwarf_attr(die, name, &attr) != NULL) {
+	if (die__attr(die, name, &attr) != NULL) {
 		str = dwarf_formstring(&attr);
 
 		if (conf && conf->kabi_prefix && str && strncmp(str, conf->kabi_prefix, conf->kabi_prefix_len) == 0)
@@ -413,7 +1023,7 @@ static struct dwarf_off_ref attr_type(Dwarf_Die *die, uint32_t attr_name)
 {
 	Dwarf_Attribute attr;
 	struct dwarf_off_ref ref;
-	if (dwarf_attr(die, attr_name, &attr) != NULL) {
+	if (die__attr(die, attr_name, &attr) != NULL) {
 		Dwarf_Die type_die;
 		if (dwarf_formref_die(&attr, &type_die) != NULL) {
 			ref.from_types = attr.form == DW_FORM_ref_sig8;
@@ -428,7 +1038,7 @@ static struct dwarf_off_ref attr_type(Dwarf_Die *die, uint32_t attr_name)
 static int attr_location(Dwarf_Die *die, Dwarf_Op **expr, size_t *exprlen)
 {
 	Dwarf_Attribute attr;
-	if (dwarf_attr(die, DW_AT_location, &attr) != NULL) {
+	if (die__attr(die, DW_AT_location, &attr) != NULL) {
 		if (dwarf_getlocation(&attr, expr, exprlen) == 0) {
 			/* DW_OP_addrx needs additional lookup for real addr. */
 			if (*exprlen != 0 && expr[0]->atom == DW_OP_addrx) {
@@ -495,22 +1105,8 @@ static void tag__init(struct tag *tag, struct cu *cu, Dwarf_Die *die)
 	tag->recursivity_level = 0;
 
 	if (cu->extra_dbg_info) {
-		pthread_mutex_lock(&libdw__lock);
-
-		int32_t decl_line;
-		const char *decl_file = dwarf_decl_file(die);
-		static const char *last_decl_file, *last_decl_file_ptr;
-
-		if (decl_file != last_decl_file_ptr) {
-			last_decl_file = decl_file ? strdup(decl_file) : NULL;
-			last_decl_file_ptr = decl_file;
-		}
-
-		dtag->decl_file = last_decl_file;
-		dwarf_decl_line(die, &decl_line);
-		dtag->decl_line = decl_line;
-
-		pthread_mutex_unlock(&libdw__lock);
+		dtag->decl_file = dwarf_cu__decl_file(cu->priv, die, DW_AT_decl_file);
+		dtag->decl_line = die__decl_line(die);
 	}
 
 	INIT_LIST_HEAD(&tag->node);
@@ -578,7 +1174,7 @@ static struct array_type *array_type__new(Dwarf_Die *die, struct cu *cu)
 		tag__init(&at->tag, cu, die);
 		at->dimensions = 0;
 		at->nr_entries = NULL;
-		at->is_vector	 = dwarf_hasattr(die, DW_AT_GNU_vector);
+		at->is_vector	 = die__hasattr(die, DW_AT_GNU_vector);
 	}
 
 	return at;
@@ -636,7 +1232,7 @@ static void type__init(struct type *type, Dwarf_Die *die, struct cu *cu, struct
 	type->is_signed_enum	 = 0;
 
 	Dwarf_Attribute attr;
-	if (dwarf_attr(die, DW_AT_type, &attr) != NULL) {
+	if (die__attr(die, DW_AT_type, &attr) != NULL) {
 		Dwarf_Die type_die;
 		if (dwarf_formref_die(&attr, &type_die) != NULL) {
 			uint64_t encoding = attr_numeric(&type_die, DW_AT_encoding);
@@ -718,7 +1314,7 @@ static struct variable *variable__new(Dwarf_Die *die, struct cu *cu, struct conf
 	struct variable *var;
 	bool has_specification;
 
-	has_specification = dwarf_hasattr(die, DW_AT_specification);
+	has_specification = die__hasattr(die, DW_AT_specification);
 	if (has_specification) {
 		var = tag__alloc_with_spec(cu, sizeof(*var));
 	} else {
@@ -729,9 +1325,9 @@ static struct variable *variable__new(Dwarf_Die *die, struct cu *cu, struct conf
 		tag__init(&var->ip.tag, cu, die);
 		var->name = attr_string(die, DW_AT_name, conf);
 		/* variable is visible outside of its enclosing cu */
-		var->external = dwarf_hasattr(die, DW_AT_external);
+		var->external = die__hasattr(die, DW_AT_external);
 		/* non-defining declaration of an object */
-		var->declaration = dwarf_hasattr(die, DW_AT_declaration);
+		var->declaration = die__hasattr(die, DW_AT_declaration);
 		var->has_specification = has_specification;
 		var->scope = VSCOPE_UNKNOWN;
 		INIT_LIST_HEAD(&var->annots);
@@ -946,14 +1542,14 @@ static struct class_member *class_member__new(Dwarf_Die *die, struct cu *cu,
 
 		Dwarf_Attribute attr;
 
-		member->has_bit_offset = dwarf_attr(die, DW_AT_data_bit_offset, &attr) != NULL;
+		member->has_bit_offset = die__attr(die, DW_AT_data_bit_offset, &attr) != NULL;
 
 		if (member->has_bit_offset) {
 			member->bit_offset = __attr_offset(&attr);
 			// byte_offset and bitfield_offset will be recalculated later, when
 			// we discover the size of this bitfield base type.
 		} else {
-			if (dwarf_attr(die, DW_AT_data_member_location, &attr) != NULL) {
+			if (die__attr(die, DW_AT_data_member_location, &attr) != NULL) {
 				member->byte_offset = __attr_offset(&attr);
 			} else {
 				member->is_static = !in_union;
@@ -1012,8 +1608,10 @@ static struct inline_expansion *inline_expansion__new(Dwarf_Die *die, struct cu
 		struct dwarf_tag *dtag = exp->ip.tag.priv;
 
 		tag__init(&exp->ip.tag, cu, die);
-		dtag->decl_file = attr_string(die, DW_AT_call_file, conf);
-		dtag->decl_line = attr_numeric(die, DW_AT_call_line);
+		if (cu->extra_dbg_info) {
+			dtag->decl_file = dwarf_cu__decl_file(cu->priv, die, DW_AT_call_file);
+			dtag->decl_line = attr_numeric(die, DW_AT_call_line);
+		}
 		dtag->type = attr_type(die, DW_AT_abstract_origin);
 		exp->ip.addr = 0;
 		exp->high_pc = 0;
@@ -1146,9 +1744,9 @@ static struct function *function__new(Dwarf_Die *die, struct cu *cu, struct conf
 		func->name	      = attr_string(die, DW_AT_name, conf);
 		func->linkage_name    = attr_string(die, DW_AT_MIPS_linkage_name, conf);
 		func->inlined	      = attr_numeric(die, DW_AT_inline);
-		func->declaration     = dwarf_hasattr(die, DW_AT_declaration);
-		func->external	      = dwarf_hasattr(die, DW_AT_external);
-		func->abstract_origin = dwarf_hasattr(die, DW_AT_abstract_origin);
+		func->declaration     = die__hasattr(die, DW_AT_declaration);
+		func->external	      = die__hasattr(die, DW_AT_external);
+		func->abstract_origin = die__hasattr(die, DW_AT_abstract_origin);
 		dwarf_tag__set_spec(func->proto.tag.priv,
 				    attr_type(die, DW_AT_specification));
 		func->accessibility   = attr_numeric(die, DW_AT_accessibility);
@@ -1157,7 +1755,7 @@ static struct function *function__new(Dwarf_Die *die, struct cu *cu, struct conf
 		INIT_LIST_HEAD(&func->annots);
 		INIT_LIST_HEAD(&func->tool_node);
 		func->vtable_entry    = -1;
-		if (dwarf_hasattr(die, DW_AT_vtable_elem_location))
+		if (die__hasattr(die, DW_AT_vtable_elem_location))
 			func->vtable_entry = attr_offset(die, DW_AT_vtable_elem_location);
 		func->cu_total_size_inline_expansions = 0;
 		func->cu_total_nr_inline_expansions = 0;
@@ -1171,13 +1769,13 @@ static uint64_t attr_upper_bound(Dwarf_Die *die)
 {
 	Dwarf_Attribute attr;
 
-	if (dwarf_attr(die, DW_AT_upper_bound, &attr) != NULL) {
+	if (die__attr(die, DW_AT_upper_bound, &attr) != NULL) {
 		Dwarf_Word num;
 
 		if (dwarf_formudata(&attr, &num) == 0) {
 			return (uintmax_t)num + 1;
 		}
-	} else if (dwarf_attr(die, DW_AT_count, &attr) != NULL) {
+	} else if (die__attr(die, DW_AT_count, &attr) != NULL) {
 		Dwarf_Word num;
 
 		if (dwarf_formudata(&attr, &num) == 0) {
@@ -1292,7 +1890,7 @@ static struct tag *die__create_new_pointer_tag(Dwarf_Die *die, struct cu *cu,
 
 		struct dwarf_tag *dtag = annot->tag.priv;
 		dtag->small_id = id;
-		cu__hash(cu, &annot->tag);
+		cu__index_tag(cu, &annot->tag);
 
 		/* For a list of DW_TAG_LLVM_annotation like tag1 -> tag2 -> tag3,
 		 * the tag->tags contains tag3 -> tag2 -> tag1.
@@ -1323,7 +1921,8 @@ static struct tag *die__create_new_class(Dwarf_Die *die, struct cu *cu, struct c
 	    dwarf_haschildren(die) != 0 &&
 	    dwarf_child(die, &child) == 0) {
 		if (die__process_class(&child, &class->type, cu, conf) != 0) {
-			class__delete(class);
+			if (!cu->use_arena)
+				class__delete(class);
 			class = NULL;
 		}
 	}
@@ -1360,7 +1959,8 @@ static struct tag *die__create_new_union(Dwarf_Die *die, struct cu *cu, struct c
 	    dwarf_haschildren(die) != 0 &&
 	    dwarf_child(die, &child) == 0) {
 		if (die__process_class(&child, utype, cu, conf) != 0) {
-			type__delete(utype);
+			if (!cu->use_arena)
+				type__delete(utype);
 			utype = NULL;
 		}
 	}
@@ -1554,16 +2154,18 @@ static struct tag *die__create_new_subroutine_type(Dwarf_Die *die,
 		if (cu__table_add_tag(cu, tag, &id) < 0)
 			goto out_delete_tag;
 hash:
-		cu__hash(cu, tag);
+		cu__index_tag(cu, tag);
 		struct dwarf_tag *dtag = tag->priv;
 		dtag->small_id = id;
 	} while (dwarf_siblingof(die, die) == 0);
 out:
 	return &ftype->tag;
 out_delete_tag:
-	tag__delete(tag);
+	if (!cu->use_arena)
+		tag__delete(tag);
 out_delete:
-	ftype__delete(ftype);
+	if (!cu->use_arena)
+		ftype__delete(ftype);
 	return NULL;
 }
 
@@ -1653,7 +2255,7 @@ static int die__process_class(Dwarf_Die *die, struct type *class,
 			}
 
 			type__add_member(class, member);
-			cu__hash(cu, &member->tag);
+			cu__index_tag(cu, &member->tag);
 			if (add_child_llvm_annotations(die, member_idx, conf, &class->namespace.annots))
 				return -ENOMEM;
 			member_idx++;
@@ -1677,7 +2279,8 @@ static int die__process_class(Dwarf_Die *die, struct type *class,
 			uint32_t id;
 
 			if (cu__table_add_tag(cu, tag, &id) < 0) {
-				tag__delete(tag);
+				if (!cu->use_arena)
+					tag__delete(tag);
 				return -ENOMEM;
 			}
 
@@ -1685,7 +2288,7 @@ static int die__process_class(Dwarf_Die *die, struct type *class,
 			dtag->small_id = id;
 
 			namespace__add_tag(&class->namespace, tag);
-			cu__hash(cu, tag);
+			cu__index_tag(cu, tag);
 			if (tag__is_function(tag)) {
 				struct function *fself = tag__function(tag);
 
@@ -1705,6 +2308,9 @@ static int die__process_namespace(Dwarf_Die *die, struct namespace *namespace,
 {
 	struct tag *tag;
 	do {
+		if (conf->ignore_global_variables && dwarf_tag(die) == DW_TAG_variable)
+			continue;
+
 		tag = die__process_tag(die, cu, 0, conf);
 		if (tag == NULL)
 			goto out_enomem;
@@ -1722,22 +2328,45 @@ static int die__process_namespace(Dwarf_Die *die, struct namespace *namespace,
 		dtag->small_id = id;
 
 		namespace__add_tag(namespace, tag);
-		cu__hash(cu, tag);
+		cu__index_tag(cu, tag);
 	} while (dwarf_siblingof(die, die) == 0);
 
 	return 0;
 out_delete_tag:
-	tag__delete(tag);
+	if (!cu->use_arena)
+		tag__delete(tag);
 out_enomem:
 	return -ENOMEM;
 }
 
+/*
+ * Variables in functions with static storage have a DW_AT_location with just
+ * an address, look at it without going thru dwarf_getlocation(), as all we
+ * want is to skip the automatic ones.
+ */
+static bool die__has_static_location(Dwarf_Die *die)
+{
+	Dwarf_Attribute attr;
+	Dwarf_Block block;
+
+	if (die__attr(die, DW_AT_location, &attr) == NULL ||
+	    dwarf_formblock(&attr, &block) != 0 || block.length == 0)
+		return false;
+
+	return block.data[0] == DW_OP_addr || block.data[0] == DW_OP_addrx ||
+	       block.data[0] == DW_OP_GNU_addr_index;
+}
+
 static int die__process_function(Dwarf_Die *die, struct ftype *ftype,
 				  struct lexblock *lexblock, struct cu *cu, struct conf_load *conf);
 
 static int die__create_new_lexblock(Dwarf_Die *die,
 				    struct cu *cu, struct lexblock *father, struct conf_load *conf)
 {
+	// Still look inside, for types and what else the tool wants, see conf_load__set_profile()
+	if (conf->ignore_lexblocks)
+		return die__process_function(die, NULL, father, cu, conf);
+
 	struct lexblock *lexblock = lexblock__new(die, cu);
 
 	if (lexblock != NULL) {
@@ -1748,7 +2377,8 @@ static int die__create_new_lexblock(Dwarf_Die *die,
 		lexblock__add_lexblock(father, lexblock);
 	return 0;
 out_delete:
-	lexblock__delete(lexblock);
+	if (!cu->use_arena)
+		lexblock__delete(lexblock);
 	return -ENOMEM;
 }
 
@@ -1829,14 +2459,15 @@ static int die__process_inline_expansion(Dwarf_Die *die, struct lexblock *lexblo
 		if (cu__table_add_tag(cu, tag, &id) < 0)
 			goto out_delete_tag;
 hash:
-		cu__hash(cu, tag);
+		cu__index_tag(cu, tag);
 		struct dwarf_tag *dtag = tag->priv;
 		dtag->small_id = id;
 	} while (dwarf_siblingof(die, die) == 0);
 
 	return 0;
 out_delete_tag:
-	tag__delete(tag);
+	if (!cu->use_arena)
+		tag__delete(tag);
 out_enomem:
 	return -ENOMEM;
 }
@@ -1910,6 +2541,8 @@ static int die__process_function(Dwarf_Die *die, struct ftype *ftype,
 			tag = die__create_new_parameter(die, ftype, lexblock, cu, conf, param_idx++);
 			break;
 		case DW_TAG_variable:
+			if (conf->ignore_local_variables && !die__has_static_location(die))
+				continue;
 			tag = die__create_new_variable(die, cu, conf);
 			if (tag == NULL)
 				goto out_enomem;
@@ -1963,14 +2596,15 @@ static int die__process_function(Dwarf_Die *die, struct ftype *ftype,
 		if (cu__table_add_tag(cu, tag, &id) < 0)
 			goto out_delete_tag;
 hash:
-		cu__hash(cu, tag);
+		cu__index_tag(cu, tag);
 		struct dwarf_tag *dtag = tag->priv;
 		dtag->small_id = id;
 	} while (dwarf_siblingof(die, die) == 0);
 
 	return 0;
 out_delete_tag:
-	tag__delete(tag);
+	if (!cu->use_arena)
+		tag__delete(tag);
 out_enomem:
 	return -ENOMEM;
 }
@@ -1981,7 +2615,8 @@ static struct tag *die__create_new_function(Dwarf_Die *die, struct cu *cu, struc
 
 	if (function != NULL &&
 	    die__process_function(die, &function->proto, &function->lexblock, cu, conf) != 0) {
-		function__delete(function);
+		if (!cu->use_arena)
+			function__delete(function);
 		function = NULL;
 	}
 
@@ -2062,6 +2697,9 @@ static struct tag *__die__process_tag(Dwarf_Die *die, struct cu *cu,
 static int die__process_unit(Dwarf_Die *die, struct cu *cu, struct conf_load *conf)
 {
 	do {
+		if (conf->ignore_global_variables && dwarf_tag(die) == DW_TAG_variable)
+			continue;
+
 		struct tag *tag = die__process_tag(die, cu, 1, conf);
 		if (tag == NULL)
 			return -ENOMEM;
@@ -2077,7 +2715,7 @@ static int die__process_unit(Dwarf_Die *die, struct cu *cu, struct conf_load *co
 
 		uint32_t id;
 		cu__add_tag(cu, tag, &id);
-		cu__hash(cu, tag);
+		cu__index_tag(cu, tag);
 		struct dwarf_tag *dtag = tag->priv;
 		dtag->small_id = id;
 		if (tag->tag == DW_TAG_unspecified_type)
@@ -2523,7 +3161,8 @@ static int cu__recode_dwarf_types_table(struct cu *cu,
 
 static int cu__recode_dwarf_types(struct cu *cu)
 {
-	if (cu__recode_dwarf_types_table(cu, &cu->types_table, 1) ||
+	if (dwarf_cu__build_index(cu->priv) ||
+	    cu__recode_dwarf_types_table(cu, &cu->types_table, 1) ||
 	    cu__recode_dwarf_types_table(cu, &cu->tags_table, 0) ||
 	    cu__recode_dwarf_types_table(cu, &cu->functions_table, 0))
 		return -1;
@@ -2534,7 +3173,22 @@ static const char *dwarf_tag__decl_file(const struct tag *tag,
 					const struct cu *cu)
 {
 	struct dwarf_tag *dtag = tag->priv;
-	return cu->extra_dbg_info ? dtag->decl_file : NULL;
+	struct dwarf_cu *dcu = cu->priv;
+	uint32_t shard, idx;
+
+	if (!cu->extra_dbg_info || dcu == NULL || dtag->decl_file == 0)
+		return NULL;
+
+	shard = dtag->decl_file >> DWARF_CU_DECL_FILE_SHARD_SHIFT;
+	if (shard != 0) {
+		if (shard > (uint32_t)dcu->nr_shards)
+			return NULL;
+		dcu = dcu->shards[shard - 1]->priv;
+	}
+
+	idx = dtag->decl_file & ((1U << DWARF_CU_DECL_FILE_SHARD_SHIFT) - 1);
+
+	return idx < dcu->nr_decl_files ? dcu->decl_files[idx] : NULL;
 }
 
 static uint32_t dwarf_tag__decl_line(const struct tag *tag,
@@ -2589,6 +3243,9 @@ static int die__process(Dwarf_Die *die, struct cu *cu, struct conf_load *conf)
 
 	cu->language = attr_numeric(die, DW_AT_language);
 
+	if (dwarf_cu__load_unit_files(cu->priv, die) != 0)
+		return -ENOMEM;
+
 	if (dwarf_child(die, &child) == 0) {
 		int err = die__process_unit(&child, cu, conf);
 		if (err)
@@ -2758,7 +3415,7 @@ static int cu__set_common(struct cu *cu, struct conf_load *conf,
 
 static int __cus__load_debug_types(struct conf_load *conf, Dwfl_Module *mod, Dwarf *dw, Elf *elf,
 				   const char *filename, const unsigned char *build_id,
-				   int build_id_len, struct cu **cup, struct dwarf_cu *dcup)
+				   int build_id_len, struct cu **cup)
 {
 	Dwarf_Off off = 0, noff, type_off;
 	size_t cuhl;
@@ -2775,15 +3432,18 @@ static int __cus__load_debug_types(struct conf_load *conf, Dwfl_Module *mod, Dwa
 			struct cu *cu;
 
 			cu = cu__new("", pointer_size, build_id,
-				     build_id_len, filename, conf->use_obstack);
+				     build_id_len, filename, conf->use_arena);
 			if (cu == NULL ||
 			    cu__set_common(cu, conf, mod, elf) != 0) {
 				return DWARF_CB_ABORT;
 			}
 
-			if (dwarf_cu__init(dcup, cu) != 0)
+			struct dwarf_cu *dcup = dwarf_cu__new(cu);
+
+			if (dcup == NULL) {
+				cu__delete(cu);
 				return DWARF_CB_ABORT;
-			dcup->cu = cu;
+			}
 			/* Funny hack.  */
 			dcup->type_unit = dcup;
 			cu->priv = dcup;
@@ -2856,51 +3516,322 @@ static bool cus__merging_cu(Dwarf *dw, Elf *elf)
 			if (abbrev == NULL || abbrev == DWARF_END_ABBREV)
 				break;
 
-			size_t attrcnt;
-			if (dwarf_getattrcnt (abbrev, &attrcnt) != 0)
-				return false;
+			size_t attrcnt;
+			if (dwarf_getattrcnt (abbrev, &attrcnt) != 0)
+				return false;
+
+			unsigned int attr_num, attr_form;
+			Dwarf_Off aboffset;
+			size_t j;
+			for (j = 0; j < attrcnt; ++j) {
+				if (dwarf_getabbrevattr (abbrev, j, &attr_num, &attr_form,
+							 &aboffset))
+					return false;
+				if (attr_form == DW_FORM_ref_addr)
+					return true;
+			}
+
+			offset += length;
+		}
+
+		off = noff;
+	}
+
+	return false;
+}
+
+/*
+ * A CU found while pre-scanning the unit headers, see dwarf_cus__scan_units().
+ */
+struct dwarf_cus_unit {
+	Dwarf_Die	die;
+	Dwarf_Off	len;
+	uint32_t	seq;
+	uint8_t		pointer_size;
+};
+
+/*
+ * Each thread starts with its own share of the units, taking from the head,
+ * i.e. biggest first, and when that runs out it steals from the tail of the
+ * other threads' queues, i.e. the smallest ones they still have to process.
+ *
+ * The units in a queue are not stored, they are dealt round robin from the
+ * sorted dwarf_cus->units array, so queue 'nr' has units nr, nr + nr_jobs,
+ * nr + 2 * nr_jobs, etc, and head and tail are indexes in that sequence.
+ */
+struct dwarf_cus_queue {
+	pthread_mutex_t	mutex;
+	uint32_t	head;
+	uint32_t	tail;
+};
+
+/*
+ * In pipeline mode, i.e. with conf_load->nr_steal_jobs set, the -j threads
+ * just load CUs, pushing them into this bounded queue, from where the steal
+ * threads pop them and call conf_load->steal, so that loading and, say,
+ * encoding BTF overlap, with at most 'size' loaded CUs waiting.
+ */
+struct dwarf_cus_pipe {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	not_empty;
+	pthread_cond_t	not_full;
+	struct cu	**cus;
+	uint32_t	size;
+	uint32_t	head;
+	uint32_t	nr;
+	bool		done;	/* No more CUs will be pushed */
+	bool		stop;	/* A steal thread got LSK__STOP_LOADING */
+};
+
+/*
+ * With conf_load->in_order_steal the units are handed to the -j threads in
+ * .debug_info order, and the loaded CUs are parked in 'slots' till all the
+ * ones before them were stolen, so that steal() sees the same sequence as
+ * when loading serially. Whoever fills the slot for 'next_seq' becomes the
+ * deliverer, calling steal() for it and for the following ready slots.
+ *
+ * A thread may only take a unit if it is less than 'window' units past
+ * 'next_seq', this bounds the number of parked CUs when some CU takes way
+ * longer to load than the ones after it.
+ */
+struct dwarf_cus_reorder_slot {
+	struct cu	*cu;	/* NULL if filtered out by early_cu_filter() */
+	bool		ready;
+};
+
+struct dwarf_cus_reorder {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	window_moved;
+	struct dwarf_cus_reorder_slot *slots;
+	uint32_t	window;
+	uint32_t	next_seq;	/* The next CU to steal */
+	uint32_t	next_unit;	/* The next unit to load */
+	bool		delivering;
+	bool		stop;
+};
+
+struct dwarf_cus {
+	struct cus	      *cus;
+	struct conf_load      *conf;
+	Dwfl_Module	      *mod;
+	Dwarf		      *dw;
+	Elf		      *elf;
+	const char	      *filename;
+	Dwarf_Off	      off;
+	const unsigned char   *build_id;
+	int		      build_id_len;
+	int		      error;
+	struct dwarf_cu	      *type_dcu;
+	struct dwarf_cus_unit *units;
+	uint32_t	      nr_units;
+	struct dwarf_cus_queue *queues;
+	struct dwarf_cus_pipe *pipe;
+	struct dwarf_cus_reorder *reorder;
+};
+
+struct dwarf_thread {
+	struct dwarf_cus	*dcus;
+	void			*data;
+	int			nr;
+};
+
+static int dwarf_cus_pipe__init(struct dwarf_cus_pipe *pipe, uint32_t size)
+{
+	pipe->cus = malloc(size * sizeof(pipe->cus[0]));
+	if (pipe->cus == NULL)
+		return -ENOMEM;
+
+	pipe->size = size;
+	pipe->head = pipe->nr = 0;
+	pipe->done = pipe->stop = false;
+	pthread_mutex_init(&pipe->mutex, NULL);
+	pthread_cond_init(&pipe->not_empty, NULL);
+	pthread_cond_init(&pipe->not_full, NULL);
+	return 0;
+}
+
+/* Deletes the CUs not stolen, if loading was stopped or failed */
+static void dwarf_cus_pipe__exit(struct dwarf_cus_pipe *pipe)
+{
+	for (; pipe->nr != 0; --pipe->nr, pipe->head = (pipe->head + 1) % pipe->size)
+		cu__delete(pipe->cus[pipe->head]);
+
+	pthread_cond_destroy(&pipe->not_full);
+	pthread_cond_destroy(&pipe->not_empty);
+	pthread_mutex_destroy(&pipe->mutex);
+	zfree(&pipe->cus);
+}
+
+static int dwarf_cus_pipe__push(struct dwarf_cus_pipe *pipe, struct cu *cu)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&pipe->mutex);
+
+	while (pipe->nr == pipe->size && !pipe->stop)
+		pthread_cond_wait(&pipe->not_full, &pipe->mutex);
+
+	if (pipe->stop) {
+		err = -1;
+	} else {
+		pipe->cus[(pipe->head + pipe->nr++) % pipe->size] = cu;
+		pthread_cond_signal(&pipe->not_empty);
+	}
+
+	pthread_mutex_unlock(&pipe->mutex);
+	return err;
+}
+
+/* Returns NULL when there are no more CUs or loading was stopped */
+static struct cu *dwarf_cus_pipe__pop(struct dwarf_cus_pipe *pipe)
+{
+	struct cu *cu = NULL;
+
+	pthread_mutex_lock(&pipe->mutex);
+
+	while (pipe->nr == 0 && !pipe->done && !pipe->stop)
+		pthread_cond_wait(&pipe->not_empty, &pipe->mutex);
+
+	if (pipe->nr != 0 && !pipe->stop) {
+		cu = pipe->cus[pipe->head];
+		pipe->head = (pipe->head + 1) % pipe->size;
+		--pipe->nr;
+		pthread_cond_signal(&pipe->not_full);
+	}
+
+	pthread_mutex_unlock(&pipe->mutex);
+	return cu;
+}
+
+static void dwarf_cus_pipe__finish(struct dwarf_cus_pipe *pipe, bool stop)
+{
+	pthread_mutex_lock(&pipe->mutex);
+	if (stop)
+		pipe->stop = true;
+	else
+		pipe->done = true;
+	pthread_cond_broadcast(&pipe->not_empty);
+	pthread_cond_broadcast(&pipe->not_full);
+	pthread_mutex_unlock(&pipe->mutex);
+}
+
+static int dwarf_cus_reorder__init(struct dwarf_cus_reorder *reorder, uint32_t window)
+{
+	reorder->slots = calloc(window, sizeof(reorder->slots[0]));
+	if (reorder->slots == NULL)
+		return -ENOMEM;
+
+	reorder->window = window;
+	reorder->next_seq = reorder->next_unit = 0;
+	reorder->delivering = reorder->stop = false;
+	pthread_mutex_init(&reorder->mutex, NULL);
+	pthread_cond_init(&reorder->window_moved, NULL);
+	return 0;
+}
+
+/* Deletes the CUs not stolen, if loading was stopped or failed */
+static void dwarf_cus_reorder__exit(struct dwarf_cus_reorder *reorder)
+{
+	uint32_t i;
+
+	for (i = 0; i < reorder->window; ++i)
+		cu__delete(reorder->slots[i].cu);
+
+	pthread_cond_destroy(&reorder->window_moved);
+	pthread_mutex_destroy(&reorder->mutex);
+	zfree(&reorder->slots);
+}
+
+static void dwarf_cus_reorder__stop(struct dwarf_cus_reorder *reorder)
+{
+	pthread_mutex_lock(&reorder->mutex);
+	reorder->stop = true;
+	pthread_cond_broadcast(&reorder->window_moved);
+	pthread_mutex_unlock(&reorder->mutex);
+}
+
+/* Returns NULL when all units were taken or loading was stopped */
+static struct dwarf_cus_unit *dwarf_cus_reorder__next_unit(struct dwarf_cus *dcus)
+{
+	struct dwarf_cus_reorder *reorder = dcus->reorder;
+	struct dwarf_cus_unit *unit = NULL;
+
+	pthread_mutex_lock(&reorder->mutex);
+
+	while (!reorder->stop && reorder->next_unit < dcus->nr_units &&
+	       reorder->next_unit - reorder->next_seq >= reorder->window)
+		pthread_cond_wait(&reorder->window_moved, &reorder->mutex);
+
+	if (!reorder->stop && reorder->next_unit < dcus->nr_units)
+		unit = &dcus->units[reorder->next_unit++];
+
+	pthread_mutex_unlock(&reorder->mutex);
+	return unit;
+}
+
+/*
+ * Parks the CU for unit 'seq', then, if no other thread is doing it, steals
+ * all the CUs that are ready, in order, dropping the lock while in steal().
+ */
+static int dwarf_cus_reorder__add(struct dwarf_cus *dcus, uint32_t seq, struct cu *cu, void *thr_data)
+{
+	struct dwarf_cus_reorder *reorder = dcus->reorder;
+	struct dwarf_cus_reorder_slot *slot;
+	int err = DWARF_CB_OK;
+
+	pthread_mutex_lock(&reorder->mutex);
+
+	if (reorder->stop) {
+		pthread_mutex_unlock(&reorder->mutex);
+		cu__delete(cu);
+		return DWARF_CB_OK;
+	}
+
+	slot = &reorder->slots[seq % reorder->window];
+	slot->cu = cu;
+	slot->ready = true;
+
+	if (reorder->delivering) {
+		pthread_mutex_unlock(&reorder->mutex);
+		return DWARF_CB_OK;
+	}
+
+	reorder->delivering = true;
+
+	while (!reorder->stop) {
+		slot = &reorder->slots[reorder->next_seq % reorder->window];
+		if (!slot->ready)
+			break;
+
+		cu = slot->cu;
+		slot->cu = NULL;
+		slot->ready = false;
+		++reorder->next_seq;
+		pthread_cond_broadcast(&reorder->window_moved);
 
-			unsigned int attr_num, attr_form;
-			Dwarf_Off aboffset;
-			size_t j;
-			for (j = 0; j < attrcnt; ++j) {
-				if (dwarf_getabbrevattr (abbrev, j, &attr_num, &attr_form,
-							 &aboffset))
-					return false;
-				if (attr_form == DW_FORM_ref_addr)
-					return true;
-			}
+		if (cu == NULL)
+			continue;
 
-			offset += length;
-		}
+		pthread_mutex_unlock(&reorder->mutex);
 
-		off = noff;
-	}
+		if (cus__finalize(dcus->cus, cu, dcus->conf, thr_data) == LSK__STOP_LOADING)
+			err = DWARF_CB_ABORT;
 
-	return false;
-}
+		pthread_mutex_lock(&reorder->mutex);
 
-struct dwarf_cus {
-	struct cus	    *cus;
-	struct conf_load    *conf;
-	Dwfl_Module	    *mod;
-	Dwarf		    *dw;
-	Elf		    *elf;
-	const char	    *filename;
-	Dwarf_Off	    off;
-	const unsigned char *build_id;
-	int		    build_id_len;
-	int		    error;
-	struct dwarf_cu	    *type_dcu;
-};
+		if (err == DWARF_CB_ABORT) {
+			reorder->stop = true;
+			pthread_cond_broadcast(&reorder->window_moved);
+		}
+	}
 
-struct dwarf_thread {
-	struct dwarf_cus	*dcus;
-	void			*data;
-};
+	reorder->delivering = false;
+	pthread_mutex_unlock(&reorder->mutex);
+	return err;
+}
 
 static int dwarf_cus__create_and_process_cu(struct dwarf_cus *dcus, Dwarf_Die *cu_die,
-					    uint8_t pointer_size, void *thr_data)
+					    uint8_t pointer_size, uint32_t seq, void *thr_data)
 {
 	/*
 	 * DW_AT_name in DW_TAG_compile_unit can be NULL, first seen in:
@@ -2908,7 +3839,7 @@ static int dwarf_cus__create_and_process_cu(struct dwarf_cus *dcus, Dwarf_Die *c
 	 * /usr/libexec/gcc/x86_64-redhat-linux/4.3.2/ecj1.debug
 	 */
 	const char *name = attr_string(cu_die, DW_AT_name, dcus->conf);
-	struct cu *cu = cu__new(name ?: "", pointer_size, dcus->build_id, dcus->build_id_len, dcus->filename, dcus->conf->use_obstack);
+	struct cu *cu = cu__new(name ?: "", pointer_size, dcus->build_id, dcus->build_id_len, dcus->filename, dcus->conf->use_arena);
 	if (cu == NULL || cu__set_common(cu, dcus->conf, dcus->mod, dcus->elf) != 0)
 		return DWARF_CB_ABORT;
 
@@ -2920,53 +3851,188 @@ static int dwarf_cus__create_and_process_cu(struct dwarf_cus *dcus, Dwarf_Die *c
 	dcu->type_unit = dcus->type_dcu;
 	cu->priv = dcu;
 	cu->dfops = &dwarf__ops;
+	cu->seq = seq;
+
+	if (dcus->conf->early_cu_filter) {
+		cu->language = attr_numeric(cu_die, DW_AT_language);
+
+		if (dcus->conf->early_cu_filter(cu) == NULL) {
+			cu__delete(cu);
+			/* Let the CUs after this one be stolen */
+			if (dcus->reorder)
+				return dwarf_cus_reorder__add(dcus, seq, NULL, thr_data);
+			return DWARF_CB_OK;
+		}
+	}
+
+	if (die__process_and_recode(cu_die, cu, dcus->conf) != 0)
+		return DWARF_CB_ABORT;
+
+	if (dcus->reorder)
+		return dwarf_cus_reorder__add(dcus, seq, cu, thr_data);
+
+	if (dcus->pipe) {
+		if (dwarf_cus_pipe__push(dcus->pipe, cu) != 0) {
+			cu__delete(cu);
+			return DWARF_CB_ABORT;
+		}
+		return DWARF_CB_OK;
+	}
 
-	if (die__process_and_recode(cu_die, cu, dcus->conf) != 0 ||
-	    cus__finalize(dcus->cus, cu, dcus->conf, thr_data) == LSK__STOP_LOADING)
+	if (cus__finalize(dcus->cus, cu, dcus->conf, thr_data) == LSK__STOP_LOADING)
 		return DWARF_CB_ABORT;
 
        return DWARF_CB_OK;
 }
 
-static int dwarf_cus__nextcu(struct dwarf_cus *dcus, Dwarf_Die *die_mem, Dwarf_Die **cu_die, uint8_t *pointer_size, uint8_t *offset_size)
+/*
+ * Walk the unit headers just once, without holding any lock, getting the CU
+ * DIEs and the unit sizes, that we use as an estimate of how long it will
+ * take to process each of them.
+ */
+static int dwarf_cus__scan_units(struct dwarf_cus *dcus)
 {
-	Dwarf_Off noff;
+	uint32_t allocated = 0;
+	uint8_t pointer_size, offset_size;
+	Dwarf_Off off = dcus->off, noff;
 	size_t cuhl;
-	int ret;
 
-	cus__lock(dcus->cus);
+	while (dwarf_nextcu(dcus->dw, off, &noff, &cuhl, NULL, &pointer_size, &offset_size) == 0) {
+		struct dwarf_cus_unit *unit;
+
+		if (dcus->nr_units == allocated) {
+			uint32_t nr = allocated ? allocated * 2 : 256;
+
+			unit = realloc(dcus->units, nr * sizeof(*unit));
+			if (unit == NULL)
+				return -ENOMEM;
+
+			dcus->units = unit;
+			allocated = nr;
+		}
+
+		unit = &dcus->units[dcus->nr_units];
+
+		if (dwarf_offdie(dcus->dw, off + cuhl, &unit->die) == NULL)
+			break;
 
-	if (dcus->error) {
-		ret = dcus->error;
-		goto out_unlock;
+		unit->len	   = noff - off;
+		unit->seq	   = dcus->nr_units;
+		unit->pointer_size = pointer_size;
+		++dcus->nr_units;
+		off = noff;
 	}
 
-	ret = dwarf_nextcu(dcus->dw, dcus->off, &noff, &cuhl, NULL, pointer_size, offset_size);
-	if (ret == 0) {
-		*cu_die = dwarf_offdie(dcus->dw, dcus->off + cuhl, die_mem);
-		if (*cu_die != NULL)
-			dcus->off = noff;
+	return 0;
+}
+
+static int dwarf_cus_unit__cmp_len(const void *a, const void *b)
+{
+	const struct dwarf_cus_unit *ua = a, *ub = b;
+
+	return ua->len < ub->len ? 1 : ua->len > ub->len ? -1 : 0;
+}
+
+static int dwarf_cus__init_queues(struct dwarf_cus *dcus, int nr_queues)
+{
+	int i;
+
+	/* When stealing in order the units are taken in .debug_info order, no queues */
+	if (dcus->reorder)
+		return 0;
+
+	qsort(dcus->units, dcus->nr_units, sizeof(dcus->units[0]), dwarf_cus_unit__cmp_len);
+
+	dcus->queues = calloc(nr_queues, sizeof(dcus->queues[0]));
+	if (dcus->queues == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_queues; ++i) {
+		struct dwarf_cus_queue *queue = &dcus->queues[i];
+
+		pthread_mutex_init(&queue->mutex, NULL);
+		queue->head = 0;
+		queue->tail = dcus->nr_units / nr_queues + (i < (int)(dcus->nr_units % nr_queues));
 	}
 
-out_unlock:
-	cus__unlock(dcus->cus);
+	return 0;
+}
+
+static void dwarf_cus__exit_queues(struct dwarf_cus *dcus, int nr_queues)
+{
+	int i;
+
+	for (i = 0; dcus->queues && i < nr_queues; ++i)
+		pthread_mutex_destroy(&dcus->queues[i].mutex);
+
+	zfree(&dcus->queues);
+	zfree(&dcus->units);
+	dcus->nr_units = 0;
+}
+
+static struct dwarf_cus_unit *dwarf_cus__pop_unit(struct dwarf_cus *dcus, int nr, int nr_queues)
+{
+	struct dwarf_cus_queue *queue;
+	struct dwarf_cus_unit *unit = NULL;
+	int victim;
+
+	if (dcus->reorder)
+		return dwarf_cus_reorder__next_unit(dcus);
+
+	queue = &dcus->queues[nr];
+	pthread_mutex_lock(&queue->mutex);
+	if (queue->head < queue->tail)
+		unit = &dcus->units[nr + queue->head++ * nr_queues];
+	pthread_mutex_unlock(&queue->mutex);
+
+	for (victim = (nr + 1) % nr_queues; unit == NULL && victim != nr; victim = (victim + 1) % nr_queues) {
+		queue = &dcus->queues[victim];
+
+		pthread_mutex_lock(&queue->mutex);
+		if (queue->head < queue->tail)
+			unit = &dcus->units[victim + --queue->tail * nr_queues];
+		pthread_mutex_unlock(&queue->mutex);
+	}
 
-	return ret;
+	return unit;
 }
 
 static void *dwarf_cus__process_cu_thread(void *arg)
 {
 	struct dwarf_thread *dthr = arg;
 	struct dwarf_cus *dcus = dthr->dcus;
-	uint8_t pointer_size, offset_size;
-	Dwarf_Die die_mem, *cu_die;
+	struct dwarf_cus_unit *unit;
 
-	while (dwarf_cus__nextcu(dcus, &die_mem, &cu_die, &pointer_size, &offset_size) == 0) {
-		if (cu_die == NULL)
-			break;
+	while (!dcus->error && (unit = dwarf_cus__pop_unit(dcus, dthr->nr, dcus->conf->nr_jobs)) != NULL) {
+		if (dwarf_cus__create_and_process_cu(dcus, &unit->die, unit->pointer_size,
+						     unit->seq, dthr->data) == DWARF_CB_ABORT)
+			goto out_abort;
+	}
+
+	dwarf_abbrevs__reset();
+
+	/* In pipeline mode the steal threads are the ones with thread data */
+	if (dcus->pipe == NULL && dcus->conf->thread_exit &&
+	    dcus->conf->thread_exit(dcus->conf, dthr->data) != 0)
+		goto out_abort;
+
+	return (void *)DWARF_CB_OK;
+out_abort:
+	dwarf_abbrevs__reset();
+	/* Don't leave the other threads waiting for this one's CU to be stolen */
+	if (dcus->reorder)
+		dwarf_cus_reorder__stop(dcus->reorder);
+	return (void *)DWARF_CB_ABORT;
+}
+
+static void *dwarf_cus__steal_cu_thread(void *arg)
+{
+	struct dwarf_thread *dthr = arg;
+	struct dwarf_cus *dcus = dthr->dcus;
+	struct cu *cu;
 
-		if (dwarf_cus__create_and_process_cu(dcus, cu_die,
-						     pointer_size, dthr->data) == DWARF_CB_ABORT)
+	while ((cu = dwarf_cus_pipe__pop(dcus->pipe)) != NULL) {
+		if (cus__finalize(dcus->cus, cu, dcus->conf, dthr->data) == LSK__STOP_LOADING)
 			goto out_abort;
 	}
 
@@ -2976,28 +4042,91 @@ static void *dwarf_cus__process_cu_thread(void *arg)
 
 	return (void *)DWARF_CB_OK;
 out_abort:
+	dwarf_cus_pipe__finish(dcus->pipe, true);
 	return (void *)DWARF_CB_ABORT;
 }
 
+static int dwarf_cus__join_threads(pthread_t *threads, int nr_threads)
+{
+	int error = 0;
+
+	while (--nr_threads >= 0) {
+		void *res;
+		int err = pthread_join(threads[nr_threads], &res);
+
+		if (err == 0 && res != NULL)
+			error = (long)res;
+	}
+
+	return error;
+}
+
 static int dwarf_cus__threaded_process_cus(struct dwarf_cus *dcus)
 {
-	pthread_t threads[dcus->conf->nr_jobs];
-	struct dwarf_thread dthr[dcus->conf->nr_jobs];
-	void *thread_data[dcus->conf->nr_jobs];
+	int nr_steal_jobs = dcus->conf->nr_steal_jobs > 0 && !dcus->conf->in_order_steal ?
+			    dcus->conf->nr_steal_jobs : 0;
+	/* The threads that call conf_load->steal are the ones with thread data */
+	int nr_thread_data = nr_steal_jobs ?: dcus->conf->nr_jobs;
+	pthread_t threads[dcus->conf->nr_jobs], steal_threads[nr_steal_jobs ?: 1];
+	struct dwarf_thread dthr[dcus->conf->nr_jobs], steal_dthr[nr_steal_jobs ?: 1];
+	void *thread_data[nr_thread_data];
+	struct dwarf_cus_reorder reorder;
+	struct dwarf_cus_pipe pipe;
+	int nr_steal_threads = 0;
 	int res;
 	int i;
 
-	if (dcus->conf->threads_prepare) {
-		res = dcus->conf->threads_prepare(dcus->conf, dcus->conf->nr_jobs, thread_data);
+	if (dcus->conf->in_order_steal) {
+		res = dwarf_cus_reorder__init(&reorder, dcus->conf->steal_window > 0 ?
+							dcus->conf->steal_window : 4 * dcus->conf->nr_jobs);
 		if (res != 0)
 			return res;
+		dcus->reorder = &reorder;
+	}
+
+	res = dwarf_cus__scan_units(dcus);
+	if (res == 0)
+		res = dwarf_cus__init_queues(dcus, dcus->conf->nr_jobs);
+	if (res != 0) {
+		zfree(&dcus->units);
+		goto out_exit_reorder;
+	}
+
+	if (nr_steal_jobs) {
+		res = dwarf_cus_pipe__init(&pipe, dcus->conf->steal_queue_size > 0 ?
+						  dcus->conf->steal_queue_size : 2 * nr_steal_jobs);
+		if (res != 0)
+			goto out_exit_queues;
+		dcus->pipe = &pipe;
+	}
+
+	if (dcus->conf->threads_prepare) {
+		res = dcus->conf->threads_prepare(dcus->conf, nr_thread_data, thread_data);
+		if (res != 0)
+			goto out_exit_pipe;
 	} else {
-		memset(thread_data, 0, sizeof(void *) * dcus->conf->nr_jobs);
+		memset(thread_data, 0, sizeof(void *) * nr_thread_data);
+	}
+
+	for (i = 0; i < nr_steal_jobs; ++i) {
+		steal_dthr[i].dcus = dcus;
+		steal_dthr[i].data = thread_data[i];
+		steal_dthr[i].nr   = i;
+
+		dcus->error = pthread_create(&steal_threads[i], NULL,
+					     dwarf_cus__steal_cu_thread,
+					     &steal_dthr[i]);
+		if (dcus->error) {
+			i = 0;
+			goto out_join;
+		}
+		++nr_steal_threads;
 	}
 
 	for (i = 0; i < dcus->conf->nr_jobs; ++i) {
 		dthr[i].dcus = dcus;
-		dthr[i].data = thread_data[i];
+		dthr[i].data = nr_steal_jobs ? NULL : thread_data[i];
+		dthr[i].nr   = i;
 
 		dcus->error = pthread_create(&threads[i], NULL,
 					     dwarf_cus__process_cu_thread,
@@ -3009,27 +4138,48 @@ static int dwarf_cus__threaded_process_cus(struct dwarf_cus *dcus)
 	dcus->error = 0;
 
 out_join:
-	while (--i >= 0) {
-		void *res;
-		int err = pthread_join(threads[i], &res);
+	if (dcus->error && dcus->reorder)
+		dwarf_cus_reorder__stop(dcus->reorder);
 
-		if (err == 0 && res != NULL)
-			dcus->error = (long)res;
+	res = dwarf_cus__join_threads(threads, i);
+	if (res)
+		dcus->error = res;
+
+	if (nr_steal_jobs) {
+		/* If loading failed, don't wait for the steal threads to go thru what was queued */
+		dwarf_cus_pipe__finish(&pipe, dcus->error != 0);
+		res = dwarf_cus__join_threads(steal_threads, nr_steal_threads);
+		if (res && dcus->error == 0)
+			dcus->error = res;
 	}
 
 	if (dcus->conf->threads_collect) {
-		res = dcus->conf->threads_collect(dcus->conf, dcus->conf->nr_jobs,
+		res = dcus->conf->threads_collect(dcus->conf, nr_thread_data,
 						  thread_data, dcus->error);
 		if (dcus->error == 0)
 			dcus->error = res;
 	}
 
-	return dcus->error;
+	res = dcus->error;
+out_exit_pipe:
+	if (nr_steal_jobs) {
+		dwarf_cus_pipe__exit(&pipe);
+		dcus->pipe = NULL;
+	}
+out_exit_queues:
+	dwarf_cus__exit_queues(dcus, dcus->conf->nr_jobs);
+out_exit_reorder:
+	if (dcus->reorder) {
+		dwarf_cus_reorder__exit(dcus->reorder);
+		dcus->reorder = NULL;
+	}
+	return res;
 }
 
 static int __dwarf_cus__process_cus(struct dwarf_cus *dcus)
 {
 	uint8_t pointer_size, offset_size;
+	uint32_t seq = 0;
 	Dwarf_Off noff;
 	size_t cuhl;
 
@@ -3040,8 +4190,8 @@ static int __dwarf_cus__process_cus(struct dwarf_cus *dcus)
 		if (cu_die == NULL)
 			break;
 
-		if (dwarf_cus__create_and_process_cu(dcus, cu_die,
-						     pointer_size, NULL) == DWARF_CB_ABORT)
+		if (dwarf_cus__create_and_process_cu(dcus, cu_die, pointer_size,
+						     seq++, NULL) == DWARF_CB_ABORT)
 			return DWARF_CB_ABORT;
 
 		dcus->off = noff;
@@ -3058,69 +4208,241 @@ static int dwarf_cus__process_cus(struct dwarf_cus *dcus)
 	return __dwarf_cus__process_cus(dcus);
 }
 
-static int cus__merge_and_process_cu(struct cus *cus, struct conf_load *conf,
-				     Dwfl_Module *mod, Dwarf *dw, Elf *elf,
-				     const char *filename,
-				     const unsigned char *build_id,
-				     int build_id_len,
-				     struct dwarf_cu *type_dcu)
+/*
+ * When loading LTO CUs in parallel each thread processes a contiguous range
+ * of the units into its own cu, a shard, that is then moved, in order, to the
+ * merged cu, see dwarf_cu__move_shard().
+ */
+struct dwarf_cus_shard {
+	struct dwarf_cus *dcus;
+	struct cu	 *cu;
+	uint32_t	 first_unit;
+	uint32_t	 end_unit;
+	pthread_t	 thread;
+};
+
+static struct cu *dwarf_cus__new_merged_cu(struct dwarf_cus *dcus, uint8_t pointer_size,
+					   uint16_t language)
 {
-	uint8_t pointer_size, offset_size;
-	struct dwarf_cu *dcu = NULL;
-	Dwarf_Off off = 0, noff;
-	struct cu *cu = NULL;
-	size_t cuhl;
+	struct conf_load *conf = dcus->conf;
+	struct cu *cu = cu__new("", pointer_size, dcus->build_id, dcus->build_id_len,
+				dcus->filename, conf->use_arena);
+	struct dwarf_cu *dcu;
 
-	while (dwarf_nextcu(dw, off, &noff, &cuhl, NULL, &pointer_size,
-			    &offset_size) == 0) {
-		Dwarf_Die die_mem;
-		Dwarf_Die *cu_die = dwarf_offdie(dw, off + cuhl, &die_mem);
+	if (cu == NULL)
+		return NULL;
 
-		if (cu_die == NULL)
-			break;
+	if (cu__set_common(cu, conf, dcus->mod, dcus->elf) != 0)
+		goto out_delete;
 
-		if (cu == NULL) {
-			cu = cu__new("", pointer_size, build_id, build_id_len,
-				     filename, conf->use_obstack);
-			if (cu == NULL || cu__set_common(cu, conf, mod, elf) != 0)
-				goto out_abort;
+	dcu = dwarf_cu__new(cu);
+	if (dcu == NULL)
+		goto out_delete;
 
-			dcu = zalloc(sizeof(*dcu));
-			if (dcu == NULL)
-				goto out_abort;
+	dcu->type_unit = dcus->type_dcu;
+	cu->priv = dcu;
+	cu->dfops = &dwarf__ops;
+	cu->language = language;
 
-			/* Merged cu tends to need a lot more memory.
-			 * Let us start with max_hashtags__bits and
-			 * go down to find a proper hashtag bit value.
-			 */
-			uint32_t default_hbits = hashtags__bits;
-			for (hashtags__bits = max_hashtags__bits;
-			     hashtags__bits >= default_hbits;
-			     hashtags__bits--) {
-				if (dwarf_cu__init(dcu, cu) == 0)
-					break;
-			}
-			if (hashtags__bits < default_hbits)
-				goto out_abort;
+	return cu;
 
-			dcu->cu = cu;
-			dcu->type_unit = type_dcu;
-			cu->priv = dcu;
-			cu->dfops = &dwarf__ops;
-			cu->language = attr_numeric(cu_die, DW_AT_language);
-		}
+out_delete:
+	cu__delete(cu);
+	return NULL;
+}
+
+static int dwarf_cus__process_units(struct dwarf_cus *dcus, struct cu *cu,
+				    uint32_t first_unit, uint32_t end_unit)
+{
+	uint32_t i;
 
+	for (i = first_unit; i < end_unit && !dcus->error; ++i) {
 		Dwarf_Die child;
-		if (dwarf_child(cu_die, &child) == 0) {
-			if (die__process_unit(&child, cu, conf) != 0)
-				goto out_abort;
+
+		if (dwarf_cu__load_unit_files(cu->priv, &dcus->units[i].die) != 0)
+			return DWARF_CB_ABORT;
+
+		if (dwarf_child(&dcus->units[i].die, &child) == 0 &&
+		    die__process_unit(&child, cu, dcus->conf) != 0)
+			return DWARF_CB_ABORT;
+	}
+
+	return DWARF_CB_OK;
+}
+
+static void *dwarf_cus__process_shard_thread(void *arg)
+{
+	struct dwarf_cus_shard *shard = arg;
+	int err = dwarf_cus__process_units(shard->dcus, shard->cu, shard->first_unit, shard->end_unit);
+
+	dwarf_abbrevs__reset();
+	return (void *)(long)err;
+}
+
+static int cu__move_table(struct cu *cu, struct cu *shard, struct ptr_table *pt, uint32_t i)
+{
+	for (; i < pt->nr_entries; ++i) {
+		struct tag *tag = pt->entries[i];
+		struct dwarf_tag *dtag;
+		uint32_t id;
+
+		if (tag == NULL) /* void, see cu__new */
+			continue;
+
+		if (cu__table_add_tag(cu, tag, &id) < 0)
+			return -ENOMEM;
+
+		dtag = tag->priv;
+		dtag->small_id = id;
+
+		if (pt == &shard->types_table && i == shard->unspecified_type.type)
+			cu->unspecified_type.type = id;
+	}
+
+	return 0;
+}
+
+/*
+ * Move all the tags from a shard to the merged cu, appending to its tables,
+ * so that loading the shards in unit order ends up with the same small_ids
+ * as processing all the units serially into the merged cu, and to its
+ * DIE offset index, that is where the DW_FORM_ref_addr references crossing
+ * shards get resolved when recoding.
+ *
+ * The memory for the tags is still in the shard, that is kept around till
+ * the merged cu gets deleted, see dwarf_cu__delete().
+ */
+static int dwarf_cu__move_shard(struct dwarf_cu *dcu, struct cu *shard)
+{
+	struct dwarf_cu *shard_dcu = shard->priv;
+	struct cu *cu = dcu->cu;
+
+	if (cu__move_table(cu, shard, &shard->types_table, 1) ||
+	    cu__move_table(cu, shard, &shard->tags_table, 0) ||
+	    cu__move_table(cu, shard, &shard->functions_table, 0))
+		return -ENOMEM;
+
+	if (shard->unspecified_type.tag)
+		cu->unspecified_type.tag = shard->unspecified_type.tag;
+
+	if (!list_empty(&shard->tags)) {
+		__list_splice(&shard->tags, cu->tags.prev);
+		INIT_LIST_HEAD(&shard->tags);
+	}
+
+	if (shard_dcu->index_err)
+		return shard_dcu->index_err;
+
+	if (dwarf_cu__add_dtags(dcu, shard_dcu->dtags, shard_dcu->nr_dtags) != 0)
+		return -ENOMEM;
+
+	dcu->shards[dcu->nr_shards++] = shard;
+	return 0;
+}
+
+/*
+ * Split the units, in the order they appear in .debug_info, in up to nr_jobs
+ * ranges of about the same size and process each in its own thread, the first
+ * range going directly to the merged cu.
+ */
+static int dwarf_cus__threaded_process_units(struct dwarf_cus *dcus, struct cu *cu)
+{
+	int nr_shards = dcus->conf->nr_jobs < (int)dcus->nr_units ? dcus->conf->nr_jobs : (int)dcus->nr_units, i;
+
+	// The shard number has to fit in dwarf_tag->decl_file
+	if (nr_shards > DWARF_CU_MAX_SHARDS)
+		nr_shards = DWARF_CU_MAX_SHARDS;
+
+	struct dwarf_cus_shard shards[nr_shards];
+	struct dwarf_cu *dcu = cu->priv;
+	uint64_t total_len = 0, len = 0;
+	uint32_t unit = 0;
+	int err = 0;
+
+	for (i = 0; i < (int)dcus->nr_units; ++i)
+		total_len += dcus->units[i].len;
+
+	for (i = 0; i < nr_shards; ++i) {
+		shards[i].dcus	     = dcus;
+		shards[i].first_unit = unit;
+		if (i == nr_shards - 1) {
+			unit = dcus->nr_units;
+		} else {
+			do {
+				len += dcus->units[unit++].len;
+			} while (len < total_len * (i + 1) / nr_shards &&
+				 dcus->nr_units - unit > (uint32_t)(nr_shards - i - 1));
 		}
+		shards[i].end_unit = unit;
+		shards[i].cu	   = i == 0 ? cu : dwarf_cus__new_merged_cu(dcus, cu->addr_size, cu->language);
+		if (shards[i].cu == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+		((struct dwarf_cu *)shards[i].cu->priv)->shard_nr = i;
+	}
 
-		off = noff;
+	dcu->shards = calloc(nr_shards, sizeof(dcu->shards[0]));
+	if (dcu->shards == NULL)
+		err = -ENOMEM;
+
+	if (err) {
+		while (--i > 0)
+			cu__delete(shards[i].cu);
+		return err;
+	}
+
+	for (i = 1; i < nr_shards; ++i) {
+		dcus->error = pthread_create(&shards[i].thread, NULL,
+					     dwarf_cus__process_shard_thread, &shards[i]);
+		if (dcus->error)
+			break;
+	}
+
+	err = dwarf_cus__process_units(dcus, cu, shards[0].first_unit, shards[0].end_unit);
+
+	while (--i > 0) {
+		void *res;
+
+		if (pthread_join(shards[i].thread, &res) == 0 && res != NULL)
+			err = DWARF_CB_ABORT;
+	}
+
+	for (i = 1; i < nr_shards; ++i) {
+		if (err == 0 && dcus->error == 0 && dwarf_cu__move_shard(dcu, shards[i].cu) == 0)
+			continue;
+		err = DWARF_CB_ABORT;
+		cu__delete(shards[i].cu);
 	}
 
+	return err ?: dcus->error;
+}
+
+static int cus__merge_and_process_cu(struct dwarf_cus *dcus)
+{
+	struct dwarf_cus_unit *first;
+	struct cu *cu;
+	int err;
+
+	err = dwarf_cus__scan_units(dcus);
+	if (err != 0 || dcus->nr_units == 0)
+		goto out_free_units;
+
+	first = &dcus->units[0];
+	cu = dwarf_cus__new_merged_cu(dcus, first->pointer_size,
+				      attr_numeric(&first->die, DW_AT_language));
 	if (cu == NULL)
-		return 0;
+		goto out_abort;
+
+	if (dcus->conf->nr_jobs > 1 && dcus->nr_units > 1)
+		err = dwarf_cus__threaded_process_units(dcus, cu);
+	else
+		err = dwarf_cus__process_units(dcus, cu, 0, dcus->nr_units);
+
+	if (err != 0)
+		goto out_abort;
+
+	zfree(&dcus->units);
 
 	/* process merged cu */
 	if (cu__recode_dwarf_types(cu) != LSK__KEEPIT)
@@ -3135,15 +4457,17 @@ static int cus__merge_and_process_cu(struct cus *cus, struct conf_load *conf,
 	if (cu__resolve_func_ret_types(cu) != LSK__KEEPIT)
 		goto out_abort;
 
-	if (cus__finalize(cus, cu, conf, NULL) == LSK__STOP_LOADING)
+	if (cus__finalize(dcus->cus, cu, dcus->conf, NULL) == LSK__STOP_LOADING)
 		goto out_abort;
 
 	return 0;
 
 out_abort:
-	dwarf_cu__delete(cu);
 	cu__delete(cu);
-	return DWARF_CB_ABORT;
+	err = DWARF_CB_ABORT;
+out_free_units:
+	zfree(&dcus->units);
+	return err;
 }
 
 static int cus__load_module(struct cus *cus, struct conf_load *conf,
@@ -3158,11 +4482,11 @@ static int cus__load_module(struct cus *cus, struct conf_load *conf,
 	int build_id_len = 0;
 #endif
 	struct cu *type_cu;
-	struct dwarf_cu type_dcu;
 	int type_lsk = LSK__KEEPIT;
 
-	int res = __cus__load_debug_types(conf, mod, dw, elf, filename, build_id, build_id_len, &type_cu, &type_dcu);
+	int res = __cus__load_debug_types(conf, mod, dw, elf, filename, build_id, build_id_len, &type_cu);
 	if (res != 0) {
+		dwarf_abbrevs__reset();
 		return res;
 	}
 
@@ -3173,25 +4497,26 @@ static int cus__load_module(struct cus *cus, struct conf_load *conf,
 		}
 	}
 
-	if (cus__merging_cu(dw, elf)) {
-		res = cus__merge_and_process_cu(cus, conf, mod, dw, elf, filename,
-						build_id, build_id_len,
-						type_cu ? &type_dcu : NULL);
-	} else {
-		struct dwarf_cus dcus = {
-			.off      = 0,
-			.cus      = cus,
-			.conf     = conf,
-			.mod      = mod,
-			.dw       = dw,
-			.elf      = elf,
-			.filename = filename,
-			.type_dcu = type_cu ? &type_dcu : NULL,
-			.build_id = build_id,
-			.build_id_len = build_id_len,
-		};
+	struct dwarf_cus dcus = {
+		.off      = 0,
+		.cus      = cus,
+		.conf     = conf,
+		.mod      = mod,
+		.dw       = dw,
+		.elf      = elf,
+		.filename = filename,
+		.type_dcu = type_cu ? type_cu->priv : NULL,
+		.build_id = build_id,
+		.build_id_len = build_id_len,
+	};
+
+	if (cus__merging_cu(dw, elf))
+		res = cus__merge_and_process_cu(&dcus);
+	else
 		res = dwarf_cus__process_cus(&dcus);
-	}
+
+	// The units will go away with the Dwarf handle, see dwfl_end()
+	dwarf_abbrevs__reset();
 
 	if (res)
 		return res;
@@ -3315,21 +4640,6 @@ static int dwarf__load_file(struct cus *cus, struct conf_load *conf,
 {
 	int fd, err;
 
-	if (conf->max_hashtable_bits != 0) {
-		if (conf->max_hashtable_bits > 31)
-			return -E2BIG;
-
-		max_hashtags__bits = conf->max_hashtable_bits;
-	}
-
-	if (conf->hashtable_bits != 0) {
-		if (conf->hashtable_bits > max_hashtags__bits)
-			return -E2BIG;
-
-		hashtags__bits = conf->hashtable_bits;
-	} else if (hashtags__bits > max_hashtags__bits)
-		return -EINVAL;
-
 	elf_version(EV_CURRENT);
 
 	fd = open(filename, O_RDONLY);
@@ -29,43 +29,226 @@
 #include "list.h"
 #include "dwarves.h"
 #include "dutil.h"
+#include "hash.h"
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
 
-#define obstack_chunk_alloc malloc
-#define obstack_chunk_free free
+/*
+ * The first chunks are small, as most CUs are small, then they grow till
+ * CU_ARENA__CHUNK_SIZE, the size of the ones kept in the per thread cache.
+ */
+#define CU_ARENA__FIRST_CHUNK_SIZE (8 * 1024)
+#define CU_ARENA__CHUNK_SIZE	   (64 * 1024)
+#define CU_ARENA__SLAB_NR_OBJS	   16
+#define CU_ARENA__MAX_CACHED	   64
+
+struct cu_arena_chunk {
+	struct cu_arena_chunk *next;
+	size_t		      size;
+	char		      data[] __attribute__((aligned(CU_ARENA__ALIGN)));
+};
+
+struct cu_arena_cache {
+	struct cu_arena_chunk *chunks;
+	int		      nr_chunks;
+};
+
+static pthread_key_t  cu_arena__cache_key;
+static pthread_once_t cu_arena__cache_once = PTHREAD_ONCE_INIT;
 
-static void *obstack_zalloc(struct obstack *obstack, size_t size)
+static void cu_arena_cache__delete(void *arg)
 {
-	void *o = obstack_alloc(obstack, size);
+	struct cu_arena_cache *cache = arg;
+
+	while (cache->chunks != NULL) {
+		struct cu_arena_chunk *chunk = cache->chunks;
+
+		cache->chunks = chunk->next;
+		free(chunk);
+	}
+
+	free(cache);
+}
 
-	if (o)
-		memset(o, 0, size);
-	return o;
+static void cu_arena__cache_key_init(void)
+{
+	pthread_key_create(&cu_arena__cache_key, cu_arena_cache__delete);
+}
+
+static struct cu_arena_cache *cu_arena__cache(bool create)
+{
+	struct cu_arena_cache *cache;
+
+	pthread_once(&cu_arena__cache_once, cu_arena__cache_key_init);
+
+	cache = pthread_getspecific(cu_arena__cache_key);
+	if (cache == NULL && create) {
+		cache = zalloc(sizeof(*cache));
+		if (cache != NULL && pthread_setspecific(cu_arena__cache_key, cache) != 0)
+			zfree(&cache);
+	}
+
+	return cache;
+}
+
+// Release the chunks cached by the calling thread, the others do it at pthread_exit() time
+static void cu_arena__cache_exit(void)
+{
+	struct cu_arena_cache *cache = cu_arena__cache(false);
+
+	if (cache != NULL) {
+		pthread_setspecific(cu_arena__cache_key, NULL);
+		cu_arena_cache__delete(cache);
+	}
+}
+
+static struct cu_arena_chunk *cu_arena__chunk_new(size_t size)
+{
+	if (size == CU_ARENA__CHUNK_SIZE) {
+		struct cu_arena_cache *cache = cu_arena__cache(false);
+
+		if (cache != NULL && cache->chunks != NULL) {
+			struct cu_arena_chunk *chunk = cache->chunks;
+
+			cache->chunks = chunk->next;
+			--cache->nr_chunks;
+			return chunk;
+		}
+	}
+
+	struct cu_arena_chunk *chunk = malloc(sizeof(*chunk) + size);
+
+	if (chunk != NULL)
+		chunk->size = size;
+
+	return chunk;
+}
+
+static void cu_arena__chunk_delete(struct cu_arena_chunk *chunk)
+{
+	if (chunk->size == CU_ARENA__CHUNK_SIZE) {
+		struct cu_arena_cache *cache = cu_arena__cache(true);
+
+		if (cache != NULL && cache->nr_chunks < CU_ARENA__MAX_CACHED) {
+			chunk->next = cache->chunks;
+			cache->chunks = chunk;
+			++cache->nr_chunks;
+			return;
+		}
+	}
+
+	free(chunk);
+}
+
+static void cu_arena__init(struct cu_arena *arena)
+{
+	memset(arena, 0, sizeof(*arena));
+	arena->chunk_size = CU_ARENA__FIRST_CHUNK_SIZE;
+}
+
+static void cu_arena__exit(struct cu_arena *arena)
+{
+	while (arena->chunks != NULL) {
+		struct cu_arena_chunk *chunk = arena->chunks;
+
+		arena->chunks = chunk->next;
+		cu_arena__chunk_delete(chunk);
+	}
+}
+
+static void *cu_arena__alloc_from_chunk(struct cu_arena *arena, size_t size)
+{
+	if ((size_t)(arena->end - arena->pos) < size) {
+		// Too big to share a chunk, don't waste what is left in the current one
+		if (size > CU_ARENA__CHUNK_SIZE / 4) {
+			struct cu_arena_chunk *chunk = cu_arena__chunk_new(size);
+
+			if (chunk == NULL)
+				return NULL;
+
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+			return chunk->data;
+		}
+
+		while (arena->chunk_size < size)
+			arena->chunk_size *= 2;
+
+		struct cu_arena_chunk *chunk = cu_arena__chunk_new(arena->chunk_size);
+
+		if (chunk == NULL)
+			return NULL;
+
+		chunk->next   = arena->chunks;
+		arena->chunks = chunk;
+		arena->pos    = chunk->data;
+		arena->end    = chunk->data + chunk->size;
+
+		if (arena->chunk_size < CU_ARENA__CHUNK_SIZE)
+			arena->chunk_size *= 2;
+	}
+
+	void *ptr = arena->pos;
+
+	arena->pos += size;
+	return ptr;
+}
+
+static void *cu_arena__alloc(struct cu_arena *arena, size_t size)
+{
+	size = (size + CU_ARENA__ALIGN - 1) & ~(size_t)(CU_ARENA__ALIGN - 1);
+	if (size == 0)
+		size = CU_ARENA__ALIGN;
+
+	if (size > CU_ARENA__MAX_CLASS_SIZE)
+		return cu_arena__alloc_from_chunk(arena, size);
+
+	struct cu_arena_slab *slab = &arena->slabs[size / CU_ARENA__ALIGN - 1];
+
+	if ((size_t)(slab->end - slab->pos) < size) {
+		const size_t slab_size = size * CU_ARENA__SLAB_NR_OBJS;
+
+		slab->pos = cu_arena__alloc_from_chunk(arena, slab_size);
+		if (slab->pos == NULL) {
+			slab->end = NULL;
+			return NULL;
+		}
+		slab->end = slab->pos + slab_size;
+	}
+
+	void *ptr = slab->pos;
+
+	slab->pos += size;
+	return ptr;
 }
 
 void *cu__zalloc(struct cu *cu, size_t size)
 {
-	if (cu->use_obstack)
-		return obstack_zalloc(&cu->obstack, size);
+	if (cu->use_arena) {
+		void *ptr = cu_arena__alloc(&cu->arena, size);
+
+		if (ptr != NULL)
+			memset(ptr, 0, size);
+		return ptr;
+	}
 
 	return zalloc(size);
 }
 
 void *cu__malloc(struct cu *cu, size_t size)
 {
-	if (cu->use_obstack)
-		return obstack_alloc(&cu->obstack, size);
+	if (cu->use_arena)
+		return cu_arena__alloc(&cu->arena, size);
 
 	return malloc(size);
 }
 
 void cu__free(struct cu *cu, void *ptr)
 {
-	if (!cu->use_obstack)
+	if (!cu->use_arena)
 		free(ptr);
 
-	// When using an obstack we'll free everything in cu__delete()
+	// When using an arena we'll free everything in cu__delete()
 }
 
 int tag__is_base_type(const struct tag *tag, const struct cu *cu)
@@ -346,6 +529,124 @@ void __type__init(struct type *type)
 	type->member_prefix = NULL;
 	type->member_prefix_len = 0;
 	type->suffix_disambiguation = 0;
+	type->fingerprint = 0;
+}
+
+#define FINGERPRINT__INIT	14695981039346656037ULL
+#define FINGERPRINT__MAX_DEPTH	32
+
+// FNV-1a, 64-bit
+static uint64_t fingerprint__add(uint64_t fp, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len-- != 0) {
+		fp ^= *p++;
+		fp *= 1099511628211ULL;
+	}
+
+	return fp;
+}
+
+static uint64_t fingerprint__add_u64(uint64_t fp, uint64_t value)
+{
+	return fingerprint__add(fp, &value, sizeof(value));
+}
+
+// The terminating NUL is added too, so that "a" + "bc" != "ab" + "c", and NULL != ""
+static uint64_t fingerprint__add_str(uint64_t fp, const char *s)
+{
+	if (s == NULL)
+		return fingerprint__add_u64(fp, UINT64_MAX);
+
+	return fingerprint__add(fp, s, strlen(s) + 1);
+}
+
+/*
+ * Covers what tag__name() renders for a type, i.e. for named types just the
+ * kind and name, for the others what they refer to, so that comparing two of
+ * these is comparing the tag__name() strings, without formatting them.
+ */
+static uint64_t tag__name_fingerprint(uint64_t fp, const struct tag *tag, const struct cu *cu, int depth)
+{
+	if (tag == NULL)
+		return fingerprint__add_u64(fp, UINT64_MAX); // void
+
+	fp = fingerprint__add_u64(fp, tag->tag);
+
+	if (depth > FINGERPRINT__MAX_DEPTH)
+		return fp;
+
+	switch (tag->tag) {
+	case DW_TAG_base_type: {
+		const struct base_type *bt = tag__base_type(tag);
+
+		fp = fingerprint__add_str(fp, bt->name);
+		return fingerprint__add_u64(fp, (bt->name_has_encoding << 0) | (bt->is_bool << 1) |
+						(bt->is_varargs << 2) | ((uint64_t)bt->float_type << 3));
+	}
+	case DW_TAG_array_type: {
+		const struct array_type *at = tag__array_type(tag);
+		int i;
+
+		fp = fingerprint__add_u64(fp, at->dimensions | (at->is_vector << 8));
+		for (i = 0; i < at->dimensions; ++i)
+			fp = fingerprint__add_u64(fp, at->nr_entries[i]);
+		break;
+	}
+	case DW_TAG_subroutine_type: {
+		const struct ftype *ftype = tag__ftype(tag);
+		struct parameter *pos;
+
+		fp = fingerprint__add_u64(fp, ftype->nr_parms | (ftype->unspec_parms << 16));
+		ftype__for_each_parameter(ftype, pos)
+			fp = tag__name_fingerprint(fp, cu__type(cu, pos->tag.type), cu, depth + 1);
+		break;
+	}
+	default:
+		if (tag__is_type(tag))
+			return fingerprint__add_str(fp, type__name(tag__type(tag)));
+		break;
+	}
+
+	// pointers, modifiers, the array entries and the function return type
+	return tag__name_fingerprint(fp, cu__type(cu, tag->type), cu, depth + 1);
+}
+
+/*
+ * A 64-bit hash of the type's name, size and members: their names, offsets,
+ * sizes, bitfields and what tag__name() would render for their types, so
+ * that two types with different fingerprints are different and two with the
+ * same are, barring a collision, the same, with just an integer compare.
+ *
+ * Computed on first use and cached in the type, so it should be first called
+ * by the thread that owns the CU, e.g. in conf_load->steal.
+ */
+uint64_t type__fingerprint(struct type *type, const struct cu *cu)
+{
+	struct class_member *pos;
+	uint64_t fp = FINGERPRINT__INIT;
+
+	if (type->fingerprint != 0)
+		return type->fingerprint;
+
+	fp = fingerprint__add_u64(fp, type->namespace.tag.tag);
+	fp = fingerprint__add_str(fp, type__name(type));
+	fp = fingerprint__add_u64(fp, type->size);
+	fp = fingerprint__add_u64(fp, type->nr_members | ((uint64_t)type->nr_static_members << 16));
+
+	type__for_each_member(type, pos) {
+		fp = fingerprint__add_str(fp, class_member__name(pos));
+		fp = fingerprint__add_u64(fp, pos->byte_offset);
+		fp = fingerprint__add_u64(fp, pos->bit_offset);
+		fp = fingerprint__add_u64(fp, pos->byte_size);
+		fp = fingerprint__add_u64(fp, (uint8_t)pos->bitfield_offset | (pos->bitfield_size << 8) |
+					      (pos->is_static << 16));
+		fp = tag__name_fingerprint(fp, cu__type(cu, pos->tag.type), cu, 0);
+	}
+
+	type->fingerprint = fp ?: 1;
+	return type->fingerprint;
 }
 
 struct class_member *
@@ -428,14 +729,111 @@ static void cu__find_class_holes(struct cu *cu)
 		class__find_holes(pos);
 }
 
+struct cus_name_index;
+struct cus_addr_index;
+
 struct cus {
 	uint32_t	 nr_entries;
 	struct list_head cus;
 	pthread_mutex_t  mutex;
 	void		 (*loader_exit)(struct cus *cus);
 	void		 *priv; // Used in dwarf_loader__exit()
+	struct cus_name_index *name_index; // Built on the first cus__find_*_by_name()
+	struct cus_addr_index *addr_index; // Built on the first cus__find_function*_at_addr*()
+	struct {
+		struct cus_cu_bucket *buckets; // By cu->name, for cus__find_pair()
+		uint32_t	     mask;
+		uint32_t	     nr;
+	} cu_names;
+};
+
+static void cus__addr_index_delete(struct cus *cus);
+
+/*
+ * The first CU added with a given name, so that __cus__find_cu_by_name()
+ * returns the same as walking the list, without strcmp()ing all the CUs,
+ * which made pairing the CUs in two multi-CU files, as codiff does, O(n^2).
+ */
+struct cus_cu_bucket {
+	const char *name;
+	uint32_t   hash;
+	struct cu  *cu;
 };
 
+static struct cus_cu_bucket *cus__cu_bucket(const struct cus *cus, const char *name, uint32_t hash)
+{
+	uint32_t i = hash & cus->cu_names.mask;
+
+	for (;; i = (i + 1) & cus->cu_names.mask) {
+		struct cus_cu_bucket *bucket = &cus->cu_names.buckets[i];
+
+		if (bucket->name == NULL || (bucket->hash == hash && strcmp(bucket->name, name) == 0))
+			return bucket;
+	}
+}
+
+static int cus__grow_cu_names(struct cus *cus)
+{
+	uint32_t i, nr_slots = cus->cu_names.buckets ? (cus->cu_names.mask + 1) * 2 : 256;
+	struct cus_cu_bucket *old = cus->cu_names.buckets, *buckets = calloc(nr_slots, sizeof(*buckets));
+
+	if (buckets == NULL)
+		return -ENOMEM;
+
+	for (i = 0; old != NULL && i <= cus->cu_names.mask; ++i) {
+		uint32_t slot;
+
+		if (old[i].name == NULL)
+			continue;
+
+		for (slot = old[i].hash & (nr_slots - 1); buckets[slot].name != NULL; slot = (slot + 1) & (nr_slots - 1))
+			;
+		buckets[slot] = old[i];
+	}
+
+	free(old);
+	cus->cu_names.buckets = buckets;
+	cus->cu_names.mask = nr_slots - 1;
+	return 0;
+}
+
+static void cus__delete_cu_names(struct cus *cus)
+{
+	zfree(&cus->cu_names.buckets);
+	cus->cu_names.mask = cus->cu_names.nr = 0;
+}
+
+// If we can't grow the hash table, __cus__find_cu_by_name() goes back to walking the list
+static void cus__add_cu_name(struct cus *cus, struct cu *cu)
+{
+	struct cus_cu_bucket *bucket;
+	size_t len;
+	uint32_t hash;
+
+	if (cu->name == NULL)
+		return;
+
+	if (cus->cu_names.buckets == NULL) {
+		// Only index the CUs if all were indexed
+		if (cus->nr_entries != 1 || cus__grow_cu_names(cus))
+			return;
+	} else if ((cus->cu_names.nr + 1) * 4 > (cus->cu_names.mask + 1) * 3 && cus__grow_cu_names(cus)) {
+		cus__delete_cu_names(cus);
+		return;
+	}
+
+	hash = hash_str(cu->name, &len);
+	bucket = cus__cu_bucket(cus, cu->name, hash);
+	if (bucket->name == NULL) {
+		bucket->name = cu->name;
+		bucket->hash = hash;
+		bucket->cu   = cu;
+		++cus->cu_names.nr;
+	}
+}
+
+static int cus__name_index_add(struct cus *cus, struct cu *cu);
+
 void cus__lock(struct cus *cus)
 {
 	pthread_mutex_lock(&cus->mutex);
@@ -462,6 +860,11 @@ void cus__add(struct cus *cus, struct cu *cu)
 
 	cus->nr_entries++;
 	list_add_tail(&cu->node, &cus->cus);
+	cus__add_cu_name(cus, cu);
+	if (cus->name_index)
+		cus__name_index_add(cus, cu);
+	// New functions may shadow the intervals, rebuild on the next lookup
+	cus__addr_index_delete(cus);
 
 	cus__unlock(cus);
 
@@ -535,6 +938,281 @@ static void *ptr_table__entry(const struct ptr_table *pt, uint32_t id)
 	return id >= pt->nr_entries ? NULL : pt->entries[id];
 }
 
+/*
+ * Lazily built index for the cu__find_*_by_name() lookups, that otherwise
+ * would go thru the whole types_table, formatting base type names as they go.
+ *
+ * Each type is added with one key per kind of lookup it may satisfy, and per
+ * key we keep the first type id, and the first that isn't a declaration, as
+ * that is what the linear searches would return. Type id 0 is void, so it is
+ * used for "none".
+ *
+ * As the CUs themselves, this isn't thread safe, a CU is only looked up by the
+ * thread that owns it at that point.
+ */
+enum cu_name_index_kind {
+	CU_NAME_INDEX__TYPE,		/* tag__is_type() */
+	CU_NAME_INDEX__STRUCT,		/* tag__is_struct() */
+	CU_NAME_INDEX__STRUCT_OR_UNION,
+	CU_NAME_INDEX__BASE_TYPE,	/* base_type__name() */
+	CU_NAME_INDEX__ENUMERATION,
+};
+
+struct cu_name_index_entry {
+	const char *name;
+	uint32_t   hash;
+	uint32_t   bit_size;
+	uint8_t	   kind;
+	bool	   sized;	/* Also keyed by bit_size */
+	bool	   owns_name;
+	type_id_t  first;
+	type_id_t  first_def;
+};
+
+struct cu_name_index {
+	struct cu_name_index_entry *entries;
+	uint32_t		   mask;
+	uint32_t		   nr;
+};
+
+static uint32_t cu_name_index__hash(const char *name, enum cu_name_index_kind kind, bool sized, uint32_t bit_size)
+{
+	size_t len;
+
+	return hash_str(name, &len) ^ (kind * 0x9e3779b9U) ^ (sized ? hash_64(bit_size + 1, 32) : 0);
+}
+
+static struct cu_name_index_entry *cu_name_index__slot(struct cu_name_index *index, const char *name, uint32_t hash,
+						       enum cu_name_index_kind kind, bool sized, uint32_t bit_size)
+{
+	uint32_t i = hash & index->mask;
+
+	for (;; i = (i + 1) & index->mask) {
+		struct cu_name_index_entry *entry = &index->entries[i];
+
+		if (entry->name == NULL ||
+		    (entry->hash == hash && entry->kind == kind && entry->sized == sized &&
+		     entry->bit_size == bit_size && strcmp(entry->name, name) == 0))
+			return entry;
+	}
+}
+
+static int cu_name_index__grow(struct cu_name_index *index)
+{
+	uint32_t i, nr_slots = index->entries ? (index->mask + 1) * 2 : 256;
+	struct cu_name_index_entry *old = index->entries, *entries = calloc(nr_slots, sizeof(*entries));
+
+	if (entries == NULL)
+		return -ENOMEM;
+
+	for (i = 0; old != NULL && i <= index->mask; ++i) {
+		uint32_t slot;
+
+		if (old[i].name == NULL)
+			continue;
+
+		// The keys are unique, just look for a free slot
+		for (slot = old[i].hash & (nr_slots - 1); entries[slot].name != NULL; slot = (slot + 1) & (nr_slots - 1))
+			;
+		entries[slot] = old[i];
+	}
+
+	free(old);
+	index->entries = entries;
+	index->mask = nr_slots - 1;
+	return 0;
+}
+
+static int cu_name_index__add_key(struct cu_name_index *index, const char *name, enum cu_name_index_kind kind,
+				  bool sized, uint32_t bit_size, bool declaration, type_id_t id)
+{
+	struct cu_name_index_entry *entry;
+	uint32_t hash;
+
+	if (name == NULL)
+		return 0;
+
+	if (index->entries == NULL || (index->nr + 1) * 4 > (index->mask + 1) * 3) {
+		if (cu_name_index__grow(index))
+			return -ENOMEM;
+	}
+
+	hash = cu_name_index__hash(name, kind, sized, bit_size);
+	entry = cu_name_index__slot(index, name, hash, kind, sized, bit_size);
+
+	if (entry->name == NULL) {
+		entry->name	 = name;
+		entry->hash	 = hash;
+		entry->kind	 = kind;
+		entry->sized	 = sized;
+		entry->bit_size	 = bit_size;
+		entry->owns_name = false;
+		++index->nr;
+	}
+
+	/* cu__table_add_tag_with_id() may add out of order */
+	if (entry->first == 0 || id < entry->first)
+		entry->first = id;
+
+	if (!declaration && (entry->first_def == 0 || id < entry->first_def))
+		entry->first_def = id;
+
+	return 0;
+}
+
+/*
+ * base_type__name() may format the name, e.g. "float complex", so keep a copy
+ * of it, once per name, in the unsized key entry, that then owns it.
+ */
+static const char *cu_name_index__add_formatted_name(struct cu_name_index *index, const char *name, type_id_t id)
+{
+	uint32_t hash = cu_name_index__hash(name, CU_NAME_INDEX__BASE_TYPE, false, 0);
+	struct cu_name_index_entry *entry;
+	char *copy;
+
+	if (index->entries != NULL) {
+		entry = cu_name_index__slot(index, name, hash, CU_NAME_INDEX__BASE_TYPE, false, 0);
+		if (entry->name != NULL)
+			return entry->name;
+	}
+
+	copy = strdup(name);
+	if (copy == NULL)
+		return NULL;
+
+	if (cu_name_index__add_key(index, copy, CU_NAME_INDEX__BASE_TYPE, false, 0, false, id) != 0) {
+		free(copy);
+		return NULL;
+	}
+
+	cu_name_index__slot(index, copy, hash, CU_NAME_INDEX__BASE_TYPE, false, 0)->owns_name = true;
+	return copy;
+}
+
+static int cu__name_index_add(struct cu *cu, struct tag *tag, type_id_t id)
+{
+	struct cu_name_index *index = cu->name_index;
+	int err;
+
+	if (tag == NULL)
+		return 0;
+
+	if (tag->tag == DW_TAG_base_type) {
+		const struct base_type *bt = tag__base_type(tag);
+		const char *name = bt->name;
+
+		if (!bt->name_has_encoding) {
+			char bf[64];
+			const char *bname = base_type__name(bt, bf, sizeof(bf));
+
+			if (bt->name == NULL || strcmp(bname, bt->name) != 0) {
+				name = cu_name_index__add_formatted_name(index, bname, id);
+				if (name == NULL)
+					return -ENOMEM;
+			}
+		}
+
+		return cu_name_index__add_key(index, name, CU_NAME_INDEX__BASE_TYPE, false, 0, false, id) ?:
+		       cu_name_index__add_key(index, name, CU_NAME_INDEX__BASE_TYPE, true, bt->bit_size, false, id);
+	}
+
+	if (!tag__is_type(tag))
+		return 0;
+
+	const struct type *type = tag__type(tag);
+	const char *name = type__name(type);
+	bool decl = type->declaration;
+
+	err = cu_name_index__add_key(index, name, CU_NAME_INDEX__TYPE, false, 0, decl, id);
+
+	if (err == 0 && tag__is_struct(tag))
+		err = cu_name_index__add_key(index, name, CU_NAME_INDEX__STRUCT, false, 0, decl, id);
+
+	if (err == 0 && (tag__is_struct(tag) || tag__is_union(tag)))
+		err = cu_name_index__add_key(index, name, CU_NAME_INDEX__STRUCT_OR_UNION, false, 0, decl, id);
+
+	if (err == 0 && tag__is_enumeration(tag)) {
+		err = cu_name_index__add_key(index, name, CU_NAME_INDEX__ENUMERATION, false, 0, false, id) ?:
+		      cu_name_index__add_key(index, name, CU_NAME_INDEX__ENUMERATION, true, type->size, false, id);
+	}
+
+	return err;
+}
+
+static void cu__name_index_delete(struct cu *cu)
+{
+	struct cu_name_index *index = cu->name_index;
+	uint32_t i;
+
+	if (index == NULL)
+		return;
+
+	for (i = 0; index->entries && i <= index->mask; ++i) {
+		if (index->entries[i].owns_name)
+			free((char *)index->entries[i].name);
+	}
+
+	free(index->entries);
+	zfree(&cu->name_index);
+}
+
+static struct cu_name_index *cu__name_index(const struct cu *cu)
+{
+	struct cu *ncu = (struct cu *)cu; // The index is a cache, built on demand
+	uint32_t id;
+	struct tag *pos;
+
+	if (cu->name_index)
+		return cu->name_index;
+
+	ncu->name_index = zalloc(sizeof(*ncu->name_index));
+	if (ncu->name_index == NULL)
+		return NULL;
+
+	cu__for_each_type(cu, id, pos) {
+		if (cu__name_index_add(ncu, pos, id) != 0) {
+			cu__name_index_delete(ncu);
+			return NULL;
+		}
+	}
+
+	return ncu->name_index;
+}
+
+/*
+ * Returns the first type id for the key, or the first that isn't a
+ * declaration if !include_decls, -1 if the index couldn't be built,
+ * so that the caller falls back to the linear search, 0 if not found.
+ */
+static int64_t cu__name_index_find(const struct cu *cu, const char *name, enum cu_name_index_kind kind,
+				   bool sized, uint32_t bit_size, bool include_decls)
+{
+	struct cu_name_index *index = cu__name_index(cu);
+	struct cu_name_index_entry *entry;
+
+	if (index == NULL)
+		return -1;
+
+	if (index->entries == NULL)
+		return 0;
+
+	entry = cu_name_index__slot(index, name, cu_name_index__hash(name, kind, sized, bit_size), kind, sized, bit_size);
+	if (entry->name == NULL)
+		return 0;
+
+	return include_decls ? entry->first : entry->first_def;
+}
+
+static struct tag *cu__name_index_type(const struct cu *cu, int64_t id, type_id_t *idp)
+{
+	if (id == 0)
+		return NULL;
+
+	if (idp != NULL)
+		*idp = id;
+	return cu__type(cu, id);
+}
+
 static void cu__insert_function(struct cu *cu, struct tag *tag)
 {
 	struct function *function = tag__function(tag);
@@ -565,11 +1243,18 @@ int cu__table_add_tag(struct cu *cu, struct tag *tag, uint32_t *type_id)
 		cu__insert_function(cu, tag);
 	}
 
-	return ptr_table__add(pt, tag, type_id) ? -ENOMEM : 0;
+	if (ptr_table__add(pt, tag, type_id))
+		return -ENOMEM;
+
+	if (cu->name_index && pt == &cu->types_table)
+		return cu__name_index_add(cu, tag, *type_id);
+
+	return 0;
 }
 
 int cu__table_nullify_type_entry(struct cu *cu, uint32_t id)
 {
+	cu__name_index_delete(cu);
 	return ptr_table__add_with_id(&cu->types_table, NULL, id);
 }
 
@@ -594,7 +1279,13 @@ int cu__table_add_tag_with_id(struct cu *cu, struct tag *tag, uint32_t id)
 		cu__insert_function(cu, tag);
 	}
 
-	return ptr_table__add_with_id(pt, tag, id);
+	if (ptr_table__add_with_id(pt, tag, id))
+		return -ENOMEM;
+
+	if (cu->name_index && pt == &cu->types_table)
+		return cu__name_index_add(cu, tag, id);
+
+	return 0;
 }
 
 int cu__add_tag_with_id(struct cu *cu, struct tag *tag, uint32_t id)
@@ -624,16 +1315,16 @@ int cu__fprintf_ptr_table_stats_csv(struct cu *cu, FILE *fp)
 
 struct cu *cu__new(const char *name, uint8_t addr_size,
 		   const unsigned char *build_id, int build_id_len,
-		   const char *filename, bool use_obstack)
+		   const char *filename, bool use_arena)
 {
 	struct cu *cu = zalloc(sizeof(*cu) + build_id_len);
 
 	if (cu != NULL) {
 		uint32_t void_id;
 
-		cu->use_obstack = use_obstack;
-		if (cu->use_obstack)
-			obstack_init(&cu->obstack);
+		cu->use_arena = use_arena;
+		if (cu->use_arena)
+			cu_arena__init(&cu->arena);
 
 		cu->name = strdup(name);
 		if (cu->name == NULL)
@@ -691,14 +1382,15 @@ void cu__delete(struct cu *cu)
 	if (cu == NULL)
 		return;
 
+	cu__name_index_delete(cu);
 	ptr_table__exit(&cu->tags_table);
 	ptr_table__exit(&cu->types_table);
 	ptr_table__exit(&cu->functions_table);
 	if (cu->dfops && cu->dfops->cu__delete)
 		cu->dfops->cu__delete(cu);
 
-	if (cu->use_obstack)
-		obstack_free(&cu->obstack, NULL);
+	if (cu->use_arena)
+		cu_arena__exit(&cu->arena);
 
 	zfree(&cu->filename);
 	zfree(&cu->name);
@@ -752,6 +1444,10 @@ struct tag *cu__find_base_type_by_name(const struct cu *cu,
 	if (cu == NULL || name == NULL)
 		return NULL;
 
+	int64_t found = cu__name_index_find(cu, name, CU_NAME_INDEX__BASE_TYPE, false, 0, true);
+	if (found >= 0)
+		return cu__name_index_type(cu, found, idp);
+
 	cu__for_each_type(cu, id, pos) {
 		if (pos->tag != DW_TAG_base_type)
 			continue;
@@ -779,6 +1475,10 @@ struct tag *cu__find_base_type_by_name_and_size(const struct cu *cu, const char
 	if (name == NULL)
 		return NULL;
 
+	int64_t found = cu__name_index_find(cu, name, CU_NAME_INDEX__BASE_TYPE, true, bit_size, true);
+	if (found >= 0)
+		return cu__name_index_type(cu, found, idp);
+
 	cu__for_each_type(cu, id, pos) {
 		if (pos->tag == DW_TAG_base_type) {
 			const struct base_type *bt = tag__base_type(pos);
@@ -805,6 +1505,10 @@ struct tag *cu__find_enumeration_by_name_and_size(const struct cu *cu, const cha
 	if (name == NULL)
 		return NULL;
 
+	int64_t found = cu__name_index_find(cu, name, CU_NAME_INDEX__ENUMERATION, true, bit_size, true);
+	if (found >= 0)
+		return cu__name_index_type(cu, found, idp);
+
 	cu__for_each_type(cu, id, pos) {
 		if (pos->tag == DW_TAG_enumeration_type) {
 			const struct type *t = tag__type(pos);
@@ -829,6 +1533,10 @@ struct tag *cu__find_enumeration_by_name(const struct cu *cu, const char *name,
 	if (name == NULL)
 		return NULL;
 
+	int64_t found = cu__name_index_find(cu, name, CU_NAME_INDEX__ENUMERATION, false, 0, true);
+	if (found >= 0)
+		return cu__name_index_type(cu, found, idp);
+
 	cu__for_each_type(cu, id, pos) {
 		if (pos->tag == DW_TAG_enumeration_type) {
 			const struct type *type = tag__type(pos);
@@ -850,6 +1558,10 @@ struct tag *cu__find_type_by_name(const struct cu *cu, const char *name, const i
 	if (cu == NULL || name == NULL)
 		return NULL;
 
+	int64_t found = cu__name_index_find(cu, name, CU_NAME_INDEX__TYPE, false, 0, include_decls);
+	if (found >= 0)
+		return cu__name_index_type(cu, found, idp);
+
 	uint32_t id;
 	struct tag *pos;
 	cu__for_each_type(cu, id, pos) {
@@ -876,6 +1588,212 @@ found:
 	return pos;
 }
 
+/*
+ * name -> (cu, type id) multimap for the cus__find_*_by_name() lookups, that
+ * otherwise would go thru all the CUs. Each bucket has the chain of named
+ * types, in the order the CUs were added and then by type id, so the first
+ * that passes the lookup filter is what the list walk would return.
+ *
+ * Built on the first lookup, then updated in cus__add(), both under
+ * cus__lock(). CUs are only removed in cus__delete().
+ */
+struct cus_name_entry {
+	struct cu *cu;
+	type_id_t id;
+	uint32_t  next;	/* index + 1 in cus_name_index->entries, 0 ends the chain */
+};
+
+struct cus_name_bucket {
+	const char *name;
+	uint32_t   hash;
+	uint32_t   first;
+	uint32_t   last;
+};
+
+struct cus_name_index {
+	struct cus_name_bucket *buckets;
+	uint32_t	       mask;
+	uint32_t	       nr_buckets;
+	struct cus_name_entry  *entries;
+	uint32_t	       nr_entries;
+	uint32_t	       allocated_entries;
+};
+
+static struct cus_name_bucket *cus_name_index__bucket(struct cus_name_index *index, const char *name, uint32_t hash)
+{
+	uint32_t i = hash & index->mask;
+
+	for (;; i = (i + 1) & index->mask) {
+		struct cus_name_bucket *bucket = &index->buckets[i];
+
+		if (bucket->name == NULL || (bucket->hash == hash && strcmp(bucket->name, name) == 0))
+			return bucket;
+	}
+}
+
+static int cus_name_index__grow(struct cus_name_index *index)
+{
+	uint32_t i, nr_slots = index->buckets ? (index->mask + 1) * 2 : 4096;
+	struct cus_name_bucket *old = index->buckets, *buckets = calloc(nr_slots, sizeof(*buckets));
+
+	if (buckets == NULL)
+		return -ENOMEM;
+
+	for (i = 0; old != NULL && i <= index->mask; ++i) {
+		uint32_t slot;
+
+		if (old[i].name == NULL)
+			continue;
+
+		for (slot = old[i].hash & (nr_slots - 1); buckets[slot].name != NULL; slot = (slot + 1) & (nr_slots - 1))
+			;
+		buckets[slot] = old[i];
+	}
+
+	free(old);
+	index->buckets = buckets;
+	index->mask = nr_slots - 1;
+	return 0;
+}
+
+static int cus_name_index__add(struct cus_name_index *index, struct cu *cu, const char *name, type_id_t id)
+{
+	struct cus_name_bucket *bucket;
+	struct cus_name_entry *entry;
+	size_t len;
+	uint32_t hash;
+
+	if (index->buckets == NULL || (index->nr_buckets + 1) * 4 > (index->mask + 1) * 3) {
+		if (cus_name_index__grow(index))
+			return -ENOMEM;
+	}
+
+	if (index->nr_entries == index->allocated_entries) {
+		uint32_t allocated_entries = index->allocated_entries ? index->allocated_entries * 2 : 4096;
+		struct cus_name_entry *entries = realloc(index->entries, allocated_entries * sizeof(*entries));
+
+		if (entries == NULL)
+			return -ENOMEM;
+
+		index->entries = entries;
+		index->allocated_entries = allocated_entries;
+	}
+
+	entry = &index->entries[index->nr_entries++];
+	entry->cu   = cu;
+	entry->id   = id;
+	entry->next = 0;
+
+	hash = hash_str(name, &len);
+	bucket = cus_name_index__bucket(index, name, hash);
+	if (bucket->name == NULL) {
+		bucket->name  = name;
+		bucket->hash  = hash;
+		bucket->first = index->nr_entries;
+		++index->nr_buckets;
+	} else {
+		index->entries[bucket->last - 1].next = index->nr_entries;
+	}
+	bucket->last = index->nr_entries;
+
+	return 0;
+}
+
+static void cus__name_index_delete(struct cus *cus)
+{
+	if (cus->name_index == NULL)
+		return;
+
+	free(cus->name_index->buckets);
+	free(cus->name_index->entries);
+	zfree(&cus->name_index);
+}
+
+// Drops the index if it can't keep up, the lookups then go back to walking the CUs
+static int cus__name_index_add(struct cus *cus, struct cu *cu)
+{
+	struct tag *pos;
+	uint32_t id;
+
+	cu__for_each_type(cu, id, pos) {
+		const char *name;
+
+		if (!tag__is_type(pos))
+			continue;
+
+		name = type__name(tag__type(pos));
+		if (name != NULL && cus_name_index__add(cus->name_index, cu, name, id) != 0) {
+			cus__name_index_delete(cus);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static struct cus_name_index *cus__name_index(struct cus *cus)
+{
+	struct cu *pos;
+
+	if (cus->name_index)
+		return cus->name_index;
+
+	cus->name_index = zalloc(sizeof(*cus->name_index));
+	if (cus->name_index == NULL)
+		return NULL;
+
+	list_for_each_entry(pos, &cus->cus, node) {
+		if (cus__name_index_add(cus, pos) != 0)
+			return NULL;
+	}
+
+	return cus->name_index;
+}
+
+/*
+ * Returns true if the index could be used, with *tagp set to what was found,
+ * if anything, must be called with cus__lock() held.
+ */
+static bool cus__name_index_find(struct cus *cus, const char *name, enum cu_name_index_kind kind,
+				 const int include_decls, struct cu **cu, type_id_t *idp, struct tag **tagp)
+{
+	struct cus_name_index *index = cus__name_index(cus);
+	struct cus_name_bucket *bucket;
+	size_t len;
+	uint32_t i;
+
+	*tagp = NULL;
+
+	if (index == NULL)
+		return false;
+
+	if (index->buckets == NULL || name == NULL)
+		return true;
+
+	bucket = cus_name_index__bucket(index, name, hash_str(name, &len));
+
+	for (i = bucket->name ? bucket->first : 0; i != 0; i = index->entries[i - 1].next) {
+		struct cus_name_entry *entry = &index->entries[i - 1];
+		struct tag *tag = cu__type(entry->cu, entry->id);
+
+		if ((kind == CU_NAME_INDEX__STRUCT && !tag__is_struct(tag)) ||
+		    (kind == CU_NAME_INDEX__STRUCT_OR_UNION && !(tag__is_struct(tag) || tag__is_union(tag))))
+			continue;
+
+		if (!include_decls && tag__type(tag)->declaration)
+			continue;
+
+		if (cu != NULL)
+			*cu = entry->cu;
+		if (idp != NULL)
+			*idp = entry->id;
+		*tagp = tag;
+		break;
+	}
+
+	return true;
+}
+
 struct tag *cus__find_type_by_name(struct cus *cus, struct cu **cu, const char *name,
 				   const int include_decls, type_id_t *id)
 {
@@ -884,6 +1802,9 @@ struct tag *cus__find_type_by_name(struct cus *cus, struct cu **cu, const char *
 
 	cus__lock(cus);
 
+	if (cus__name_index_find(cus, name, CU_NAME_INDEX__TYPE, include_decls, cu, id, &tag))
+		goto out_unlock;
+
 	list_for_each_entry(pos, &cus->cus, node) {
 		tag = cu__find_type_by_name(pos, name, include_decls, id);
 		if (tag != NULL) {
@@ -892,7 +1813,7 @@ struct tag *cus__find_type_by_name(struct cus *cus, struct cu **cu, const char *
 			break;
 		}
 	}
-
+out_unlock:
 	cus__unlock(cus);
 
 	return tag;
@@ -904,6 +1825,11 @@ static struct tag *__cu__find_struct_by_name(const struct cu *cu, const char *na
 	if (cu == NULL || name == NULL)
 		return NULL;
 
+	int64_t found = cu__name_index_find(cu, name, unions ? CU_NAME_INDEX__STRUCT_OR_UNION : CU_NAME_INDEX__STRUCT,
+					    false, 0, include_decls);
+	if (found >= 0)
+		return cu__name_index_type(cu, found, idp);
+
 	uint32_t id;
 	struct tag *pos;
 	cu__for_each_type(cu, id, pos) {
@@ -950,15 +1876,19 @@ static struct tag *__cus__find_struct_by_name(struct cus *cus, struct cu **cu, c
 
 	cus__lock(cus);
 
+	if (cus__name_index_find(cus, name, unions ? CU_NAME_INDEX__STRUCT_OR_UNION : CU_NAME_INDEX__STRUCT,
+				 include_decls, cu, id, &tag))
+		goto out_unlock;
+
 	list_for_each_entry(pos, &cus->cus, node) {
-		struct tag *tag = __cu__find_struct_by_name(pos, name, include_decls, unions, id);
+		tag = __cu__find_struct_by_name(pos, name, include_decls, unions, id);
 		if (tag != NULL) {
 			if (cu != NULL)
 				*cu = pos;
 			break;
 		}
 	}
-
+out_unlock:
 	cus__unlock(cus);
 
 	return tag;
@@ -1001,13 +1931,139 @@ struct function *cu__find_function_at_addr(const struct cu *cu,
 
 }
 
+/*
+ * All the functions with an address range, in all CUs, as an array of sorted,
+ * non overlapping intervals, so that looking up an address is a binary search
+ * instead of a search in each CU's functions rb-tree.
+ *
+ * Overlapping ranges are not expected, but if there are any the one starting
+ * first wins, then the one in the CU added first, and the others are trimmed.
+ */
+struct cus_addr_interval {
+	uint64_t	start;
+	uint64_t	end;
+	struct function *function;
+	struct cu	*cu;
+	uint32_t	order;	// Tie breaker for functions starting at the same address
+};
+
+struct cus_addr_index {
+	struct cus_addr_interval *intervals;
+	uint32_t		 nr_intervals;
+};
+
+static void cus__addr_index_delete(struct cus *cus)
+{
+	if (cus->addr_index == NULL)
+		return;
+
+	free(cus->addr_index->intervals);
+	zfree(&cus->addr_index);
+}
+
+static int cus_addr_interval__cmp(const void *a, const void *b)
+{
+	const struct cus_addr_interval *ia = a, *ib = b;
+
+	if (ia->start != ib->start)
+		return ia->start < ib->start ? -1 : 1;
+
+	return ia->order < ib->order ? -1 : ia->order > ib->order ? 1 : 0;
+}
+
+static struct cus_addr_index *cus__addr_index(struct cus *cus)
+{
+	struct cus_addr_interval *intervals;
+	struct cus_addr_index *index;
+	uint32_t nr = 0, i, j;
+	struct function *pos;
+	struct cu *cu;
+	uint32_t id;
+
+	if (cus->addr_index)
+		return cus->addr_index;
+
+	list_for_each_entry(cu, &cus->cus, node)
+		nr += cu->functions_table.nr_entries;
+
+	index = zalloc(sizeof(*index));
+	intervals = malloc((nr ?: 1) * sizeof(*intervals));
+	if (index == NULL || intervals == NULL) {
+		free(index);
+		free(intervals);
+		return NULL;
+	}
+
+	nr = 0;
+	list_for_each_entry(cu, &cus->cus, node) {
+		cu__for_each_function(cu, id, pos) {
+			if (pos->lexblock.size == 0)
+				continue;
+
+			intervals[nr].start    = pos->lexblock.ip.addr;
+			intervals[nr].end      = pos->lexblock.ip.addr + pos->lexblock.size;
+			intervals[nr].function = pos;
+			intervals[nr].cu       = cu;
+			intervals[nr].order    = nr;
+			++nr;
+		}
+	}
+
+	qsort(intervals, nr, sizeof(*intervals), cus_addr_interval__cmp);
+
+	// Trim or drop what overlaps with the previous interval
+	for (i = j = 0; i < nr; ++i) {
+		if (j != 0 && intervals[i].start < intervals[j - 1].end) {
+			if (intervals[i].end <= intervals[j - 1].end)
+				continue;
+			intervals[i].start = intervals[j - 1].end;
+		}
+		intervals[j++] = intervals[i];
+	}
+
+	index->intervals    = intervals;
+	index->nr_intervals = j;
+	cus->addr_index	    = index;
+	return index;
+}
+
+// Returns the index of the last interval starting at or before addr, -1 if none
+static int64_t cus_addr_index__search(const struct cus_addr_index *index, uint64_t addr)
+{
+	int64_t low = 0, high = (int64_t)index->nr_intervals - 1;
+
+	while (low <= high) {
+		int64_t mid = low + (high - low) / 2;
+
+		if (index->intervals[mid].start <= addr)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return high;
+}
+
 struct function *cus__find_function_at_addr(struct cus *cus, uint64_t addr, struct cu **cu)
 {
 	struct function *f = NULL;
+	struct cus_addr_index *index;
 	struct cu *pos;
 
 	cus__lock(cus);
 
+	index = cus__addr_index(cus);
+	if (index != NULL) {
+		int64_t i = cus_addr_index__search(index, addr);
+
+		if (i >= 0 && addr < index->intervals[i].end) {
+			f = index->intervals[i].function;
+			if (cu != NULL)
+				*cu = index->intervals[i].cu;
+		}
+		goto out_unlock;
+	}
+
 	list_for_each_entry(pos, &cus->cus, node) {
 		f = cu__find_function_at_addr(pos, addr);
 
@@ -1017,16 +2073,72 @@ struct function *cus__find_function_at_addr(struct cus *cus, uint64_t addr, stru
 			break;
 		}
 	}
-
+out_unlock:
 	cus__unlock(cus);
 
 	return f;
 }
 
+int cus__find_functions_at_addrs(struct cus *cus, const uint64_t *addrs, uint32_t nr_addrs,
+				 struct function **functions, struct cu **cus_found)
+{
+	struct cus_addr_index *index;
+	int64_t interval = -1;
+	uint32_t i;
+	int nr_found = 0;
+
+	cus__lock(cus);
+
+	index = cus__addr_index(cus);
+	if (index == NULL) {
+		cus__unlock(cus);
+
+		for (i = 0; i < nr_addrs; ++i) {
+			functions[i] = cus__find_function_at_addr(cus, addrs[i], cus_found ? &cus_found[i] : NULL);
+			nr_found += functions[i] != NULL;
+		}
+
+		return nr_found;
+	}
+
+	for (i = 0; i < nr_addrs; ++i) {
+		uint64_t addr = addrs[i];
+
+		if (i == 0 || addr < addrs[i - 1]) {
+			// Not sorted, start over
+			interval = cus_addr_index__search(index, addr);
+		} else {
+			// Merge: advance to the last interval starting at or before addr
+			while (interval + 1 < (int64_t)index->nr_intervals &&
+			       index->intervals[interval + 1].start <= addr)
+				++interval;
+		}
+
+		functions[i] = NULL;
+		if (interval >= 0 && addr < index->intervals[interval].end) {
+			functions[i] = index->intervals[interval].function;
+			++nr_found;
+		}
+
+		if (cus_found != NULL)
+			cus_found[i] = functions[i] ? index->intervals[interval].cu : NULL;
+	}
+
+	cus__unlock(cus);
+
+	return nr_found;
+}
+
 static struct cu *__cus__find_cu_by_name(struct cus *cus, const char *name)
 {
 	struct cu *pos;
 
+	if (cus->cu_names.buckets != NULL) {
+		size_t len;
+
+		return cus__cu_bucket(cus, name, hash_str(name, &len))->cu;
+	}
+
 	list_for_each_entry(pos, &cus->cus, node)
 		if (pos->name && strcmp(pos->name, name) == 0)
 			goto out;
@@ -1984,9 +3096,10 @@ out:
 /*
  * This should really do demand loading of DSOs, STABS anyone? 8-)
  */
-extern struct debug_fmt_ops dwarf__ops, ctf__ops, btf__ops;
+extern struct debug_fmt_ops cache__ops, dwarf__ops, ctf__ops, btf__ops;
 
 static struct debug_fmt_ops *debug_fmt_table[] = {
+	&cache__ops,
 	&dwarf__ops,
 	&btf__ops,
 	&ctf__ops,
@@ -2055,9 +3168,6 @@ int cus__load_file(struct cus *cus, struct conf_load *conf,
 	return -EINVAL;
 }
 
-#define BUILD_ID_SIZE   20
-#define SBUILD_ID_SIZE  (BUILD_ID_SIZE * 2 + 1)
-
 #define NOTE_ALIGN(sz) (((sz) + 3) & ~3)
 
 #define NT_GNU_BUILD_ID	3
@@ -2439,7 +3549,7 @@ static int sysfs__sprintf_build_id(const char *root_dir, char *sbuild_id)
 	return build_id__sprintf(build_id, sizeof(build_id), sbuild_id);
 }
 
-static int filename__sprintf_build_id(const char *pathname, char *sbuild_id)
+int filename__sprintf_build_id(const char *pathname, char *sbuild_id)
 {
 	unsigned char build_id[BUILD_ID_SIZE];
 	int ret;
@@ -2584,6 +3694,21 @@ int cus__fprintf_load_files_err(struct cus *cus __maybe_unused, const char *tool
 		       errno ? strerror(errno) : "No debugging information found");
 }
 
+void conf_load__set_profile(struct conf_load *conf, enum conf_load_profile profile)
+{
+	bool skip_bodies = profile != CONF_LOAD_PROFILE__ALL;
+
+	/*
+	 * XXX for now, test this more thoroughly for the BTF profile
+	 * We may have some references from formal parameters, etc, (abstract_origin)
+	 */
+	conf->ignore_inline_expansions = profile == CONF_LOAD_PROFILE__TYPES;
+	conf->ignore_labels	       = skip_bodies;
+	conf->ignore_lexblocks	       = skip_bodies;
+	conf->ignore_local_variables   = skip_bodies;
+	conf->ignore_global_variables  = profile == CONF_LOAD_PROFILE__TYPES;
+}
+
 struct cus *cus__new(void)
 {
 	struct cus *cus = zalloc(sizeof(*cus));
@@ -2613,6 +3738,9 @@ void cus__delete(struct cus *cus)
 	if (cus->loader_exit)
 		cus->loader_exit(cus);
 
+	cus__name_index_delete(cus);
+	cus__addr_index_delete(cus);
+	cus__delete_cu_names(cus);
 	cus__unlock(cus);
 
 	free(cus);
@@ -2664,6 +3792,8 @@ void dwarves__exit(void)
 			debug_fmt_table[i]->exit();
 		++i;
 	}
+
+	cu_arena__cache_exit();
 }
 
 struct argp_state;
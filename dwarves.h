@@ -8,9 +8,9 @@
 */
 
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <obstack.h>
 #include <dwarf.h>
 #include <elfutils/libdwfl.h>
 #include <sys/types.h>
@@ -36,13 +36,45 @@ typedef uint32_t type_id_t;
 struct btf;
 struct conf_fprintf;
 
+/*
+ * What the tool will use from what gets loaded, so that loaders can avoid
+ * creating what will not be used, see conf_load__set_profile().
+ *
+ * CONF_LOAD_PROFILE__ALL - Everything, function bodies included
+ * CONF_LOAD_PROFILE__TYPES - Types, functions and their parameters, for layout queries
+ * CONF_LOAD_PROFILE__BTF - What the BTF encoder needs: types, functions,
+ *			    parameters and variables with static storage, inline
+ *			    expansions are still loaded, as before the profiles
+ */
+enum conf_load_profile {
+	CONF_LOAD_PROFILE__ALL,
+	CONF_LOAD_PROFILE__TYPES,
+	CONF_LOAD_PROFILE__BTF,
+};
+
 /** struct conf_load - load configuration
  * @thread_exit - called at the end of a thread, 1st user: BTF encoder dedup
+ * @early_cu_filter - called when just the CU name and language are known,
+ *		     before loading its tags, returning NULL skips the CU
  * @extra_dbg_info - keep original debugging format extra info
  *		     (e.g. DWARF's decl_{line,file}, id, etc)
+ * @use_arena - allocate the tags in a per CU arena, released all at once in cu__delete(),
+ *	       so the tool can't keep pointers to them after deleting the CU
  * @fixup_silly_bitfields - Fixup silly things such as "int foo:32;"
  * @get_addr_info - wheter to load DW_AT_location and other addr info
+ * @ignore_lexblocks - don't create lexical blocks, their contents go to the enclosing one
+ * @ignore_local_variables - don't load variables in functions, unless with static storage
+ * @ignore_global_variables - don't load variables outside functions
+ * @use_cache - load from/store to a per build-id cache of what the DWARF loader produces
+ * @cache_dir - where to keep that cache, NULL for $XDG_CACHE_HOME/dwarves
  * @nr_jobs - -j argument, number of threads to use
+ * @nr_steal_jobs - if set, the nr_jobs threads just load CUs, handing them to
+ *		   these many threads that call steal(), with thread data
+ * @steal_queue_size - how many loaded CUs may wait for the steal threads, default: 2 * nr_steal_jobs
+ * @in_order_steal - with nr_jobs, still call steal() in .debug_info order, as when
+ *		    loading serially, takes precedence over nr_steal_jobs
+ * @steal_window - in_order_steal: how many CUs the threads may load past the
+ *		  first one not yet stolen, default: 4 * nr_jobs
  * @ptr_table_stats - print developer oriented ptr_table statistics.
  * @skip_missing - skip missing types rather than bailing out.
  */
@@ -51,25 +83,35 @@ struct conf_load {
 					 struct conf_load *conf,
 					 void *thr_data);
 	int			(*thread_exit)(struct conf_load *conf, void *thr_data);
+	struct cu		*(*early_cu_filter)(struct cu *cu);
 	void			*cookie;
 	char			*format_path;
 	int			nr_jobs;
+	int			nr_steal_jobs;
+	int			steal_queue_size;
+	int			steal_window;
+	bool			in_order_steal;
 	bool			extra_dbg_info;
-	bool			use_obstack;
+	bool			use_arena;
 	bool			fixup_silly_bitfields;
 	bool			get_addr_info;
 	bool			ignore_alignment_attr;
 	bool			ignore_inline_expansions;
 	bool			ignore_labels;
+	bool			ignore_lexblocks;
+	bool			ignore_local_variables;
+	bool			ignore_global_variables;
+	bool			use_cache;
 	bool			ptr_table_stats;
 	bool			skip_encoding_btf_decl_tag;
 	bool			skip_missing;
 	bool			skip_encoding_btf_type_tag;
 	bool			skip_encoding_btf_enum64;
-	uint8_t			hashtable_bits;
-	uint8_t			max_hashtable_bits;
+	uint8_t			hashtable_bits;		/* Deprecated, ignored, no more DIE offset hashtables */
+	uint8_t			max_hashtable_bits;	/* Deprecated, ignored */
 	uint16_t		kabi_prefix_len;
 	const char		*kabi_prefix;
+	const char		*cache_dir;
 	struct btf		*base_btf;
 	struct conf_fprintf	*conf_fprintf;
 	int			(*threads_prepare)(struct conf_load *conf, int nr_threads, void **thr_data);
@@ -133,6 +175,8 @@ struct conf_fprintf {
 	uint8_t	   skip_emitting_atomic_typedefs:1;
 };
 
+void conf_load__set_profile(struct conf_load *conf, enum conf_load_profile profile);
+
 struct cus;
 
 struct cus *cus__new(void);
@@ -161,6 +205,13 @@ struct tag *cu__find_type_by_name(const struct cu *cu, const char *name, const i
 struct tag *cus__find_type_by_name(struct cus *cus, struct cu **cu, const char *name,
 				   const int include_decls, type_id_t *id);
 struct function *cus__find_function_at_addr(struct cus *cus, uint64_t addr, struct cu **cu);
+/*
+ * Looks up many addresses at once, best sorted, so that it is a single pass
+ * thru the functions, setting functions[i] and, if not NULL, cus_found[i], to
+ * NULL if nothing is at addrs[i], returns the number of addresses resolved.
+ */
+int cus__find_functions_at_addrs(struct cus *cus, const uint64_t *addrs, uint32_t nr_addrs,
+				 struct function **functions, struct cu **cus_found);
 void cus__for_each_cu(struct cus *cus, int (*iterator)(struct cu *cu, void *cookie),
 		      void *cookie,
 		      struct cu *(*filter)(struct cu *cu));
@@ -236,6 +287,39 @@ struct debug_fmt_ops {
  * unspecified_type: If this CU has a DW_TAG_unspecified_type, as BTF doesn't have a representation for this
  * 		     and thus we need to check functions returning this to convert it to void.
  */
+/*
+ * struct cu_arena - where the tags of a CU are allocated from
+ *
+ * Objects up to CU_ARENA__MAX_CLASS_SIZE bytes are carved from per size class
+ * slabs, so that, say, all the class_members of a CU are close to each other,
+ * the slabs and bigger objects come from chunks that are only released, all
+ * at once, in cu__delete(), going to a per thread cache to be reused by the
+ * next CU loaded by that thread.
+ *
+ * All sizes are rounded up to CU_ARENA__ALIGN, _Alignof(max_align_t), so that
+ * what is returned has the same alignment as what malloc() returns.
+ */
+#define CU_ARENA__ALIGN		 _Alignof(max_align_t)
+#define CU_ARENA__MAX_CLASS_SIZE 256
+#define CU_ARENA__NR_CLASSES	 (CU_ARENA__MAX_CLASS_SIZE / CU_ARENA__ALIGN)
+
+struct cu_arena_chunk;
+
+struct cu_arena_slab {
+	char *pos;
+	char *end;
+};
+
+struct cu_arena {
+	struct cu_arena_chunk *chunks;
+	char		      *pos;
+	char		      *end;
+	size_t		      chunk_size;
+	struct cu_arena_slab  slabs[CU_ARENA__NR_CLASSES];
+};
+
+struct cu_name_index;
+
 struct cu {
 	struct list_head node;
 	struct list_head tags;
@@ -254,9 +338,11 @@ struct cu {
 	struct debug_fmt_ops *dfops;
 	Elf		 *elf;
 	Dwfl_Module	 *dwfl;
-	struct obstack	 obstack;
+	struct cu_arena	 arena;
+	struct cu_name_index *name_index; /* Built on the first cu__find_*_by_name() */
 	uint32_t	 cached_symtab_nr_entries;
-	bool		 use_obstack;
+	uint32_t	 seq;		/* Position in the file, -j may steal out of order */
+	bool		 use_arena;
 	uint8_t		 addr_size;
 	uint8_t		 extra_dbg_info:1;
 	uint8_t		 has_addr_info:1;
@@ -276,7 +362,7 @@ struct cu {
 
 struct cu *cu__new(const char *name, uint8_t addr_size,
 		   const unsigned char *build_id, int build_id_len,
-		   const char *filename, bool use_obstack);
+		   const char *filename, bool use_arena);
 void cu__delete(struct cu *cu);
 
 void *cu__malloc(struct cu *cu, size_t size);
@@ -412,6 +498,11 @@ struct tag *cu__find_struct_by_name(const struct cu *cu, const char *name,
 struct tag *cu__find_struct_or_union_by_name(const struct cu *cu, const char *name,
 					     const int include_decls, type_id_t *id);
 bool cu__same_build_id(const struct cu *cu, const struct cu *other);
+
+#define BUILD_ID_SIZE   20
+#define SBUILD_ID_SIZE  (BUILD_ID_SIZE * 2 + 1)
+
+int filename__sprintf_build_id(const char *pathname, char *sbuild_id);
 void cu__account_inline_expansions(struct cu *cu);
 int cu__for_all_tags(struct cu *cu,
 		     int (*iterator)(struct tag *tag,
@@ -1066,10 +1157,13 @@ struct type {
 	uint8_t		 fwd_decl_emitted:1;
 	uint8_t		 resized:1;
 	uint8_t		 is_signed_enum:1;
+	uint64_t	 fingerprint;	/* See type__fingerprint(), 0 if not yet computed */
 };
 
 void __type__init(struct type *type);
 
+uint64_t type__fingerprint(struct type *type, const struct cu *cu);
+
 size_t tag__natural_alignment(struct tag *tag, const struct cu *cu);
 
 static inline struct class *type__class(const struct type *type)
@@ -1391,6 +1485,11 @@ struct enumerator {
 	struct tag_cu	 type_enum; // To cache the type_enum searches
 };
 
+static inline struct enumerator *tag__enumerator(const struct tag *tag)
+{
+	return (struct enumerator *)tag;
+}
+
 static inline const char *enumerator__name(const struct enumerator *enumerator)
 {
 	return enumerator->name;
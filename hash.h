@@ -14,6 +14,7 @@
  * machines where multiplications are slow.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 static inline uint64_t hash_64(const uint64_t val, const unsigned int bits)
@@ -21,4 +22,22 @@ static inline uint64_t hash_64(const uint64_t val, const unsigned int bits)
 	return (val * 11400714819323198485LLU) >> (64 - bits);
 }
 
+/*
+ * FNV-1a, for strings such as symbol names, also returning the string
+ * length, so that it can be compared with memcmp() when the hashes match.
+ */
+static inline uint32_t hash_str(const char *s, size_t *len)
+{
+	const char *p = s;
+	uint32_t hash = 2166136261U;
+
+	while (*p != '\0') {
+		hash ^= (uint8_t)*p++;
+		hash *= 16777619U;
+	}
+
+	*len = p - s;
+	return hash;
+}
+
 #endif /* _LINUX_HASH_H */
@@ -31,6 +31,7 @@
 
 static struct btf_encoder *btf_encoder;
 static char *detached_btf_filename;
+static const char *btf_encode_batch_list;
 static bool btf_encode;
 static bool btf_gen_floats;
 static bool ctf_encode;
@@ -203,6 +204,10 @@ static bool languages__in(int lang)
 
 static int type__compare_members_types(struct type *a, struct cu *cu_a, struct type *b, struct cu *cu_b)
 {
+	// Only called when all CUs are loaded, so the fingerprints can be computed here
+	if (type__fingerprint(a, cu_a) == type__fingerprint(b, cu_b))
+		return 0;
+
 	int ret = strcmp(type__name(a), type__name(b));
 
 	if (ret)
@@ -364,6 +369,15 @@ static int type__compare_members(struct type *a, struct type *b)
 
 static int type__compare(struct type *a, struct cu *cu_a, struct type *b, struct cu *cu_b)
 {
+	/*
+	 * structures__add() computed both fingerprints, 'a' in another
+	 * thread, but it is already in the tree, so just read them. When
+	 * sorting the members types are looked at in the end, and these are
+	 * considered different, see type__compare_members().
+	 */
+	if (!sort_output && a->fingerprint != 0 && a->fingerprint == b->fingerprint)
+		return 0;
+
 	int ret = strcmp(type__name(a), type__name(b));
 
 	if (ret)
@@ -423,6 +437,9 @@ static struct structure *structures__add(struct class *class, struct cu *cu, uin
 {
 	struct structure *str;
 
+	// In the thread that owns the CU, outside the lock, see type__compare()
+	type__fingerprint(&class->type, cu);
+
 	pthread_mutex_lock(&structures_lock);
 	str = __structures__add(class, cu, id, existing_entry);
 	pthread_mutex_unlock(&structures_lock);
@@ -853,6 +870,7 @@ static void class__resize_LP(struct tag *tag, struct cu *cu)
 		return;
 
 	tag__type(tag)->resized = 1;
+	tag__type(tag)->fingerprint = 0; // sizes and offsets will change
 
 	if (original_word_size > word_size)
 		word_size_diff = original_word_size - word_size;
@@ -941,6 +959,7 @@ static void union__find_new_size(struct tag *tag, struct cu *cu)
 		return;
 
 	type->resized = 1;
+	type->fingerprint = 0; // sizes and offsets will change
 
 	type__for_each_tag(type, tag_pos) {
 		struct tag *type;
@@ -1221,6 +1240,11 @@ ARGP_PROGRAM_VERSION_HOOK_DEF = dwarves_print_version;
 #define ARGP_languages_exclude	   336
 #define ARGP_skip_encoding_btf_enum64 337
 #define ARGP_skip_emitting_atomic_typedefs 338
+#define ARGP_cache		   339
+#define ARGP_btf_encode_batch	   340
+#define ARGP_pipeline_jobs	   341
+#define ARGP_pipeline_queue	   342
+#define ARGP_ordered_steal	   343
 
 static const struct argp_option pahole__options[] = {
 	{
@@ -1589,7 +1613,7 @@ static const struct argp_option pahole__options[] = {
 		.name = "hashbits",
 		.key  = ARGP_hashbits,
 		.arg  = "BITS",
-		.doc  = "Number of bits for the hash table key",
+		.doc  = "Deprecated, ignored, kept for compatibility with scripts using it",
 	},
 	{
 		.name = "ptr_table_stats",
@@ -1633,6 +1657,38 @@ static const struct argp_option pahole__options[] = {
 		.key  = ARGP_skip_emitting_atomic_typedefs,
 		.doc  = "Do not emit 'typedef _Atomic int atomic_int' & friends."
 	},
+	{
+		.name  = "cache",
+		.key   = ARGP_cache,
+		.arg   = "DIR",
+		.flags = OPTION_ARG_OPTIONAL,
+		.doc   = "Cache what is loaded from DWARF, keyed by build-id [default: $XDG_CACHE_HOME/dwarves]"
+	},
+	{
+		.name = "btf_encode_batch",
+		.key  = ARGP_btf_encode_batch,
+		.arg  = "LIST",
+		.doc  = "Encode BTF for each file, plus an optional detached output file, per line in LIST, using -j worker threads"
+	},
+	{
+		.name = "pipeline_jobs",
+		.key  = ARGP_pipeline_jobs,
+		.arg  = "NR_JOBS",
+		.doc  = "With -j, have the -j threads just load CUs, processing them, e.g. encoding BTF, in NR_JOBS other threads"
+	},
+	{
+		.name = "pipeline_queue",
+		.key  = ARGP_pipeline_queue,
+		.arg  = "NR_CUS",
+		.doc  = "With --pipeline_jobs, how many loaded CUs may be waiting to be processed [default: 2 * NR_JOBS]"
+	},
+	{
+		.name  = "ordered_steal",
+		.key   = ARGP_ordered_steal,
+		.arg   = "WINDOW",
+		.flags = OPTION_ARG_OPTIONAL,
+		.doc   = "With -j, process the CUs in the order they are in the file, loading at most WINDOW CUs past the first not yet processed [default: 4 * NR_JOBS]"
+	},
 	{
 		.name = NULL,
 	}
@@ -1672,16 +1728,16 @@ static error_t pahole__options_parser(int key, char *arg,
 		  fputs("pahole: Multithreading requires elfutils >= 0.178. Continuing with a single thread...\n", stderr);
 #endif
 							break;
+	case ARGP_btf_encode_batch:
+		  btf_encode_batch_list = arg;
+		  goto btf_encode;
 	case ARGP_btf_encode_detached:
 		  detached_btf_filename = arg; // fallthru
-	case 'J': btf_encode = 1;
+	case 'J':
+btf_encode:
+		  btf_encode = 1;
 		  conf_load.get_addr_info = true;
 		  conf_load.ignore_alignment_attr = true;
-		  // XXX for now, test this more thoroughly
-		  // We may have some references from formal parameters, etc, (abstract_origin)
-		  // conf_load.ignore_inline_expansions = true;
-		  conf_load.ignore_labels	     = true;
-		  conf_load.use_obstack		     = true;
 		  no_bitfield_type_recode = true;	break;
 	case 'l': conf.show_first_biggest_size_base_type_member = 1;	break;
 	case 'M': conf.show_only_data_members = 1;	break;
@@ -1783,8 +1839,10 @@ static error_t pahole__options_parser(int key, char *arg,
 		prettify_input_filename = arg;		break;
 	case ARGP_sort_output:
 		sort_output = true;			break;
-	case ARGP_hashbits:
-		conf_load.hashtable_bits = atoi(arg);	break;
+	case ARGP_hashbits: /* No hashtables to size anymore */
+		conf_load.hashtable_bits = atoi(arg);
+		fputs("pahole: --hashbits is deprecated and ignored, the DIE offsets are not hashed anymore\n", stderr);
+		break;
 	case ARGP_devel_stats:
 		conf_load.ptr_table_stats = true;	break;
 	case ARGP_skip_encoding_btf_decl_tag:
@@ -1802,6 +1860,16 @@ static error_t pahole__options_parser(int key, char *arg,
 		conf_load.skip_encoding_btf_enum64 = true;	break;
 	case ARGP_skip_emitting_atomic_typedefs:
 		conf.skip_emitting_atomic_typedefs = true;	break;
+	case ARGP_cache:
+		conf_load.use_cache = true;
+		conf_load.cache_dir = arg;			break;
+	case ARGP_pipeline_jobs:
+		conf_load.nr_steal_jobs = atoi(arg);		break;
+	case ARGP_pipeline_queue:
+		conf_load.steal_queue_size = atoi(arg);		break;
+	case ARGP_ordered_steal:
+		conf_load.in_order_steal = true;
+		conf_load.steal_window = arg ? atoi(arg) : 0;	break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -2935,7 +3003,6 @@ out:
 static struct type_instance *header;
 
 struct thread_data {
-	struct btf *btf;
 	struct btf_encoder *encoder;
 };
 
@@ -2950,25 +3017,12 @@ static int pahole_threads_prepare(struct conf_load *conf, int nr_threads, void *
 	return 0;
 }
 
-static int pahole_thread_exit(struct conf_load *conf, void *thr_data)
-{
-	struct thread_data *thread = thr_data;
-
-	if (thread == NULL)
-		return 0;
-
-	/*
-	 * Here we will call btf__dedup() here once we extend
-	 * btf__dedup().
-	 */
-
-	return 0;
-}
-
 static int pahole_threads_collect(struct conf_load *conf, int nr_threads, void **thr_data,
 				  int error)
 {
 	struct thread_data **threads = (struct thread_data **)thr_data;
+	struct btf_encoder *encoders[nr_threads];
+	int nr_encoders = 0;
 	int i;
 	int err = 0;
 
@@ -2976,25 +3030,22 @@ static int pahole_threads_collect(struct conf_load *conf, int nr_threads, void *
 		goto out;
 
 	for (i = 0; i < nr_threads; i++) {
-		/*
-		 * Merge content of the btf instances of worker threads to the btf
-		 * instance of the primary btf_encoder.
-                */
-		if (!threads[i]->btf || threads[i]->encoder == btf_encoder)
-			continue; /* The primary btf_encoder */
-		err = btf_encoder__add_encoder(btf_encoder, threads[i]->encoder);
-		if (err < 0)
-			goto out;
-		btf_encoder__delete(threads[i]->encoder);
-		threads[i]->encoder = NULL;
+		if (threads[i]->encoder)
+			encoders[nr_encoders++] = threads[i]->encoder;
 	}
-	err = 0;
 
+	/*
+	 * Merge the per CU fragments encoded by the worker threads into the
+	 * primary btf_encoder, in the order the CUs are in the file, so that
+	 * the result doesn't depend on which thread got which CU. This is done
+	 * here, and not as each thread exits, as only now the function claims
+	 * are final. The result is deduplicated once, in btf_encoder__encode().
+	 */
+	if (nr_encoders)
+		err = btf_encoder__add_fragments(btf_encoder, encoders, nr_encoders);
 out:
-	for (i = 0; i < nr_threads; i++) {
-		if (threads[i]->encoder && threads[i]->encoder != btf_encoder)
-			btf_encoder__delete(threads[i]->encoder);
-	}
+	for (i = 0; i < nr_threads; i++)
+		btf_encoder__delete(threads[i]->encoder);
 	free(threads[0]);
 
 	return err;
@@ -3022,6 +3073,7 @@ static enum load_steal_kind pahole_stealer(struct cu *cu,
 	if (btf_encode) {
 		static pthread_mutex_t btf_lock = PTHREAD_MUTEX_INITIALIZER;
 		struct btf_encoder *encoder;
+		int err;
 
 		pthread_mutex_lock(&btf_lock);
 		/*
@@ -3032,18 +3084,12 @@ static enum load_steal_kind pahole_stealer(struct cu *cu,
 		 */
 		if (!btf_encoder) {
 			/*
-			 * btf_encoder is the primary encoder.
-			 * And, it is used by the thread
-			 * create it.
+			 * btf_encoder is the primary encoder, the one
+			 * that gets the fragments encoded by the worker
+			 * threads, if any.
 			 */
 			btf_encoder = btf_encoder__new(cu, detached_btf_filename, conf_load->base_btf, skip_encoding_btf_vars,
 						       btf_encode_force, btf_gen_floats, global_verbose);
-			if (btf_encoder && thr_data) {
-				struct thread_data *thread = thr_data;
-
-				thread->encoder = btf_encoder;
-				thread->btf = btf_encoder__btf(btf_encoder);
-			}
 		}
 		pthread_mutex_unlock(&btf_lock);
 
@@ -3054,10 +3100,10 @@ static enum load_steal_kind pahole_stealer(struct cu *cu,
 
 		/*
 		 * thr_data keeps per-thread data for worker threads.  Each worker thread
-		 * has an encoder.  The main thread will merge the data collected by all
-		 * these encoders to btf_encoder.  However, the first thread reaching this
-		 * function creates btf_encoder and reuses it as its local encoder.  It
-		 * avoids copying the data collected by the first thread.
+		 * has an encoder, that encodes each CU in a separate fragment.  The main
+		 * thread will splice the fragments collected by all these encoders into
+		 * btf_encoder in CU order, so that the result is the same as when
+		 * encoding with just one thread.
 		 */
 		if (thr_data) {
 			struct thread_data *thread = thr_data;
@@ -3070,14 +3116,19 @@ static enum load_steal_kind pahole_stealer(struct cu *cu,
 							 btf_encode_force,
 							 btf_gen_floats,
 							 global_verbose);
-				thread->btf = btf_encoder__btf(thread->encoder);
+				if (thread->encoder == NULL) {
+					ret = LSK__STOP_LOADING;
+					goto out_btf;
+				}
 			}
 			encoder = thread->encoder;
+			err = btf_encoder__encode_cu_fragment(encoder, cu, conf_load);
 		} else {
 			encoder = btf_encoder;
+			err = btf_encoder__encode_cu(encoder, cu, conf_load);
 		}
 
-		if (btf_encoder__encode_cu(encoder, cu, conf_load)) {
+		if (err) {
 			fprintf(stderr, "Encountered error while encoding BTF.\n");
 			exit(1);
 		}
@@ -3260,6 +3311,273 @@ filter_it:
 	return ret;
 }
 
+/*
+ * --btf_encode_batch: encode BTF for many files, kernel modules, usually
+ * against the same --btf_base, in one process. Each worker thread loads and
+ * encodes one file at a time, serially, the parallelism is across files.
+ */
+struct btf_batch_job {
+	struct conf_load   conf_load;
+	struct btf_encoder *encoder;
+	char		   *filename;
+	char		   *detached_filename;
+};
+
+struct btf_batch {
+	struct btf_batch_job *jobs;
+	int		     nr_jobs;
+	int		     allocated_jobs;
+	int		     next_job;
+	int		     nr_errors;
+	pthread_mutex_t	     lock;
+};
+
+struct btf_batch_worker {
+	struct btf_batch *batch;
+	struct btf	 *base_btf;
+	pthread_t	 thread;
+};
+
+static enum load_steal_kind pahole_batch_stealer(struct cu *cu, struct conf_load *conf_load,
+						 void *thr_data __maybe_unused)
+{
+	struct btf_batch_job *job = container_of(conf_load, struct btf_batch_job, conf_load);
+
+	if (!cu__filter(cu))
+		return LSK__DELETE;
+
+	if (job->encoder == NULL) {
+		job->encoder = btf_encoder__new(cu, job->detached_filename, conf_load->base_btf,
+						skip_encoding_btf_vars, btf_encode_force,
+						btf_gen_floats, global_verbose);
+		if (job->encoder == NULL)
+			return LSK__STOP_LOADING;
+	}
+
+	if (btf_encoder__encode_cu(job->encoder, cu, conf_load)) {
+		fprintf(stderr, "pahole: %s: Encountered error while encoding BTF.\n", job->filename);
+		return LSK__STOP_LOADING;
+	}
+
+	return LSK__DELETE;
+}
+
+static int btf_batch__add(struct btf_batch *batch, const char *filename, const char *detached_filename)
+{
+	struct btf_batch_job *job;
+
+	if (batch->nr_jobs == batch->allocated_jobs) {
+		int allocated = batch->allocated_jobs ? batch->allocated_jobs * 2 : 256;
+
+		job = realloc(batch->jobs, allocated * sizeof(*job));
+		if (job == NULL)
+			return -ENOMEM;
+
+		batch->jobs	      = job;
+		batch->allocated_jobs = allocated;
+	}
+
+	job = &batch->jobs[batch->nr_jobs];
+	memset(job, 0, sizeof(*job));
+
+	job->filename = strdup(filename);
+	if (job->filename == NULL)
+		return -ENOMEM;
+
+	if (detached_filename) {
+		job->detached_filename = strdup(detached_filename);
+		if (job->detached_filename == NULL) {
+			free(job->filename);
+			return -ENOMEM;
+		}
+	}
+
+	job->conf_load			= conf_load;
+	job->conf_load.nr_jobs		= 1;
+	job->conf_load.steal		= pahole_batch_stealer;
+	job->conf_load.early_cu_filter	= cu__filter;
+	job->conf_load.thread_exit	= NULL;
+	job->conf_load.threads_prepare	= NULL;
+	job->conf_load.threads_collect	= NULL;
+	++batch->nr_jobs;
+	return 0;
+}
+
+/*
+ * One file per line, optionally followed by the file where to write the
+ * detached BTF, otherwise it is added as a .BTF ELF section to the file.
+ * Empty lines and lines starting with '#' are ignored.
+ */
+static int btf_batch__load_list(struct btf_batch *batch, const char *list)
+{
+	FILE *fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+	char *line = NULL;
+	size_t line_len = 0;
+	int err = 0;
+
+	if (fp == NULL) {
+		fprintf(stderr, "pahole: couldn't open '%s': %s\n", list, strerror(errno));
+		return -errno;
+	}
+
+	while (err == 0 && getline(&line, &line_len, fp) != -1) {
+		char *saveptr, *filename = strtok_r(line, " \t\n", &saveptr);
+
+		if (filename == NULL || filename[0] == '#')
+			continue;
+
+		err = btf_batch__add(batch, filename, strtok_r(NULL, " \t\n", &saveptr));
+	}
+
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	return err;
+}
+
+static struct btf_batch_job *btf_batch__next_job(struct btf_batch *batch)
+{
+	struct btf_batch_job *job = NULL;
+
+	pthread_mutex_lock(&batch->lock);
+	if (batch->next_job < batch->nr_jobs)
+		job = &batch->jobs[batch->next_job++];
+	pthread_mutex_unlock(&batch->lock);
+
+	return job;
+}
+
+static int btf_batch_job__encode(struct btf_batch_job *job)
+{
+	char *filenames[] = { job->filename, NULL };
+	struct cus *cus = cus__new();
+	int err;
+
+	if (cus == NULL)
+		return -ENOMEM;
+
+	err = cus__load_files(cus, &job->conf_load, filenames);
+	if (err != 0) {
+		cus__fprintf_load_files_err(cus, "pahole", filenames, err, stderr);
+	} else if (job->encoder) {
+		err = btf_encoder__encode(job->encoder);
+		if (err)
+			fprintf(stderr, "pahole: %s: Failed to encode BTF\n", job->filename);
+	}
+
+	btf_encoder__delete(job->encoder);
+	job->encoder = NULL;
+	cus__delete(cus);
+	return err;
+}
+
+static void *btf_batch__worker(void *arg)
+{
+	struct btf_batch_worker *worker = arg;
+	struct btf_batch *batch = worker->batch;
+	struct btf_batch_job *job;
+
+	while ((job = btf_batch__next_job(batch)) != NULL) {
+		job->conf_load.base_btf = worker->base_btf;
+
+		if (btf_batch_job__encode(job) != 0) {
+			pthread_mutex_lock(&batch->lock);
+			++batch->nr_errors;
+			pthread_mutex_unlock(&batch->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The base BTF is read from disk just once, but each worker gets its own
+ * copy of it: libbpf looks up the split BTF strings in the base's string
+ * set, which isn't thread safe, so it can't be shared. A worker's copy and
+ * its string index, built on first use, are then reused for all the files
+ * it encodes.
+ */
+static int btf_encode_batch(char *filenames[])
+{
+	struct btf_batch batch = { .lock = PTHREAD_MUTEX_INITIALIZER, };
+	int nr_workers = conf_load.nr_jobs > 1 ? conf_load.nr_jobs : 1;
+	struct btf_batch_worker *workers;
+	const void *raw_base_btf = NULL;
+	uint32_t raw_base_btf_size = 0;
+	int i, err = 0;
+
+	if (btf_encode_batch_list)
+		err = btf_batch__load_list(&batch, btf_encode_batch_list);
+
+	for (i = 0; err == 0 && filenames[i] != NULL; ++i)
+		err = btf_batch__add(&batch, filenames[i], NULL);
+
+	if (err)
+		goto out_free_jobs;
+
+	if (nr_workers > batch.nr_jobs)
+		nr_workers = batch.nr_jobs;
+
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (workers == NULL) {
+		err = -ENOMEM;
+		goto out_free_jobs;
+	}
+
+	if (conf_load.base_btf) {
+		raw_base_btf = btf__raw_data(conf_load.base_btf, &raw_base_btf_size);
+		if (raw_base_btf == NULL) {
+			err = -ENOMEM;
+			goto out_free_workers;
+		}
+	}
+
+	for (i = 0; i < nr_workers; ++i) {
+		workers[i].batch = &batch;
+
+		if (raw_base_btf) {
+			workers[i].base_btf = btf__new(raw_base_btf, raw_base_btf_size);
+			if (libbpf_get_error(workers[i].base_btf)) {
+				workers[i].base_btf = NULL;
+				err = -ENOMEM;
+				break;
+			}
+		}
+
+		err = pthread_create(&workers[i].thread, NULL, btf_batch__worker, &workers[i]);
+		if (err) {
+			btf__free(workers[i].base_btf);
+			err = -err;
+			break;
+		}
+	}
+
+	/* If setting up a worker failed, the ones already running still do all the work */
+	if (i == 0)
+		goto out_free_workers;
+	err = 0;
+
+	while (--i >= 0) {
+		pthread_join(workers[i].thread, NULL);
+		btf__free(workers[i].base_btf);
+	}
+
+	if (batch.nr_errors) {
+		fprintf(stderr, "pahole: failed to encode BTF for %d of %d files\n",
+			batch.nr_errors, batch.nr_jobs);
+		err = -1;
+	}
+out_free_workers:
+	free(workers);
+out_free_jobs:
+	for (i = 0; i < batch.nr_jobs; ++i) {
+		free(batch.jobs[i].filename);
+		free(batch.jobs[i].detached_filename);
+	}
+	free(batch.jobs);
+	return err;
+}
+
 static int prototypes__add(struct list_head *prototypes, const char *entry)
 {
 	struct prototype *prototype = prototype__new(entry);
@@ -3403,11 +3721,6 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	if (conf_load.hashtable_bits > 31) {
-		fprintf(stderr, "Invalid --hashbits value (%d) should be less than 32\n", conf_load.hashtable_bits);
-		goto out;
-	}
-
 	if (dwarves__init()) {
 		fputs("pahole: insufficient memory\n", stderr);
 		goto out;
@@ -3415,6 +3728,27 @@ int main(int argc, char *argv[])
 
 	dwarves__resolve_cacheline_size(&conf_load, cacheline_size);
 
+	/*
+	 * The CTF encoder wants the global variables, function bodies are
+	 * only used by the other tools.
+	 */
+	if (btf_encode)
+		conf_load__set_profile(&conf_load, CONF_LOAD_PROFILE__BTF);
+	else if (!ctf_encode)
+		conf_load__set_profile(&conf_load, CONF_LOAD_PROFILE__TYPES);
+
+	/*
+	 * Printing all the classes, the stats, --contains and --find_pointers_to
+	 * keep classes in the structures tree after the CUs they came from are
+	 * deleted, so the tags can't go away with the CU arena in those cases.
+	 */
+	conf_load.use_arena = btf_encode || ctf_encode ||
+			      (class_name != NULL && !find_containers && !find_pointers_in_structs);
+
+	/* The encoders need the ELF file, its symtab, etc, not just the types */
+	if (btf_encode || ctf_encode)
+		conf_load.use_cache = false;
+
 	if (prettify_input_filename) {
 		if (strcmp(prettify_input_filename, "-") == 0) {
 			prettify_input = stdin;
@@ -3441,6 +3775,17 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (btf_encode_batch_list) {
+		if (detached_btf_filename) {
+			fputs("pahole: --btf_encode_detached can't be used with --btf_encode_batch, add the detached file name after each file in the list\n", stderr);
+			goto out_dwarves_exit;
+		}
+
+		if (btf_encode_batch(argv + remaining) == 0)
+			rc = EXIT_SUCCESS;
+		goto out_dwarves_exit;
+	}
+
 	struct cus *cus = cus__new();
 	if (cus == NULL) {
 		fputs("pahole: insufficient memory\n", stderr);
@@ -3450,7 +3795,7 @@ int main(int argc, char *argv[])
 	memset(tab, ' ', sizeof(tab) - 1);
 
 	conf_load.steal = pahole_stealer;
-	conf_load.thread_exit = pahole_thread_exit;
+	conf_load.early_cu_filter = cu__filter;
 	conf_load.threads_prepare = pahole_threads_prepare;
 	conf_load.threads_collect = pahole_threads_collect;
 
@@ -7,6 +7,7 @@
 */
 
 #include <argp.h>
+#include <elfutils/version.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,6 +21,7 @@
 #include "dwarves_emit.h"
 #include "dutil.h"
 #include "elf_symtab.h"
+#include "hash.h"
 
 static int verbose;
 static int show_inline_expansions;
@@ -40,12 +42,14 @@ static struct conf_fprintf conf;
 
 static struct conf_load conf_load = {
 	.conf_fprintf = &conf,
+	.use_arena    = true,
 };
 
 struct fn_stats {
 	struct list_head node;
 	struct tag	 *tag;
 	const struct cu	 *cu;
+	uint32_t	 hash;
 	uint32_t	 nr_expansions;
 	uint32_t	 size_expansions;
 	uint32_t	 nr_files;
@@ -73,16 +77,66 @@ static void fn_stats__delete(struct fn_stats *stats)
 	free(stats);
 }
 
+/*
+ * The list is in the order the stats are printed, the hash table, keyed by
+ * function name, is for fn_stats__find(), that returns the first entry in
+ * the list with that name, i.e. the last one added, as there may be more
+ * than one, see function__filter().
+ */
 static LIST_HEAD(fn_stats__list);
 
+static struct {
+	struct fn_stats **entries;
+	uint32_t	mask;
+	uint32_t	nr_entries;
+} fn_stats__table;
+
+static struct fn_stats **fn_stats__table_slot(const char *name, uint32_t hash)
+{
+	uint32_t i = hash & fn_stats__table.mask;
+
+	for (;; i = (i + 1) & fn_stats__table.mask) {
+		struct fn_stats **slot = &fn_stats__table.entries[i];
+
+		if (*slot == NULL ||
+		    ((*slot)->hash == hash && strcmp(function__name(tag__function((*slot)->tag)), name) == 0))
+			return slot;
+	}
+}
+
+static int fn_stats__table_grow(void)
+{
+	uint32_t i, nr_slots = fn_stats__table.entries ? (fn_stats__table.mask + 1) * 2 : 4096;
+	struct fn_stats **old = fn_stats__table.entries, **entries = calloc(nr_slots, sizeof(*entries));
+
+	if (entries == NULL)
+		return -1;
+
+	for (i = 0; old != NULL && i <= fn_stats__table.mask; ++i) {
+		uint32_t slot;
+
+		if (old[i] == NULL)
+			continue;
+
+		for (slot = old[i]->hash & (nr_slots - 1); entries[slot] != NULL; slot = (slot + 1) & (nr_slots - 1))
+			;
+		entries[slot] = old[i];
+	}
+
+	free(old);
+	fn_stats__table.entries = entries;
+	fn_stats__table.mask = nr_slots - 1;
+	return 0;
+}
+
 static struct fn_stats *fn_stats__find(const char *name)
 {
-	struct fn_stats *pos;
+	size_t len;
 
-	list_for_each_entry(pos, &fn_stats__list, node)
-		if (strcmp(function__name(tag__function(pos->tag)), name) == 0)
-			return pos;
-	return NULL;
+	if (fn_stats__table.entries == NULL)
+		return NULL;
+
+	return *fn_stats__table_slot(name, hash_str(name, &len));
 }
 
 static void fn_stats__delete_list(void)
@@ -93,13 +147,33 @@ static void fn_stats__delete_list(void)
 		list_del_init(&pos->node);
 		fn_stats__delete(pos);
 	}
+
+	zfree(&fn_stats__table.entries);
+	fn_stats__table.mask = fn_stats__table.nr_entries = 0;
 }
 
 static void fn_stats__add(struct tag *tag, const struct cu *cu)
 {
-	struct fn_stats *fns = fn_stats__new(tag, cu);
-	if (fns != NULL)
-		list_add(&fns->node, &fn_stats__list);
+	const char *name = function__name(tag__function(tag));
+	struct fn_stats **slot, *fns;
+	size_t len;
+
+	if ((fn_stats__table.entries == NULL ||
+	     (fn_stats__table.nr_entries + 1) * 4 > (fn_stats__table.mask + 1) * 3) &&
+	    fn_stats__table_grow() != 0)
+		return;
+
+	fns = fn_stats__new(tag, cu);
+	if (fns == NULL)
+		return;
+
+	fns->hash = hash_str(name, &len);
+	list_add(&fns->node, &fn_stats__list);
+
+	slot = fn_stats__table_slot(name, fns->hash);
+	if (*slot == NULL)
+		++fn_stats__table.nr_entries;
+	*slot = fns;
 }
 
 static void fn_stats_inline_exps_fmtr(const struct fn_stats *stats)
@@ -514,6 +588,7 @@ ARGP_PROGRAM_VERSION_HOOK_DEF = dwarves_print_version;
 #define ARGP_symtab		300
 #define ARGP_no_parm_names	301
 #define ARGP_compile		302
+#define ARGP_cache		303
 
 static const struct argp_option pfunct__options[] = {
 	{
@@ -575,6 +650,13 @@ static const struct argp_option pfunct__options[] = {
 		.name = "inline_expansions_stats",
 		.doc  = "show inline expansions stats",
 	},
+	{
+		.name  = "jobs",
+		.key   = 'j',
+		.arg   = "NR_JOBS",
+		.flags = OPTION_ARG_OPTIONAL, // Use sysconf(_SC_NPROCESSORS_ONLN) * 1.1 by default
+		.doc   = "run N jobs in parallel [default to number of online processors + 10%]",
+	},
 	{
 		.key  = 'l',
 		.name = "decl_info",
@@ -639,6 +721,13 @@ static const struct argp_option pfunct__options[] = {
 		.key   = ARGP_no_parm_names,
 		.doc   = "Don't show parameter names",
 	},
+	{
+		.name  = "cache",
+		.key   = ARGP_cache,
+		.arg   = "DIR",
+		.flags = OPTION_ARG_OPTIONAL,
+		.doc   = "Cache what is loaded from DWARF, keyed by build-id [default: $XDG_CACHE_HOME/dwarves]",
+	},
 	{
 		.name = NULL,
 	}
@@ -676,6 +765,20 @@ static error_t pfunct__options_parser(int key, char *arg,
 		  conf_load.get_addr_info = true;	 break;
 	case 'I': formatter = fn_stats_inline_exps_fmtr;
 		  conf_load.get_addr_info = true;	 break;
+	case 'j':
+#if _ELFUTILS_PREREQ(0, 178)
+		  conf_load.nr_jobs = arg ? atoi(arg) :
+					    sysconf(_SC_NPROCESSORS_ONLN) * 1.1;
+		  /*
+		   * Load in parallel, but keep pfunct_stealer() and the cus
+		   * list seeing the CUs in file order, so that the output is the
+		   * same as when loading serially.
+		   */
+		  conf_load.in_order_steal = true;
+#else
+		  fputs("pfunct: Multithreading requires elfutils >= 0.178. Continuing with a single thread...\n", stderr);
+#endif
+							 break;
 	case 'l': conf.show_decl_info = 1;
 		  conf_load.extra_dbg_info = 1;		 break;
 	case 't': show_total_inline_expansion_stats = true;
@@ -687,6 +790,9 @@ static error_t pfunct__options_parser(int key, char *arg,
 		  conf_load.get_addr_info = true;	 break;
 	case ARGP_symtab: symtab_name = arg ?: ".symtab";  break;
 	case ARGP_no_parm_names: conf.no_parm_names = 1; break;
+	case ARGP_cache:
+		  conf_load.use_cache = true;
+		  conf_load.cache_dir = arg;		 break;
 	case ARGP_compile:
 		  expand_types = true;
 		  type_emissions__init(&emissions, &conf);
@@ -23,6 +23,7 @@ static struct conf_fprintf conf = {
 
 static struct conf_load conf_load = {
 	.conf_fprintf = &conf,
+	.use_arena    = true,
 };
 
 struct extvar {